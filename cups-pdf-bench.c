@@ -0,0 +1,1259 @@
+/* cups-pdf-bench.c -- benchmark for the CUPS-PDF postscript line scanner
+
+   This code may be freely distributed as long as this header
+   is preserved.
+
+   This code is distributed under the GPL.
+   (http://www.gnu.org/copyleft/gpl.html)
+
+   For more detailed licensing information see cups-pdf.c in the
+   corresponding version number.
+
+   ---------------------------------------------------------------------------
+
+   Runs the postscript extraction of cups-pdf.c over synthetic or given
+   input and compares it with the former byte-at-a-time fgets2() scanner:
+   both have to produce identical spool data, the throughput of both is
+   reported for traditional and FixNewlines line splitting.
+
+   With -p it runs the backend pipeline instead, without CUPS and without
+   root: a temporary directory holds the configuration (plus any -s
+   settings), spool and output directories, the job belongs to a made-up
+   user with the caller's uid and a stub converter copies the spool file.
+   Synthetic postscript, PJL wrapped postscript and PDF jobs of several
+   sizes (plus any given files) go through the spooling (including the
+   title lookup), title preparation and output placement stages; their
+   throughput (calls per second for title preparation, which does not read
+   the input) and p50/p99 latencies are written to stdout as JSON.
+
+   With -l it puts load on a real backend binary as root, simulating a
+   burst of print jobs from CUPS: for every concurrency level the given
+   number of jobs is run with CUPS' argv and environment against a
+   sandboxed configuration (/etc/cups/cups-pdf-load-<pid>.conf, removed
+   afterwards), spool and output tree. Users, job sizes, the share of PDF
+   jobs and a postprocessing delay are chosen per run; half of the jobs
+   come through a pipe from a feeder process like from a CUPS filter.
+   Jobs per second, latency percentiles, peak spool usage and peak RSS
+   per level are written to stdout as JSON, together with the level from
+   which more concurrent backends no longer raise the job rate.
+
+   With -R it replays jobs captured by the backend (see Capture in
+   cups-pdf.conf) through a real backend binary as root, one after the
+   other or with -t at their original inter-arrival times. Every job runs
+   with its captured argv, environment and configuration, but spool, log,
+   output, cache and lock paths are moved into a temporary directory and
+   postprocessing is skipped unless -k is given. The duration, exit code
+   and RSS of every job and their percentiles are written as JSON.
+
+   Build: gcc -O2 -o cups-pdf-bench cups-pdf-bench.c -lcups -lz -lpthread
+   Usage: cups-pdf-bench [-m megabytes] [-r rounds] [file ...]
+          cups-pdf-bench -p [-n iterations] [-s "Key value"] ... [file ...]
+          cups-pdf-bench -l backend [-c levels] [-j jobs] [-u users] [-z sizes]
+                         [-f pdf-percent] [-d postprocessing-ms] [-s "Key value"] ...
+          cups-pdf-bench -R backend [-t] [-k] [-s "Key value"] ... capture ...
+*/
+
+#define main cups_pdf_main
+#include "cups-pdf.c"
+#undef main
+
+#include <time.h>
+#include <ftw.h>
+
+#define BENCH_MEGABYTES 64
+#define BENCH_ROUNDS 5
+#define BENCH_ITERATIONS 25
+#define BENCH_SETTINGS 32
+#define BENCH_INPUTS 64
+#define LOAD_LEVELS "1,2,4,8,16"
+#define LOAD_JOBS 64
+#define LOAD_SIZES "16k,256k,4m"
+#define LOAD_PDF_PERCENT 30
+#define LOAD_LIST 32                    /* users, sizes and levels */
+#define LOAD_SATURATION 110             /* percent the job rate has to rise */
+#define LOAD_POLL 2000                  /* microseconds between spool samples */
+#define REPLAY_ENVIRONMENT 24
+
+enum benchStages { B_SPOOL, B_TITLE, B_OUTPUT, END_OF_BENCH_STAGES };
+
+static const char *bench_stage_names[] = { "spool", "title", "output" };
+
+struct bench_input {
+  char name[64];
+  cp_string path;
+  off_t size;
+};
+
+struct load_job {
+  pid_t pid, feeder;
+  double start;
+};
+
+struct load_level {
+  int concurrency, jobs, failed;
+  double seconds, p50, p95, p99, max;
+  long long peak_spool;
+  long peak_rss;
+};
+
+struct replay_job {
+  cp_string capture;            /* directory of the captured job */
+  char *argdata, *envdata, *args[8], *env[REPLAY_ENVIRONMENT];
+  int nargs, nenv, status;
+  double arrival, start, seconds;       /* arrival: after the first job */
+  long long bytes;
+  long rss;
+  pid_t pid, feeder;
+};
+
+static cp_string bench_dir;
+static struct passwd bench_passwd;
+
+
+static char *legacy_fgets2(char *fbuffer, int fbufsize, FILE *ffpsrc) {
+  /* fgets2() as it was before the block reader */
+  int c, pos;
+  char *result;
+
+  if (!Conf_FixNewlines)
+    return fgets(fbuffer, fbufsize, ffpsrc);
+
+  result=NULL;
+  pos=0;
+
+  while (pos < fbufsize) {
+    c=fgetc(ffpsrc);
+    if (c == EOF)
+      break;
+    fbuffer[pos++]=c;
+    if (c == 0x0A || c == 0x0C || c == 0x0D)
+      break;
+  }
+
+  if (pos > 0 && !ferror(ffpsrc)) {
+    fbuffer[pos]='\0';
+    result=fbuffer;
+  }
+
+  return result;
+}
+
+static void legacy_extract(FILE *fpsrc, FILE *fpdest) {
+  /* the former extract_postscript() loop including its DSC checks */
+  char buffer[BUFSIZE+1];
+  cp_string title;
+  int depth=0, search=1;
+
+  while (legacy_fgets2(buffer, BUFSIZE, fpsrc) != NULL) {
+    (void) fputs(buffer, fpdest);
+    if (search && !depth)
+      if (sscanf(buffer, "%%%%Title: %"TBUFSIZE"c", title)==1)
+        search=0;
+    if (!strncmp(buffer, "%!", 2))
+      depth++;
+    else if (!strncmp(buffer, "%%EOF", 5)) {
+      if (!depth)
+        return;
+      depth--;
+    }
+  }
+  return;
+}
+
+static void current_extract(FILE *fpsrc, FILE *fpdest) {
+  cp_string title;
+
+  ps_rec_depth=0;
+  index_init();
+  if (reader_open(&src_reader, fileno(fpsrc))) {
+    fputs("cups-pdf-bench: out of memory\n", stderr);
+    exit(1);
+  }
+  (void) extract_postscript(fpdest, title, 0);
+  reader_close(&src_reader);
+  return;
+}
+
+static int generate_input(FILE *fp, long size) {
+  /* postscript with the usual mix of short code lines, long hex image
+     data, embedded EPS and a few CR and FF delimited lines */
+  char hexline[6001];
+  long written=0;
+  int page=0, i;
+
+  written+=fprintf(fp, "%%!PS-Adobe-3.0\n%%%%Title: benchmark\n%%%%EndComments\n");
+  while (written < size) {
+    written+=fprintf(fp, "%%%%Page: %d %d\nsave\n", page+1, page+1);
+    for (i=0; i<200; i++)
+      written+=fprintf(fp, "%d %d moveto (line %d of page %d) show\n", 72, 720-3*i, i, page);
+    written+=fprintf(fp, "gsave 0 0 translate\r1 setgray\f");
+    for (i=0; i<40; i++) {
+      memset(hexline, 'a'+(i%6), (i%8)?72:sizeof(hexline)-1);
+      hexline[(i%8)?72:sizeof(hexline)-1]='\0';
+      written+=fprintf(fp, "%s\n", hexline);
+    }
+    if (page%10 == 0)
+      written+=fprintf(fp, "%%%%BeginDocument: inc.eps\n%%!PS-Adobe-3.0 EPSF-3.0\n"
+                           "0 0 moveto\n%%%%EOF\n%%%%EndDocument\n");
+    written+=fprintf(fp, "grestore restore showpage\n");
+    page++;
+  }
+  written+=fprintf(fp, "%%%%Trailer\n%%%%EOF\n");
+  return ferror(fp);
+}
+
+static int generate_pjl(FILE *fp, long size) {
+  /* postscript as it comes from drivers that wrap jobs into PJL */
+  fprintf(fp, "\033%%-12345X@PJL JOB NAME=\"benchmark\"\r\n@PJL SET RESOLUTION=600\r\n"
+              "@PJL ENTER LANGUAGE=POSTSCRIPT\r\n");
+  if (generate_input(fp, size))
+    return 1;
+  fprintf(fp, "\033%%-12345X@PJL EOJ NAME=\"benchmark\"\r\n\033%%-12345X");
+  return ferror(fp);
+}
+
+static const char xmp_packet[]=
+  "<?xpacket begin=\"\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>\n"
+  "<x:xmpmeta xmlns:x=\"adobe:ns:meta/\"><rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">"
+  "<rdf:Description xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:title><rdf:Alt>"
+  "<rdf:li xml:lang=\"x-default\">benchmark &amp; r&#xE9;sum&#233; &#65</rdf:li>"
+  "</rdf:Alt></dc:title></rdf:Description></rdf:RDF></x:xmpmeta>\n"
+  "<?xpacket end=\"w\"?>";
+
+static int generate_pdf(FILE *fp, long size) {
+  /* an uncompressed PDF with a classic xref table, titled only by XMP
+     metadata whose title ends in a reference without ';' */
+  char content[16384];
+  long *offsets=NULL, *tmp;
+  long written, xref;
+  int nobjects=3, allocated=0, page, len, i;
+
+  written=fprintf(fp, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n");
+  for (page=0; written < size || !page; page++) {
+    if (nobjects+2 >= allocated) {
+      allocated=2*allocated+64;
+      tmp=realloc(offsets, allocated*sizeof(long));
+      if (tmp == NULL) {
+        free(offsets);
+        return 1;
+      }
+      offsets=tmp;
+    }
+    offsets[++nobjects]=written;
+    written+=fprintf(fp, "%d 0 obj\n<< /Type /Page /Parent 2 0 R /MediaBox [0 0 612 792] "
+                         "/Contents %d 0 R >>\nendobj\n", nobjects, nobjects+1);
+    for (len=0, i=0; i<200; i++)
+      len+=snprintf(content+len, sizeof(content)-len, "BT 72 %d Td (line %d of page %d) Tj ET\n",
+                    720-3*i, i, page+1);
+    offsets[++nobjects]=written;
+    written+=fprintf(fp, "%d 0 obj\n<< /Length %d >>\nstream\n%s\nendstream\nendobj\n",
+                     nobjects, len, content);
+  }
+  offsets[1]=written;
+  written+=fprintf(fp, "1 0 obj\n<< /Type /Catalog /Pages 2 0 R /Metadata 3 0 R >>\nendobj\n");
+  offsets[2]=written;
+  written+=fprintf(fp, "2 0 obj\n<< /Type /Pages /Count %d /Kids [", page);
+  for (i=4; i<=nobjects; i+=2)
+    written+=fprintf(fp, " %d 0 R", i);
+  written+=fprintf(fp, " ] >>\nendobj\n");
+  offsets[3]=written;
+  written+=fprintf(fp, "3 0 obj\n<< /Type /Metadata /Subtype /XML /Length %d >>\nstream\n%s\nendstream\nendobj\n",
+                   (int) strlen(xmp_packet), xmp_packet);
+  xref=written;
+  fprintf(fp, "xref\n0 %d\n0000000000 65535 f \n", nobjects+1);
+  for (i=1; i<=nobjects; i++)
+    fprintf(fp, "%010ld 00000 n \n", offsets[i]);
+  fprintf(fp, "trailer\n<< /Size %d /Root 1 0 R >>\nstartxref\n%ld\n%%%%EOF\n",
+          nobjects+1, xref);
+  free(offsets);
+  return ferror(fp);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static double run(void (*extract)(FILE *, FILE *), FILE *input, FILE *output) {
+  double start;
+
+  rewind(input);
+  (void) lseek(fileno(input), 0, SEEK_SET);
+  rewind(output);
+  (void) ftruncate(fileno(output), 0);
+  start=now();
+  extract(input, output);
+  (void) fflush(output);
+  return now()-start;
+}
+
+static int same_content(FILE *a, FILE *b) {
+  char bufa[BUFSIZE], bufb[BUFSIZE];
+  size_t na, nb;
+
+  rewind(a);
+  rewind(b);
+  do {
+    na=fread(bufa, 1, BUFSIZE, a);
+    nb=fread(bufb, 1, BUFSIZE, b);
+    if (na != nb || memcmp(bufa, bufb, na))
+      return 0;
+  } while (na > 0);
+  return 1;
+}
+
+static int bench(const char *name, FILE *input, int rounds) {
+  FILE *legacy, *current;
+  struct stat fstatus;
+  double t, tlegacy, tcurrent, mb;
+  int fix, r, failed=0;
+
+  if (fstat(fileno(input), &fstatus))
+    return 1;
+  mb=fstatus.st_size/1048576.0;
+  legacy=tmpfile();
+  current=tmpfile();
+  if (legacy == NULL || current == NULL) {
+    fputs("cups-pdf-bench: failed to create temporary files\n", stderr);
+    return 1;
+  }
+  for (fix=0; fix<=1; fix++) {
+    Conf_FixNewlines=fix;
+    tlegacy=tcurrent=-1;
+    for (r=0; r<rounds; r++) {
+      t=run(legacy_extract, input, legacy);
+      if (tlegacy < 0 || t < tlegacy)
+        tlegacy=t;
+      t=run(current_extract, input, current);
+      if (tcurrent < 0 || t < tcurrent)
+        tcurrent=t;
+    }
+    r=same_content(legacy, current);
+    printf("%-24s %-12s %8.1f MB  fgets2 %8.1f MB/s  block reader %8.1f MB/s  (x%.1f) %s\n",
+           name, (fix)?"FixNewlines":"traditional", mb, mb/tlegacy, mb/tcurrent,
+           tlegacy/tcurrent, (r)?"identical":"OUTPUT DIFFERS");
+    if (!r)
+      failed=1;
+  }
+  (void) fclose(legacy);
+  (void) fclose(current);
+  return failed;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftwbuf) {
+  (void) sb;
+  (void) flag;
+  (void) ftwbuf;
+  return remove(path);
+}
+
+static int pipeline_setup(char *settings[], int nsettings) {
+  /* the configuration of a temporary cups-pdf installation and a user
+     that does not need a passwd entry */
+  cp_string conffile;
+  FILE *fp;
+  int i;
+
+  if (build_path(bench_dir, "%s/cups-pdf-bench-XXXXXX", (getenv("TMPDIR") != NULL)?getenv("TMPDIR"):"/tmp") ||
+      mkdtemp(bench_dir) == NULL)
+    return 1;
+  fp=(build_path(conffile, "%s/cups-pdf.conf", bench_dir))?NULL:fopen(conffile, "w");
+  if (fp == NULL)
+    return 1;
+  fprintf(fp, "Out %s/out/${USER}\nAnonDirName %s/out/ANONYMOUS\nSpool %s/spool\n",
+          bench_dir, bench_dir, bench_dir);
+  for (i=0; i<nsettings; i++)
+    fprintf(fp, "%s\n", settings[i]);
+  if (fclose(fp))
+    return 1;
+  read_config_file(conffile);
+  if (create_dir(Conf_Spool, 1))
+    return 1;
+
+  bench_passwd.pw_name="bench";
+  bench_passwd.pw_passwd="x";
+  bench_passwd.pw_uid=getuid();
+  bench_passwd.pw_gid=getgid();
+  bench_passwd.pw_gecos="cups-pdf benchmark";
+  bench_passwd.pw_dir=bench_dir;
+  bench_passwd.pw_shell="/bin/sh";
+  return 0;
+}
+
+static int stub_convert(FILE *fpsrc, char *spoolfile, char *outfile) {
+  /* stands in for GhostScript: the spool file or stream becomes the output */
+  struct stat fstatus;
+  int fdin, fdout, result;
+
+  if (input_is_pdf)
+    return passthrough_pdf(fpsrc, outfile);
+  fdout=open(outfile, O_WRONLY|O_CREAT|O_EXCL, 0600);
+  if (fdout < 0)
+    return 1;
+  if (input_is_streamed) {
+    stream_postscript(fpsrc, fdout);
+    return 0;
+  }
+  fdin=(spool_memfd >= 0)?spool_memfd:open(spoolfile, O_RDONLY);
+  result=(fdin < 0 || fstat(fdin, &fstatus) || copy_file_data(fdin, 0, fstatus.st_size, fdout));
+  if (fdin >= 0 && fdin != spool_memfd)
+    (void) close(fdin);
+  return close(fdout) || result;
+}
+
+static int pipeline_job(struct bench_input *input, int job, double *times) {
+  /* runs one job through the stages as backend() does, timing each */
+  cp_string spoolfile, title, cmdtitle;
+  char *dirname, *outfile;
+  FILE *fpsrc;
+  double start;
+  size_t size;
+  int failed=0;
+
+  input_is_pdf=0;
+  input_is_streamed=0;
+  pdf_offset=-1;
+  ps_finished=0;
+  spool_compressed=0;
+  if (build_path(spoolfile, "%s/cups2pdf-%d", Conf_Spool, job))
+    return 1;
+  snprintf(cmdtitle, BUFSIZE, "smbprn.%08d Microsoft Word - (%s) \\\\server\\share\\report.doc", job, input->name);
+  title[0]='\0';
+
+  start=now();
+  fpsrc=fopen(input->path, "r");
+  if (preparespoolfile(fpsrc, spoolfile, title, cmdtitle, job, &bench_passwd))
+    return 1;
+  times[B_SPOOL]=now()-start;
+
+  start=now();
+  (void) preparetitle(cmdtitle);
+  times[B_TITLE]=now()-start;
+
+  start=now();
+  dirname=preparedirname(&bench_passwd, bench_passwd.pw_name);
+  if (dirname == NULL || prepareuser(&bench_passwd, dirname))
+    failed=1;
+  else {
+    size=strlen(dirname)+strlen(title)+strlen(Conf_OutExtension)+3;
+    outfile=calloc(size, sizeof(char));
+    if (outfile == NULL)
+      failed=1;
+    else {
+      snprintf(outfile, size, "%s/%s.%s", dirname, title, Conf_OutExtension);
+      (void) unlink(outfile);
+      failed=(stub_convert(fpsrc, spoolfile, outfile) || chmod(outfile, 0600));
+      free(outfile);
+    }
+  }
+  times[B_OUTPUT]=now()-start;
+
+  free(dirname);
+  reader_close(&src_reader);
+  if (input_is_pdf)
+    (void) fclose(fpsrc);
+  else if (!input_is_streamed)
+    (void) remove_spoolfile(spoolfile);
+  return failed;
+}
+
+static int compare_times(const void *a, const void *b) {
+  double x=*(const double *)a, y=*(const double *)b;
+
+  return (x > y)-(x < y);
+}
+
+static double percentile(double *samples, int n, int pct) {
+  /* nearest rank of sorted samples */
+  int rank=(n*pct+99)/100;
+
+  return samples[(rank > 0)?rank-1:0];
+}
+
+static int pipeline_run(struct bench_input *input, int iterations, int first) {
+  double *samples, times[END_OF_BENCH_STAGES], total;
+  int stage, i, failed=0;
+
+  samples=calloc((size_t) iterations*END_OF_BENCH_STAGES, sizeof(double));
+  if (samples == NULL)
+    return 1;
+  for (i=0; i<iterations && !failed; i++) {
+    failed=pipeline_job(input, i+1, times);
+    for (stage=0; stage<END_OF_BENCH_STAGES; stage++)
+      samples[stage*iterations+i]=times[stage];
+  }
+  if (failed) {
+    fprintf(stderr, "cups-pdf-bench: pipeline failed for %s\n", input->name);
+    free(samples);
+    return 1;
+  }
+
+  printf("%s\n  {\"name\":", (first)?"":",");
+  json_string(stdout, input->name);
+  printf(",\"type\":\"%s\",\"bytes\":%lld,\"stages\":{",
+         (input_is_pdf)?"pdf":((input_is_streamed)?"postscript-streamed":"postscript"),
+         (long long) input->size);
+  for (stage=0; stage<END_OF_BENCH_STAGES; stage++) {
+    for (total=0, i=0; i<iterations; i++)
+      total+=samples[stage*iterations+i];
+    qsort(samples+stage*iterations, iterations, sizeof(double), compare_times);
+    /* title preparation does not depend on the input size */
+    if (stage == B_TITLE)
+      printf("%s\"%s\":{\"calls_s\":%.0f,", (stage)?",":"", bench_stage_names[stage],
+             (total > 0)?iterations/total:0);
+    else
+      printf("%s\"%s\":{\"mb_s\":%.1f,", (stage)?",":"", bench_stage_names[stage],
+             (total > 0)?input->size*iterations/total/1048576:0);
+    printf("\"p50_ms\":%.4f,\"p99_ms\":%.4f}",
+           percentile(samples+stage*iterations, iterations, 50)*1000,
+           percentile(samples+stage*iterations, iterations, 99)*1000);
+  }
+  printf("}}");
+  free(samples);
+  return 0;
+}
+
+static int add_input(struct bench_input *inputs, int *ninputs, const char *name,
+                     const char *path, int (*generate)(FILE *, long), long size) {
+  /* generates a synthetic input, or just takes path if generate is NULL */
+  struct bench_input *input=inputs+*ninputs;
+  struct stat fstatus;
+  FILE *fp;
+
+  if (*ninputs >= BENCH_INPUTS)
+    return 1;
+  snprintf(input->name, sizeof(input->name), "%s", name);
+  if (generate == NULL)
+    snprintf(input->path, BUFSIZE, "%s", path);
+  else {
+    fp=(build_path(input->path, "%s/%s", bench_dir, name))?NULL:fopen(input->path, "w");
+    if (fp == NULL || generate(fp, size) || fclose(fp)) {
+      fprintf(stderr, "cups-pdf-bench: failed to generate %s\n", name);
+      return 1;
+    }
+  }
+  if (stat(input->path, &fstatus)) {
+    fprintf(stderr, "cups-pdf-bench: failed to open %s\n", input->path);
+    return 1;
+  }
+  input->size=fstatus.st_size;
+  (*ninputs)++;
+  return 0;
+}
+
+static int pipeline(char *files[], int nfiles, char *settings[], int nsettings, int iterations) {
+  static const long sizes[] = { 16384, 1048576, 8388608 };
+  static const char *size_names[] = { "small", "medium", "large" };
+  struct bench_input inputs[BENCH_INPUTS];
+  cp_string name;
+  int ninputs=0, failed=0, i;
+
+  if (pipeline_setup(settings, nsettings)) {
+    fprintf(stderr, "cups-pdf-bench: failed to set up %s\n", bench_dir);
+    return 1;
+  }
+  for (i=0; i<3 && !failed; i++) {
+    snprintf(name, BUFSIZE, "ps-%s", size_names[i]);
+    failed|=add_input(inputs, &ninputs, name, NULL, generate_input, sizes[i]);
+    snprintf(name, BUFSIZE, "pjl-%s", size_names[i]);
+    failed|=add_input(inputs, &ninputs, name, NULL, generate_pjl, sizes[i]);
+    snprintf(name, BUFSIZE, "pdf-%s", size_names[i]);
+    failed|=add_input(inputs, &ninputs, name, NULL, generate_pdf, sizes[i]);
+  }
+  for (i=0; i<nfiles && !failed; i++)
+    failed|=add_input(inputs, &ninputs, files[i], files[i], NULL, 0);
+
+  if (!failed) {
+    printf("{\"benchmark\":\"pipeline\",\"iterations\":%d,\"settings\":[", iterations);
+    for (i=0; i<nsettings; i++) {
+      printf("%s", (i)?",":"");
+      json_string(stdout, settings[i]);
+    }
+    printf("],\"inputs\":[");
+    for (i=0; i<ninputs && !failed; i++)
+      failed=pipeline_run(inputs+i, iterations, !i);
+    printf("\n]}\n");
+  }
+  (void) nftw(bench_dir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+  return failed;
+}
+
+static int split_list(char *list, char *items[]) {
+  char *item, *save=NULL;
+  int n=0;
+
+  for (item=strtok_r(list, ",", &save); item != NULL && n < LOAD_LIST; item=strtok_r(NULL, ",", &save))
+    items[n++]=item;
+  return n;
+}
+
+static long parse_size(const char *size) {
+  char *end;
+  long value=strtol(size, &end, 10);
+
+  if (*end == 'k' || *end == 'K')
+    value*=1024;
+  else if (*end == 'm' || *end == 'M')
+    value*=1048576;
+  return value;
+}
+
+static int load_setup(char *uri, char *conffile, char *settings[], int nsettings, int delay) {
+  /* a sandboxed configuration for the backend and the script delaying
+     postprocessing */
+  cp_string script;
+  FILE *fp;
+  int i;
+
+  if (build_path(bench_dir, "%s/cups-pdf-load-XXXXXX", (getenv("TMPDIR") != NULL)?getenv("TMPDIR"):"/tmp") ||
+      mkdtemp(bench_dir) == NULL || chmod(bench_dir, 0755))
+    return 1;
+  snprintf(uri, BUFSIZE, "cups-pdf:/load-%d", (int) getpid());
+  snprintf(conffile, BUFSIZE, "%s/cups-pdf-load-%d.conf", CP_CONFIG_PATH, (int) getpid());
+  if (delay > 0) {
+    fp=(build_path(script, "%s/postprocess", bench_dir))?NULL:fopen(script, "w");
+    if (fp == NULL)
+      return 1;
+    fprintf(fp, "#!/bin/sh\nsleep %d.%03d\n", delay/1000, delay%1000);
+    if (fclose(fp) || chmod(script, 0755))
+      return 1;
+  }
+  fp=fopen(conffile, "w");
+  if (fp == NULL)
+    return 1;
+  fprintf(fp, "Out %s/out/${USER}\nAnonDirName %s/out/ANONYMOUS\nSpool %s/spool\nLog %s/log\n"
+              "ConverterLocks %s/slots\n", bench_dir, bench_dir, bench_dir, bench_dir, bench_dir);
+  if (delay > 0)
+    fprintf(fp, "PostProcessing %s\n", script);
+  for (i=0; i<nsettings; i++)
+    fprintf(fp, "%s\n", settings[i]);
+  return (fclose(fp) != 0);
+}
+
+static pid_t spawn_backend(char *backend, char *args[], char *envp[], char *path, pid_t *feeder) {
+  /* starts the backend as CUPS does; with path set, the job is piped in
+     from that file by a feeder */
+  cp_string buffer;
+  ssize_t count;
+  pid_t pid;
+  int pipefd[2], fd, piped=(path != NULL);
+
+  *feeder=-1;
+  if (piped && pipe(pipefd))
+    return -1;
+  pid=fork();
+  if (!pid) {
+    fd=open("/dev/null", O_RDWR);
+    (void) dup2((piped)?pipefd[0]:fd, STDIN_FILENO);
+    (void) dup2(fd, STDOUT_FILENO);
+    (void) dup2(fd, STDERR_FILENO);
+    if (piped) {
+      (void) close(pipefd[0]);
+      (void) close(pipefd[1]);
+    }
+    if (fd > STDERR_FILENO)
+      (void) close(fd);
+    execve(backend, args, envp);
+    _exit(127);
+  }
+  if (!piped)
+    return pid;
+  (void) close(pipefd[0]);
+  if (pid > 0 && !(*feeder=fork())) {
+    fd=open(path, O_RDONLY);
+    while (fd >= 0 && (count=read(fd, buffer, BUFSIZE)) > 0)
+      if (write_all(pipefd[1], buffer, count))
+        break;
+    _exit(0);
+  }
+  (void) close(pipefd[1]);
+  return pid;
+}
+
+static pid_t load_spawn(char *backend, char *uri, int job, char *user, char *path, pid_t *feeder) {
+  /* odd jobs are piped in, the others are passed as a file */
+  char jobid[16], title[64];
+  char *args[]={ uri, jobid, user, title, "1", "number-up=1 job-originating-host-name=localhost",
+                 path, NULL };
+
+  snprintf(jobid, sizeof(jobid), "%d", job);
+  snprintf(title, sizeof(title), "Microsoft Word - report-%d.doc", job);
+  if (job%2) {
+    args[6]=NULL;
+    return spawn_backend(backend, args, environ, path, feeder);
+  }
+  return spawn_backend(backend, args, environ, NULL, feeder);
+}
+
+static long long spool_usage(const char *dirname) {
+  /* bytes in the spool directory right now */
+  struct dirent *entry;
+  struct stat fstatus;
+  long long total=0;
+  DIR *dir;
+  int fd;
+
+  dir=opendir(dirname);
+  if (dir == NULL)
+    return 0;
+  fd=dirfd(dir);
+  while ((entry=readdir(dir)) != NULL)
+    if (!fstatat(fd, entry->d_name, &fstatus, AT_SYMLINK_NOFOLLOW) && S_ISREG(fstatus.st_mode))
+      total+=fstatus.st_size;
+  (void) closedir(dir);
+  return total;
+}
+
+static int load_level(struct load_level *level, char *backend, char *uri, char *users[], int nusers,
+                      struct bench_input *inputs, int ninputs, int pdf_percent, int *jobid) {
+  /* runs level->jobs jobs with at most level->concurrency backends at a time */
+  struct load_job *jobs;
+  struct rusage usage;
+  cp_string spooldir, outdir;
+  double *latencies, start;
+  long long spool;
+  pid_t pid;
+  int started=0, finished=0, measured=0, running=0, status, input, i;
+
+  jobs=calloc(level->jobs, sizeof(struct load_job));
+  latencies=calloc(level->jobs, sizeof(double));
+  if (jobs == NULL || latencies == NULL ||
+      build_path(spooldir, "%s/spool", bench_dir) || build_path(outdir, "%s/out", bench_dir)) {
+    free(jobs);
+    free(latencies);
+    return 1;
+  }
+  start=now();
+  while (finished < level->jobs) {
+    while (running < level->concurrency && started < level->jobs) {
+      /* inputs are PDF and postscript of each size in turn */
+      input=2*(rand()%(ninputs/2))+((rand()%100 < pdf_percent)?1:0);
+      jobs[started].start=now();
+      jobs[started].pid=load_spawn(backend, uri, ++(*jobid), users[rand()%nusers],
+                                   inputs[input].path, &jobs[started].feeder);
+      if (jobs[started++].pid > 0)
+        running++;
+      else {
+        level->failed++;
+        finished++;
+      }
+    }
+    pid=wait4(-1, &status, WNOHANG, &usage);
+    if (pid <= 0) {
+      spool=spool_usage(spooldir);
+      if (spool > level->peak_spool)
+        level->peak_spool=spool;
+      (void) usleep(LOAD_POLL);
+      continue;
+    }
+    for (i=0; i<started; i++)
+      if (jobs[i].pid == pid)
+        break;
+    if (i == started)
+      continue;
+    latencies[measured++]=now()-jobs[i].start;
+    finished++;
+    running--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      level->failed++;
+    if (usage.ru_maxrss > level->peak_rss)
+      level->peak_rss=usage.ru_maxrss;
+  }
+  level->seconds=now()-start;
+  while (wait(NULL) > 0);
+
+  if (measured) {
+    qsort(latencies, measured, sizeof(double), compare_times);
+    level->p50=percentile(latencies, measured, 50);
+    level->p95=percentile(latencies, measured, 95);
+    level->p99=percentile(latencies, measured, 99);
+    level->max=latencies[measured-1];
+  }
+  free(jobs);
+  free(latencies);
+  (void) nftw(outdir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+  return 0;
+}
+
+static int load(char *backend, const char *levellist, int njobs, const char *userlist,
+                const char *sizelist, int pdf_percent, int delay, char *settings[], int nsettings) {
+  struct bench_input inputs[2*LOAD_LIST];
+  struct load_level levels[LOAD_LIST];
+  char *users[LOAD_LIST], *sizes[LOAD_LIST], *items[LOAD_LIST];
+  cp_string uri, conffile, name, levelbuf, userbuf, sizebuf;
+  int nlevels, nusers, nsizes, ninputs=0, jobid=0, saturation=0, failed=0, i;
+
+  if (geteuid()) {
+    fputs("cups-pdf-bench: the load test has to run as root, just like the backend\n", stderr);
+    return 1;
+  }
+  snprintf(levelbuf, BUFSIZE, "%s", levellist);
+  snprintf(userbuf, BUFSIZE, "%s", userlist);
+  snprintf(sizebuf, BUFSIZE, "%s", sizelist);
+  nlevels=split_list(levelbuf, items);
+  for (i=0; i<nlevels; i++) {
+    memset(levels+i, 0, sizeof(struct load_level));
+    levels[i].concurrency=(atoi(items[i]) > 0)?atoi(items[i]):1;
+    levels[i].jobs=njobs;
+  }
+  nusers=split_list(userbuf, users);
+  nsizes=split_list(sizebuf, sizes);
+  if (!nlevels || !nusers || !nsizes) {
+    fputs("cups-pdf-bench: empty list of levels, users or sizes\n", stderr);
+    return 1;
+  }
+  if (load_setup(uri, conffile, settings, nsettings, delay)) {
+    fprintf(stderr, "cups-pdf-bench: failed to set up %s and %s\n", bench_dir, conffile);
+    (void) unlink(conffile);
+    (void) nftw(bench_dir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+    return 1;
+  }
+  for (i=0; i<nsizes && !failed; i++) {
+    snprintf(name, BUFSIZE, "job-%s.ps", sizes[i]);
+    failed|=add_input(inputs, &ninputs, name, NULL, generate_input, parse_size(sizes[i]));
+    snprintf(name, BUFSIZE, "job-%s.pdf", sizes[i]);
+    failed|=add_input(inputs, &ninputs, name, NULL, generate_pdf, parse_size(sizes[i]));
+  }
+
+  (void) setenv("PRINTER", uri+strlen("cups-pdf:/"), 1);
+  (void) setenv("DEVICE_URI", uri, 1);
+  (void) setenv("PPD", "/nonexistent", 1);
+  srand(1);
+  for (i=0; i<nlevels && !failed; i++)
+    failed=load_level(levels+i, backend, uri, users, nusers, inputs, ninputs, pdf_percent, &jobid);
+
+  if (!failed) {
+    for (i=1; i<nlevels && !saturation; i++)
+      if (levels[i].jobs/levels[i].seconds*100 < LOAD_SATURATION*levels[i-1].jobs/levels[i-1].seconds)
+        saturation=levels[i-1].concurrency;
+    printf("{\"benchmark\":\"load\",\"backend\":");
+    json_string(stdout, backend);
+    printf(",\"jobs_per_level\":%d,\"pdf_percent\":%d,\"postprocessing_ms\":%d,\"users\":[",
+           njobs, pdf_percent, delay);
+    for (i=0; i<nusers; i++) {
+      printf("%s", (i)?",":"");
+      json_string(stdout, users[i]);
+    }
+    printf("],\"inputs\":[");
+    for (i=0; i<ninputs; i++) {
+      printf("%s{\"name\":", (i)?",":"");
+      json_string(stdout, inputs[i].name);
+      printf(",\"bytes\":%lld}", (long long) inputs[i].size);
+    }
+    printf("],\"settings\":[");
+    for (i=0; i<nsettings; i++) {
+      printf("%s", (i)?",":"");
+      json_string(stdout, settings[i]);
+    }
+    printf("],\"levels\":[");
+    for (i=0; i<nlevels; i++)
+      printf("%s\n  {\"concurrency\":%d,\"jobs\":%d,\"failed\":%d,\"seconds\":%.3f,\"jobs_s\":%.2f,"
+             "\"p50_ms\":%.1f,\"p95_ms\":%.1f,\"p99_ms\":%.1f,\"max_ms\":%.1f,"
+             "\"peak_spool_bytes\":%lld,\"peak_rss_kb\":%ld}", (i)?",":"",
+             levels[i].concurrency, levels[i].jobs, levels[i].failed, levels[i].seconds,
+             levels[i].jobs/levels[i].seconds, levels[i].p50*1000, levels[i].p95*1000,
+             levels[i].p99*1000, levels[i].max*1000, levels[i].peak_spool, levels[i].peak_rss);
+    printf("\n],\"saturates_at\":%d}\n", saturation);
+  }
+  (void) unlink(conffile);
+  snprintf(name, BUFSIZE, "%s/cups-pdf-%s.snapshot", CP_SNAPSHOT_PATH, getenv("PRINTER"));
+  (void) unlink(name);
+  (void) nftw(bench_dir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+  return failed;
+}
+
+static char *read_strings(const char *dirname, const char *name, char *strings[], int max, int *count) {
+  /* loads a file of NUL terminated strings from a capture */
+  cp_string filename;
+  struct stat fstatus;
+  char *data=NULL, *pos;
+  int fd;
+
+  *count=0;
+  fd=(build_path(filename, "%s/%s", dirname, name))?-1:open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (!fstat(fd, &fstatus))
+    data=calloc(fstatus.st_size+1, sizeof(char));
+  if (data != NULL && read(fd, data, fstatus.st_size) != fstatus.st_size) {
+    free(data);
+    data=NULL;
+  }
+  (void) close(fd);
+  for (pos=data; data != NULL && pos < data+fstatus.st_size && *count < max; pos+=strlen(pos)+1)
+    strings[(*count)++]=pos;
+  return data;
+}
+
+static int replay_add(struct replay_job **jobs, int *njobs, const char *dirname) {
+  struct replay_job *job;
+  struct stat fstatus;
+  cp_string filename;
+  const char *base;
+  char *end;
+
+  if (!(*njobs%64)) {
+    job=realloc(*jobs, (*njobs+64)*sizeof(struct replay_job));
+    if (job == NULL)
+      return 1;
+    *jobs=job;
+  }
+  job=*jobs+*njobs;
+  memset(job, 0, sizeof(struct replay_job));
+  if (build_path(job->capture, "%s", dirname)) {
+    fprintf(stderr, "cups-pdf-bench: capture name too long: %s\n", dirname);
+    return 1;
+  }
+  while (strlen(job->capture) > 1 && job->capture[strlen(job->capture)-1] == '/')
+    job->capture[strlen(job->capture)-1]='\0';
+  base=(strrchr(job->capture, '/') != NULL)?strrchr(job->capture, '/')+1:job->capture;
+  job->arrival=strtod(base, &end);
+  job->argdata=read_strings(job->capture, CAPTURE_ARGV, job->args, 7, &job->nargs);
+  job->envdata=read_strings(job->capture, CAPTURE_ENVIRON, job->env, REPLAY_ENVIRONMENT-5, &job->nenv);
+  if (end == base || *end != '-' || job->argdata == NULL || job->nargs < 6 ||
+      build_path(filename, "%s/%s", job->capture, CAPTURE_INPUT) || stat(filename, &fstatus)) {
+    fprintf(stderr, "cups-pdf-bench: not a complete capture: %s\n", job->capture);
+    free(job->argdata);
+    free(job->envdata);
+    return 1;
+  }
+  job->bytes=fstatus.st_size;
+  (*njobs)++;
+  return 0;
+}
+
+static int replay_collect(struct replay_job **jobs, int *njobs, const char *path) {
+  /* path is a single capture or the Capture directory holding them */
+  struct dirent *entry;
+  struct stat fstatus;
+  cp_string filename;
+  DIR *dir;
+  int failed=0;
+
+  snprintf(filename, BUFSIZE, "%s/%s", path, CAPTURE_ARGV);
+  if (!stat(filename, &fstatus))
+    return replay_add(jobs, njobs, path);
+  dir=opendir(path);
+  if (dir == NULL) {
+    fprintf(stderr, "cups-pdf-bench: failed to open %s\n", path);
+    return 1;
+  }
+  while ((entry=readdir(dir)) != NULL && !failed) {
+    snprintf(filename, BUFSIZE, "%s/%s/%s", path, entry->d_name, CAPTURE_ARGV);
+    if (entry->d_name[0] != '.' && !stat(filename, &fstatus)) {
+      snprintf(filename, BUFSIZE, "%s/%s", path, entry->d_name);
+      failed=replay_add(jobs, njobs, filename);
+    }
+  }
+  (void) closedir(dir);
+  return failed;
+}
+
+static int replay_order(const void *a, const void *b) {
+  double first=((const struct replay_job *) a)->arrival, second=((const struct replay_job *) b)->arrival;
+
+  return (first > second) - (first < second);
+}
+
+static int replay_setup(struct replay_job *job, char *printer, int postprocessing,
+                        char *settings[], int nsettings) {
+  /* the captured configuration with every path written to moved into the
+     sandbox, capturing off and postprocessing only if asked for */
+  cp_string filename, line, sandbox;
+  FILE *config, *fp;
+  char *value;
+  size_t len;
+  int i, failed=0;
+
+  config=(build_path(filename, "%s/%s", job->capture, CAPTURE_CONFIG))?NULL:fopen(filename, "r");
+  if (config == NULL)
+    return 1;
+  fp=(build_path(filename, "%s/cups-pdf-%s.conf", CP_CONFIG_PATH, printer))?NULL:fopen(filename, "w");
+  if (fp == NULL) {
+    (void) fclose(config);
+    return 1;
+  }
+  while (!failed && fgets(line, BUFSIZE, config) != NULL) {
+    line[strcspn(line, "\n")]='\0';
+    value=strstr(line, " = ");
+    if (value == NULL)
+      continue;
+    line[strcspn(line, " ")]='\0';
+    value+=3;
+    len=strlen(value);
+    if (len > 1 && value[0] == '"' && value[len-1] == '"') {
+      value[len-1]='\0';
+      value++;
+    }
+    if (!strcasecmp(line, "GSTmp") && !strncmp(value, "TMPDIR=", 7))
+      value+=7;
+    else if (!strcasecmp(line, "Out") || !strcasecmp(line, "AnonDirName")) {
+      failed=build_path(sandbox, "%s/out/%s", bench_dir, (!strcasecmp(line, "Out"))?"${USER}":"ANONYMOUS");
+      value=sandbox;
+    }
+    else if (!strcasecmp(line, "Spool") || !strcasecmp(line, "Log") || !strcasecmp(line, "ConverterLocks") ||
+             (strlen(value) && (!strcasecmp(line, "ConversionCache") ||
+                                !strcasecmp(line, "PostProcessingQueue")))) {
+      failed=build_path(sandbox, "%s/%s", bench_dir, line);
+      value=sandbox;
+    }
+    else if (!strcasecmp(line, "TraceFile") || !strcasecmp(line, "Capture") ||
+             (!postprocessing && !strcasecmp(line, "PostProcessing")))
+      value="";
+    fprintf(fp, "%s %s\n", line, value);
+  }
+  for (i=0; i<nsettings; i++)
+    fprintf(fp, "%s\n", settings[i]);
+  (void) fclose(config);
+  return (fclose(fp) != 0 || failed);
+}
+
+static int replay(char *backend, char *paths[], int npaths, int timed, int postprocessing,
+                  char *settings[], int nsettings) {
+  struct replay_job *jobs=NULL, *job;
+  struct rusage usage;
+  cp_string input, spooldir, variables[4], name;
+  char printer[32], uri[48];
+  char *args[8], *env[REPLAY_ENVIRONMENT];
+  double *latencies, start, seconds;
+  long long spool, peak_spool=0;
+  long peak_rss=0;
+  pid_t pid;
+  int njobs=0, started=0, finished=0, measured=0, running=0, failed=0, status, i, j, n;
+
+  if (geteuid()) {
+    fputs("cups-pdf-bench: the replay has to run as root, just like the backend\n", stderr);
+    return 1;
+  }
+  for (i=0; i<npaths && !failed; i++)
+    failed=replay_collect(&jobs, &njobs, paths[i]);
+  latencies=calloc(njobs+1, sizeof(double));
+  if (failed || !njobs || latencies == NULL) {
+    fputs("cups-pdf-bench: no captured jobs to replay\n", stderr);
+    for (i=0; i<njobs; i++) {
+      free(jobs[i].argdata);
+      free(jobs[i].envdata);
+    }
+    free(jobs);
+    free(latencies);
+    return 1;
+  }
+  qsort(jobs, njobs, sizeof(struct replay_job), replay_order);
+  for (i=njobs-1; i>=0; i--)
+    jobs[i].arrival-=jobs[0].arrival;
+
+  failed=(build_path(bench_dir, "%s/cups-pdf-replay-XXXXXX", (getenv("TMPDIR") != NULL)?getenv("TMPDIR"):"/tmp") ||
+          mkdtemp(bench_dir) == NULL || chmod(bench_dir, 0755) || build_path(spooldir, "%s/Spool", bench_dir));
+  for (i=0; i<njobs && !failed; i++) {
+    snprintf(printer, sizeof(printer), "replay-%d-%d", (int) getpid(), i);
+    failed=replay_setup(jobs+i, printer, postprocessing, settings, nsettings);
+  }
+  if (failed)
+    fprintf(stderr, "cups-pdf-bench: failed to set up %s and the configuration files\n", bench_dir);
+
+  start=now();
+  while (finished < njobs && !failed) {
+    /* serially every job waits for the one before, otherwise for its
+       original arrival */
+    while (started < njobs && ((timed)?now()-start >= jobs[started].arrival:!running)) {
+      job=jobs+started++;
+      snprintf(printer, sizeof(printer), "replay-%d-%d", (int) getpid(), (int) (job-jobs));
+      snprintf(uri, sizeof(uri), "cups-pdf:/%s", printer);
+      snprintf(input, BUFSIZE, "%s/%s", job->capture, CAPTURE_INPUT);
+      snprintf(variables[0], BUFSIZE, "PRINTER=%s", printer);
+      snprintf(variables[1], BUFSIZE, "DEVICE_URI=%s", uri);
+      snprintf(variables[2], BUFSIZE, "PPD=/nonexistent");
+      snprintf(variables[3], BUFSIZE, "PATH=%s", (getenv("PATH") != NULL)?getenv("PATH"):"/usr/bin:/bin");
+      for (n=0; n<4; n++)
+        env[n]=variables[n];
+      for (j=0; j<job->nenv; j++)
+        if (strncmp(job->env[j], "PRINTER=", 8) && strncmp(job->env[j], "DEVICE_URI=", 11) &&
+            strncmp(job->env[j], "PPD=", 4))
+          env[n++]=job->env[j];
+      env[n]=NULL;
+      memcpy(args, job->args, sizeof(args));
+      args[0]=uri;
+      args[6]=(job->nargs > 6)?input:NULL;
+      args[7]=NULL;
+      job->start=now();
+      job->pid=spawn_backend(backend, args, env, (job->nargs > 6)?NULL:input, &job->feeder);
+      if (job->pid > 0)
+        running++;
+      else {
+        job->status=-1;
+        finished++;
+      }
+    }
+    pid=wait4(-1, &status, WNOHANG, &usage);
+    if (pid <= 0) {
+      spool=spool_usage(spooldir);
+      if (spool > peak_spool)
+        peak_spool=spool;
+      (void) usleep(LOAD_POLL);
+      continue;
+    }
+    for (job=jobs; job < jobs+started; job++)
+      if (job->pid == pid)
+        break;
+    if (job == jobs+started)
+      continue;
+    job->seconds=now()-job->start;
+    job->status=(WIFEXITED(status))?WEXITSTATUS(status):-1;
+    job->rss=usage.ru_maxrss;
+    latencies[measured++]=job->seconds;
+    finished++;
+    running--;
+    if (job->rss > peak_rss)
+      peak_rss=job->rss;
+  }
+  seconds=now()-start;
+  while (wait(NULL) > 0);
+
+  if (!failed) {
+    for (i=0; i<njobs; i++)
+      failed+=(jobs[i].status != 0);
+    qsort(latencies, measured, sizeof(double), compare_times);
+    printf("{\"benchmark\":\"replay\",\"backend\":");
+    json_string(stdout, backend);
+    printf(",\"mode\":\"%s\",\"postprocessing\":%s,\"settings\":[", (timed)?"timed":"serial",
+           (postprocessing)?"true":"false");
+    for (i=0; i<nsettings; i++) {
+      printf("%s", (i)?",":"");
+      json_string(stdout, settings[i]);
+    }
+    printf("],\"jobs\":%d,\"failed\":%d,\"seconds\":%.3f,\"p50_ms\":%.1f,\"p95_ms\":%.1f,"
+           "\"p99_ms\":%.1f,\"max_ms\":%.1f,\"peak_spool_bytes\":%lld,\"peak_rss_kb\":%ld,\"replayed\":[",
+           njobs, failed, seconds, percentile(latencies, measured, 50)*1000,
+           percentile(latencies, measured, 95)*1000, percentile(latencies, measured, 99)*1000,
+           (measured)?latencies[measured-1]*1000:0, peak_spool, peak_rss);
+    for (i=0; i<njobs; i++) {
+      printf("%s\n  {\"capture\":", (i)?",":"");
+      json_string(stdout, jobs[i].capture);
+      printf(",\"job\":");
+      json_string(stdout, jobs[i].args[1]);
+      printf(",\"user\":");
+      json_string(stdout, jobs[i].args[2]);
+      printf(",\"title\":");
+      json_string(stdout, jobs[i].args[3]);
+      printf(",\"bytes\":%lld,\"arrival_s\":%.3f,\"exit\":%d,\"ms\":%.1f,\"rss_kb\":%ld}",
+             jobs[i].bytes, jobs[i].arrival, jobs[i].status, jobs[i].seconds*1000, jobs[i].rss);
+    }
+    printf("\n]}\n");
+  }
+  for (i=0; i<njobs; i++) {
+    snprintf(name, BUFSIZE, "%s/cups-pdf-replay-%d-%d.conf", CP_CONFIG_PATH, (int) getpid(), i);
+    (void) unlink(name);
+    snprintf(name, BUFSIZE, "%s/cups-pdf-replay-%d-%d.snapshot", CP_SNAPSHOT_PATH, (int) getpid(), i);
+    (void) unlink(name);
+    free(jobs[i].argdata);
+    free(jobs[i].envdata);
+  }
+  free(jobs);
+  free(latencies);
+  (void) nftw(bench_dir, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+  return (failed != 0);
+}
+
+int main(int argc, char *argv[]) {
+  FILE *input;
+  char *settings[BENCH_SETTINGS], *names[BENCH_INPUTS], *backend;
+  const char *levels=LOAD_LEVELS, *users="nobody", *sizes=LOAD_SIZES;
+  long megabytes=BENCH_MEGABYTES;
+  int rounds=BENCH_ROUNDS, iterations=BENCH_ITERATIONS, files=0, nsettings=0, failed=0, i;
+  int njobs=LOAD_JOBS, pdf_percent=LOAD_PDF_PERCENT, delay=0, timed=0, postprocessing=0;
+
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "-p")) {
+      for (i++; i<argc; i++) {
+        if (!strcmp(argv[i], "-n") && i+1 < argc)
+          iterations=(atoi(argv[++i]) > 0)?atoi(argv[i]):1;
+        else if (!strcmp(argv[i], "-s") && i+1 < argc && nsettings < BENCH_SETTINGS)
+          settings[nsettings++]=argv[++i];
+        else if (argv[i][0] == '-' || files >= BENCH_INPUTS) {
+          fputs("Usage: cups-pdf-bench -p [-n iterations] [-s \"Key value\"] ... [file ...]\n", stderr);
+          return 1;
+        }
+        else
+          names[files++]=argv[i];
+      }
+      return pipeline(names, files, settings, nsettings, iterations);
+    }
+    else if (!strcmp(argv[i], "-l") && i+1 < argc) {
+      backend=argv[++i];
+      for (i++; i<argc; i++) {
+        if (!strcmp(argv[i], "-c") && i+1 < argc)
+          levels=argv[++i];
+        else if (!strcmp(argv[i], "-j") && i+1 < argc)
+          njobs=(atoi(argv[++i]) > 0)?atoi(argv[i]):1;
+        else if (!strcmp(argv[i], "-u") && i+1 < argc)
+          users=argv[++i];
+        else if (!strcmp(argv[i], "-z") && i+1 < argc)
+          sizes=argv[++i];
+        else if (!strcmp(argv[i], "-f") && i+1 < argc)
+          pdf_percent=atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-d") && i+1 < argc)
+          delay=atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i+1 < argc && nsettings < BENCH_SETTINGS)
+          settings[nsettings++]=argv[++i];
+        else {
+          fputs("Usage: cups-pdf-bench -l backend [-c levels] [-j jobs] [-u users] [-z sizes]\n"
+                "                      [-f pdf-percent] [-d postprocessing-ms] [-s \"Key value\"] ...\n", stderr);
+          return 1;
+        }
+      }
+      return load(backend, levels, njobs, users, sizes, pdf_percent, delay, settings, nsettings);
+    }
+    else if (!strcmp(argv[i], "-R") && i+1 < argc) {
+      backend=argv[++i];
+      for (i++; i<argc; i++) {
+        if (!strcmp(argv[i], "-t"))
+          timed=1;
+        else if (!strcmp(argv[i], "-k"))
+          postprocessing=1;
+        else if (!strcmp(argv[i], "-s") && i+1 < argc && nsettings < BENCH_SETTINGS)
+          settings[nsettings++]=argv[++i];
+        else if (argv[i][0] == '-' || files >= BENCH_INPUTS) {
+          fputs("Usage: cups-pdf-bench -R backend [-t] [-k] [-s \"Key value\"] ... capture ...\n", stderr);
+          return 1;
+        }
+        else
+          names[files++]=argv[i];
+      }
+      return replay(backend, names, files, timed, postprocessing, settings, nsettings);
+    }
+    else if (!strcmp(argv[i], "-m") && i+1 < argc)
+      megabytes=atol(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i+1 < argc)
+      rounds=(atoi(argv[++i]) > 0)?atoi(argv[i]):1;
+    else if (argv[i][0] == '-') {
+      fputs("Usage: cups-pdf-bench [-m megabytes] [-r rounds] [file ...]\n"
+            "       cups-pdf-bench -p [-n iterations] [-s \"Key value\"] ... [file ...]\n"
+            "       cups-pdf-bench -l backend [-c levels] [-j jobs] [-u users] [-z sizes]\n"
+            "                      [-f pdf-percent] [-d postprocessing-ms] [-s \"Key value\"] ...\n"
+            "       cups-pdf-bench -R backend [-t] [-k] [-s \"Key value\"] ... capture ...\n", stderr);
+      return 1;
+    }
+    else {
+      files++;
+      if ((input=fopen(argv[i], "r")) == NULL) {
+        fprintf(stderr, "cups-pdf-bench: failed to open %s\n", argv[i]);
+        return 1;
+      }
+      failed|=bench(argv[i], input, rounds);
+      (void) fclose(input);
+    }
+  }
+  if (!files) {
+    input=tmpfile();
+    if (input == NULL || generate_input(input, megabytes*1048576)) {
+      fputs("cups-pdf-bench: failed to generate input\n", stderr);
+      return 1;
+    }
+    (void) fflush(input);
+    failed|=bench("synthetic", input, rounds);
+    (void) fclose(input);
+  }
+  return failed;
+}
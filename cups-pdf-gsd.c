@@ -0,0 +1,288 @@
+/* cups-pdf-gsd.c -- GhostScript conversion daemon for CUPS-PDF
+
+   This code may be freely distributed as long as this header
+   is preserved.
+
+   This code is distributed under the GPL.
+   (http://www.gnu.org/copyleft/gpl.html)
+
+   For more detailed licensing information see cups-pdf.c in the
+   corresponding version number.
+
+   ---------------------------------------------------------------------------
+
+   The daemon loads the GhostScript interpreter (init files, font map and
+   pdfwrite device) once and keeps a pool of pre-forked workers that share
+   this warm instance. Each worker accepts one job on a Unix socket, takes
+   over the credentials the cups-pdf backend sent the request with
+   (SCM_CREDENTIALS), converts the job and exits; it is then replaced by a
+   fresh fork. The socket is only open to root and the given group, the
+   backend connects before it drops its privileges. A connection that does
+   not hand over a job within GSD_TIMEOUT seconds is dropped, so idle
+   clients cannot hold on to the workers.
+
+   Build: gcc -O2 -o cups-pdf-gsd cups-pdf-gsd.c -lgs
+   Usage: cups-pdf-gsd [-s socket] [-g group] [-n workers] [-- gs arguments]
+   (requires GhostScript 9.50 or later for gsapi_add_control_path)
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <ghostscript/iapi.h>
+#include <ghostscript/ierrors.h>
+
+#include "cups-pdf.h"
+
+#define GSD_SOCKET "/run/cups-pdf-gsd.sock"
+#define GSD_GROUP "lp"
+#define GSD_WORKERS 4
+
+static char *gs_default_args[] = { "gs", "-q", "-dNOPAUSE", "-dBATCH", "-dSAFER",
+  "-sDEVICE=pdfwrite", "-sOutputFile=/dev/null", "-dAutoRotatePages=/PageByPage",
+  "-dAutoFilterColorImages=false", "-dColorImageFilter=/FlateEncode",
+  "-dPDFSETTINGS=/prepress", NULL };
+
+static volatile sig_atomic_t terminate=0;
+
+
+static void log_gsd(const char *message, const char *detail) {
+  fprintf(stderr, "cups-pdf-gsd[%d]: %s%s%s\n", (int) getpid(), message,
+          (detail != NULL)?": ":"", (detail != NULL)?detail:"");
+  return;
+}
+
+static void on_signal(int sig) {
+  (void) sig;
+  terminate=1;
+  return;
+}
+
+static int escape_ps_string(char *dest, const char *src, size_t size) {
+  /* copies src into a PostScript string literal body; non-zero if it
+     does not fit */
+  size_t pos=0;
+
+  while (*src && pos+2 < size) {
+    if (*src == '(' || *src == ')' || *src == '\\')
+      dest[pos++]='\\';
+    dest[pos++]=*src++;
+  }
+  dest[pos]='\0';
+  return (*src != '\0');
+}
+
+static int set_timeouts(int fd, int seconds) {
+  struct timeval timeout;
+
+  timeout.tv_sec=seconds;
+  timeout.tv_usec=0;
+  return (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+          setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)));
+}
+
+static int receive_request(int fd, struct gsd_request *request, int *infd, struct ucred *cred) {
+  /* reads the request with the credentials of its sender */
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int))+CMSG_SPACE(sizeof(struct ucred))];
+  int on=1, credentials=0;
+
+  *infd=-1;
+  if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)))
+    return 1;
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base=request;
+  iov.iov_len=sizeof(*request);
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  msg.msg_control=control;
+  msg.msg_controllen=sizeof(control);
+  if (recvmsg(fd, &msg, MSG_WAITALL) != (ssize_t) sizeof(*request))
+    return 1;
+  for (cmsg=CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg=CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(infd, CMSG_DATA(cmsg), sizeof(int));
+    else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
+      memcpy(cred, CMSG_DATA(cmsg), sizeof(*cred));
+      credentials=1;
+    }
+  request->pdfver[sizeof(request->pdfver)-1]='\0';
+  request->outfile[BUFSIZE-1]='\0';
+  request->infile[BUFSIZE-1]='\0';
+  return (request->version != GSD_VERSION || !credentials);
+}
+
+static int drop_privileges(struct ucred *cred) {
+  struct passwd *passwd;
+
+  passwd=getpwuid(cred->uid);
+  if (passwd == NULL || initgroups(passwd->pw_name, cred->gid))
+    return 1;
+  if (setgid(cred->gid) || setuid(cred->uid))
+    return 1;
+  (void) umask(0077);
+  return 0;
+}
+
+static int convert(void *instance, struct gsd_request *request, int infd) {
+  cp_string buffer, outfile;
+  int exit_code, code, len;
+
+  if (infd >= 0) {
+    if (dup2(infd, STDIN_FILENO) < 0)
+      return 1;
+    (void) close(infd);
+  }
+  (void) gsapi_add_control_path(instance, GS_PERMIT_FILE_WRITING, request->outfile);
+  if (infd < 0)
+    (void) gsapi_add_control_path(instance, GS_PERMIT_FILE_READING, request->infile);
+
+  if (escape_ps_string(outfile, request->outfile, BUFSIZE))
+    return 1;
+  len=snprintf(buffer, BUFSIZE, "<< /CompatibilityLevel %s >> setdistillerparams "
+               "<< /OutputFile (%s) >> setpagedevice", request->pdfver, outfile);
+  if (len < 0 || len >= BUFSIZE)
+    return 1;
+  code=gsapi_run_string(instance, buffer, 0, &exit_code);
+  if (code == 0 || code == gs_error_Quit)
+    code=gsapi_run_file(instance, (infd >= 0)?"%stdin":request->infile, 0, &exit_code);
+  if (code == gs_error_Quit)
+    code=0;
+  if (gsapi_exit(instance) && !code)
+    code=1;
+  /* GhostScript errors are negative, the backend takes those for an
+     unusable daemon and would convert the job again */
+  return (code != 0);
+}
+
+static void worker(void *instance, int listenfd) {
+  struct gsd_request request;
+  struct ucred cred;
+  int fd, infd, result=1, accepted=0;
+
+  (void) prctl(PR_SET_PDEATHSIG, SIGTERM);
+  fd=accept(listenfd, NULL, NULL);
+  if (fd < 0)
+    _exit(1);
+  (void) close(listenfd);
+  if (set_timeouts(fd, GSD_TIMEOUT) || receive_request(fd, &request, &infd, &cred))
+    log_gsd("no valid request received", NULL);
+  else if (drop_privileges(&cred))
+    log_gsd("failed to take over credentials for", request.outfile);
+  else if (send(fd, &accepted, sizeof(accepted), MSG_NOSIGNAL) != (ssize_t) sizeof(accepted) ||
+           recv(fd, &accepted, sizeof(accepted), MSG_WAITALL) != (ssize_t) sizeof(accepted))
+    /* the backend gave up waiting and converts the job itself */
+    log_gsd("job not confirmed by the backend", request.outfile);
+  else {
+    result=convert(instance, &request, infd);
+    if (result)
+      log_gsd("conversion failed", request.outfile);
+  }
+  (void) send(fd, &result, sizeof(result), MSG_NOSIGNAL);
+  (void) close(fd);
+  gsapi_delete_instance(instance);
+  _exit(0);
+}
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_un addr;
+  struct sigaction action;
+  struct group *group;
+  char *socketname=GSD_SOCKET, *groupname=GSD_GROUP, **gsargs=gs_default_args;
+  void *instance=NULL;
+  int workers=GSD_WORKERS, running=0, listenfd, gsargc, i;
+  pid_t pid;
+
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "-s") && i+1 < argc)
+      socketname=argv[++i];
+    else if (!strcmp(argv[i], "-g") && i+1 < argc)
+      groupname=argv[++i];
+    else if (!strcmp(argv[i], "-n") && i+1 < argc)
+      workers=(atoi(argv[++i]) > 0)?atoi(argv[i]):1;
+    else if (!strcmp(argv[i], "--")) {
+      gsargs=argv+i;
+      gsargs[0]="gs";
+      break;
+    }
+    else {
+      (void) fputs("Usage: cups-pdf-gsd [-s socket] [-g group] [-n workers] [-- gs arguments]\n", stderr);
+      return 1;
+    }
+  }
+  for (gsargc=0; gsargs[gsargc] != NULL; gsargc++);
+
+  if (strlen(socketname) >= sizeof(addr.sun_path)) {
+    log_gsd("socket name too long", socketname);
+    return 1;
+  }
+  if ((group=getgrnam(groupname)) == NULL) {
+    log_gsd("unknown group", groupname);
+    return 1;
+  }
+  if (gsapi_new_instance(&instance, NULL) < 0 ||
+      gsapi_set_arg_encoding(instance, GS_ARG_ENCODING_UTF8) ||
+      gsapi_init_with_args(instance, gsargc, gsargs)) {
+    log_gsd("failed to initialise GhostScript", NULL);
+    return 1;
+  }
+
+  listenfd=socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path, socketname);
+  (void) unlink(socketname);
+  (void) umask(0117);
+  if (listenfd < 0 || bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) ||
+      chown(socketname, 0, group->gr_gid) || chmod(socketname, 0660) || listen(listenfd, 64)) {
+    log_gsd("failed to create socket", socketname);
+    return 1;
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler=on_signal;
+  (void) sigaction(SIGTERM, &action, NULL);
+  (void) sigaction(SIGINT, &action, NULL);
+
+  while (!terminate) {
+    while (running < workers) {
+      pid=fork();
+      if (!pid)
+        worker(instance, listenfd);
+      if (pid < 0) {
+        log_gsd("failed to fork worker", NULL);
+        (void) sleep(1);
+        break;
+      }
+      running++;
+    }
+    if (wait(NULL) > 0)
+      running--;
+    else if (errno == ECHILD)
+      running=0;
+  }
+
+  (void) unlink(socketname);
+  (void) gsapi_exit(instance);
+  gsapi_delete_instance(instance);
+  return 0;
+}
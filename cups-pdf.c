@@ -39,6 +39,10 @@
    HISTORY: see ChangeLog in the parent directory of the source archive
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <time.h>
 #include <errno.h>
 #include <stdio.h>
@@ -48,13 +52,34 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pwd.h>
 #include <grp.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <poll.h>
 #include <dirent.h>
+#include <utime.h>
+#include <spawn.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
 
 #include <cups/cups.h>
 #include <cups/ppd.h>
@@ -62,73 +87,506 @@
 
 #include "cups-pdf.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CP_X86_SIMD
+#endif
+
+
+extern char **environ;
 
 static FILE *logfp=NULL;
+static cp_string log_path;
+
+#define LOGBUFSIZE 65536
+#define LOGLINESIZE (BUFSIZE+256)
+
+static char log_buffer[LOGBUFSIZE];  /* lines not yet written to logfp */
+static size_t log_buffered=0;
+static time_t log_secs=-1;
+static char log_time[32];
 int input_is_pdf=0;
+static long pdf_offset=-1;        /* start of PDF data in a seekable source */
+int input_is_streamed=0;
+static char *ps_header=NULL;      /* DSC header read before the converter starts */
+static size_t ps_header_len=0;
+static int ps_rec_depth=0;
+static int ps_finished=0;
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char block[64];
+  size_t used;
+} sha256_ctx;
+
+static sha256_ctx spool_hash;
+static int spool_hashing=0;
+static char cache_key[65]="";
+static int spool_memfd=-1;        /* spool kept in memory, see SpoolMemory */
+static int spool_compressed=0;    /* spool file holds gzip data, see SpoolCompress */
+static cp_string cache_entry, cache_tmp;
+
+/* ways a job gets converted, part of the conversion cache key */
+
+enum convertPaths { P_GSCALL, P_DAEMON, P_PARALLEL };
+
+static const char *convert_path_names[] = { "gscall", "daemon", "parallel" };
+
+#define READSIZE 65536
+
+typedef struct {
+  int fd;
+  char *data;
+  size_t pos, len, size;
+  off_t offset;                 /* input offset of data[0] */
+  off_t line_offset;            /* input offset of the last line returned */
+  int eof;
+} line_reader;
+
+static line_reader src_reader;
+
+#define SPOOL_MEMORY_MAX 1048576        /* highest SpoolMemory in kB */
+#define SPOOL_COMPRESS_MAX 1048576      /* highest SpoolCompress in MB */
+
+static const char *capture_variables[] = { "PRINTER", "DEVICE_URI", "PPD", "CONTENT_TYPE",
+  "FINAL_CONTENT_TYPE", "CHARSET", "LANG", "TZ", NULL };
+
+#define ADMIT_SLOTS 64                  /* highest MaxConverters */
+#define ADMIT_AGING 10                  /* seconds halving a waiting job's size */
+#define ADMIT_POLL 100000               /* microseconds between attempts */
+#define ADMIT_UNKNOWN ((off_t) 1 << 40) /* size of piped streamed jobs */
+
+static struct dsc_index job_index;
+static long long *job_pages=NULL;
+static long long spool_offset, profile_images, profile_data;
+static int job_pages_allocated=0, index_depth, index_line_start, profiling;
+static size_t (*find_delimiter)(const char *, size_t, int)=NULL;
+
+/* processing stages timed for the per-job trace record */
+
+enum traceStages { T_CONFIG, T_SETUP, T_NSS, T_USERDIR, T_SPOOL, T_ADMIT, T_STREAM, T_CONVERT, T_CHMOD, T_POSTPROCESS, T_WAIT, END_OF_STAGES };
+
+static const char *trace_names[] = { "config", "setup", "nss", "userdir", "spool", "admission", "stream", "convert", "chmod", "postprocessing", "wait" };
+
+typedef struct {
+  double start[END_OF_STAGES];    /* seconds since the job started, -1 if not run */
+  double duration[END_OF_STAGES];
+  long long input_bytes, spool_bytes, output_bytes;
+} job_trace;
+
+static job_trace trace_local, *trace=&trace_local;
+static struct timespec trace_epoch;
+
+/* precompiled result of cups-pdf.conf and the PPD defaults, followed by
+   the values of all options in the order of configData[] */
+
+#define SNAPSHOT_MAGIC "CPDFSNP1"
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+} snapshot_source;
+
+typedef struct {
+  char magic[8];
+  char version[16];
+  int options;
+  int valuesize;
+  cp_string conf_name;
+  cp_string ppd_name;
+  snapshot_source binary, conf, ppd;
+  uint64_t checksum;
+} config_snapshot;
+
+static int config_from_snapshot=0;
+
+/* values set by cups-pdf.conf, parsed once by the server and inherited by
+   the workers it forks; jobs only apply their PPD and options on top */
+static unsigned char *server_values=NULL;
+static snapshot_source server_source;
+static cp_string server_conffile;
+static int config_from_server=0;
+
+/* cache of user and group lookups, one line per entry:
+   <type>TAB<name>TAB<time resolved>TAB<data>, type U (passwd), L (group list
+   for the gid in data) or G (group) */
+
+#define USER_CACHE CP_SNAPSHOT_PATH "/cups-pdf-users.cache"
+
+static char *user_cache=NULL;
+static int user_cache_loaded=0;
+
 
+static int build_path(char *path, const char *format, ...) {
+  /* formats a file name into a cp_string; non-zero if it does not fit,
+     leaving path empty so that no truncated name gets used by mistake */
+  va_list ap;
+  int len;
+
+  va_start(ap, format);
+  len=vsnprintf(path, BUFSIZE, format, ap);
+  va_end(ap);
+  if (len >= 0 && len < BUFSIZE)
+    return 0;
+  path[0]='\0';
+  return 1;
+}
+
+static void log_rotate(void) {
+  /* moves a log grown beyond LogRotateSize to <log>.1; called with the
+     log locked and only with the privileges to reopen it */
+  struct stat fstatus, pstatus;
+  cp_string rotated;
+  FILE *fp;
+
+  if (fstat(fileno(logfp), &fstatus))
+    return;
+  if (stat(log_path, &pstatus) || pstatus.st_ino != fstatus.st_ino || pstatus.st_dev != fstatus.st_dev) {
+    /* already rotated by a concurrent backend */
+    if ((fp=fopen(log_path, "a")) != NULL) {
+      (void) fclose(logfp);
+      logfp=fp;
+      (void) flock(fileno(logfp), LOCK_EX);
+    }
+    return;
+  }
+  if (fstatus.st_size+(off_t)log_buffered <= (off_t)Conf_LogRotateSize*1024)
+    return;
+  if (build_path(rotated, "%s.1", log_path) || rename(log_path, rotated) || (fp=fopen(log_path, "a")) == NULL)
+    return;
+  (void) fclose(logfp);
+  logfp=fp;
+  (void) flock(fileno(logfp), LOCK_EX);
+  return;
+}
+
+static void log_flush(void) {
+  /* writes all buffered lines with a single write(2) */
+  size_t pos=0;
+  ssize_t count;
+  int fd;
+
+  if (logfp == NULL || !log_buffered)
+    return;
+  fd=fileno(logfp);
+  if (Conf_LogRotateSize > 0 && !geteuid()) {
+    (void) flock(fd, LOCK_EX);
+    log_rotate();
+    fd=fileno(logfp);
+  }
+  while (pos < log_buffered) {
+    count=write(fd, log_buffer+pos, log_buffered-pos);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      break;
+    pos+=count;
+  }
+  if (Conf_LogRotateSize > 0 && !geteuid())
+    (void) flock(fd, LOCK_UN);
+  log_buffered=0;
+  return;
+}
+
+static void log_close(void) {
+  log_flush();
+  if (logfp != NULL)
+    (void) fclose(logfp);
+  logfp=NULL;
+  return;
+}
 
 static void log_event(short type, const char *message, ...) {
   time_t secs;
-  int error=errno;
-  char ctype[8], *timestring;
-  cp_string logbuffer;
+  int error=errno, len;
+  char *line;
+  const char *ctype;
   va_list ap;
 
-  if ((logfp != NULL) && (type & Conf_LogType)) {
-    (void) time(&secs);
-    timestring=ctime(&secs);
-    timestring[strlen(timestring)-1]='\0';
+  if ((logfp == NULL) || !(type & Conf_LogType))
+    return;
 
-    if (type == CPERROR)
-      snprintf(ctype, 8, "ERROR");
-    else if (type == CPSTATUS)
-      snprintf(ctype, 8, "STATUS");
-    else
-      snprintf(ctype, 8, "DEBUG");
+  (void) time(&secs);
+  if (secs != log_secs) {
+    (void) ctime_r(&secs, log_time);
+    log_time[strcspn(log_time, "\n")]='\0';
+    log_secs=secs;
+  }
+  if (type == CPERROR)
+    ctype="ERROR";
+  else if (type == CPSTATUS)
+    ctype="STATUS";
+  else
+    ctype="DEBUG";
+
+  if (log_buffered+LOGLINESIZE > LOGBUFSIZE)
+    log_flush();
+  line=log_buffer+log_buffered;
+  len=snprintf(line, 64, "%s  [%s] ", log_time, ctype);
+  log_buffered+=len;
+  va_start(ap, message);
+  len=vsnprintf(log_buffer+log_buffered, BUFSIZE, message, ap);
+  va_end(ap);
+  if (len < 0)
+    len=0;
+  else if (len > BUFSIZE-1)
+    len=BUFSIZE-1;
+  log_buffered+=len;
+  log_buffer[log_buffered++]='\n';
+  if ((Conf_LogType & CPDEBUG) && (type == CPERROR) && error)
+    log_buffered+=snprintf(log_buffer+log_buffered, LOGBUFSIZE-log_buffered,
+                           "%s  [DEBUG] ERRNO: %d (%s)\n", log_time, error, strerror(error));
+  if (type == CPERROR)
+    log_flush();
+  return;
+}
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x,n) (((x) >> (n)) | ((x) << (32-(n))))
+
+static void sha256_block(sha256_ctx *ctx, const unsigned char *data) {
+  uint32_t w[64], v[8], t1, t2;
+  int i;
+
+  for (i=0; i<16; i++)
+    w[i]=((uint32_t)data[4*i]<<24)|((uint32_t)data[4*i+1]<<16)|((uint32_t)data[4*i+2]<<8)|data[4*i+3];
+  for (i=16; i<64; i++)
+    w[i]=w[i-16]+(ROR32(w[i-15],7)^ROR32(w[i-15],18)^(w[i-15]>>3))+
+         w[i-7]+(ROR32(w[i-2],17)^ROR32(w[i-2],19)^(w[i-2]>>10));
+  memcpy(v, ctx->state, sizeof(v));
+  for (i=0; i<64; i++) {
+    t1=v[7]+(ROR32(v[4],6)^ROR32(v[4],11)^ROR32(v[4],25))+((v[4]&v[5])^(~v[4]&v[6]))+sha256_k[i]+w[i];
+    t2=(ROR32(v[0],2)^ROR32(v[0],13)^ROR32(v[0],22))+((v[0]&v[1])^(v[0]&v[2])^(v[1]&v[2]));
+    memmove(v+1, v, 7*sizeof(uint32_t));
+    v[4]+=t1;
+    v[0]=t1+t2;
+  }
+  for (i=0; i<8; i++)
+    ctx->state[i]+=v[i];
+  return;
+}
+
+static void sha256_init(sha256_ctx *ctx) {
+  static const uint32_t init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+  memcpy(ctx->state, init, sizeof(init));
+  ctx->length=0;
+  ctx->used=0;
+  return;
+}
+
+static void sha256_update(sha256_ctx *ctx, const void *data, size_t len) {
+  const unsigned char *ptr=data;
+  size_t chunk;
+
+  ctx->length+=len;
+  while (len > 0) {
+    chunk=(64-ctx->used < len)?64-ctx->used:len;
+    memcpy(ctx->block+ctx->used, ptr, chunk);
+    ctx->used+=chunk;
+    ptr+=chunk;
+    len-=chunk;
+    if (ctx->used == 64) {
+      sha256_block(ctx, ctx->block);
+      ctx->used=0;
+    }
+  }
+  return;
+}
+
+static void sha256_final(sha256_ctx *ctx, char *hex) {
+  /* writes the digest as 64 hex digits plus terminating 0 */
+  unsigned char pad[72];
+  uint64_t bits=ctx->length*8;
+  size_t padlen;
+  int i;
+
+  padlen=(ctx->used < 56)?56-ctx->used:120-ctx->used;
+  memset(pad, 0, sizeof(pad));
+  pad[0]=0x80;
+  for (i=0; i<8; i++)
+    pad[padlen+i]=(unsigned char)(bits>>(56-8*i));
+  sha256_update(ctx, pad, padlen+8);
+  for (i=0; i<8; i++)
+    snprintf(hex+8*i, 9, "%08x", ctx->state[i]);
+  return;
+}
+
+static double trace_clock(void) {
+  struct timespec now;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-trace_epoch.tv_sec)+(now.tv_nsec-trace_epoch.tv_nsec)/1e9;
+}
+
+static void trace_init(void) {
+  int i;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+  for (i=0; i<END_OF_STAGES; i++) {
+    trace->start[i]=-1;
+    trace->duration[i]=0;
+  }
+  return;
+}
+
+static void trace_begin(int stage) {
+  trace->start[stage]=trace_clock();
+  return;
+}
 
-    va_start(ap, message);
-    vsnprintf(logbuffer, BUFSIZE, message, ap);
-    va_end(ap);
+static void trace_end(int stage) {
+  if (trace->start[stage] >= 0)
+    trace->duration[stage]=trace_clock()-trace->start[stage];
+  log_flush();
+  return;
+}
 
-    fprintf(logfp,"%s  [%s] %s\n", timestring, ctype, logbuffer);
-    if ((Conf_LogType & CPDEBUG) && (type == CPERROR) && error)
-      fprintf(logfp,"%s  [DEBUG] ERRNO: %d (%s)\n", timestring, error, strerror(error));
+static void trace_share(void) {
+  /* moves the trace record into memory shared with the child process,
+     so the stages timed after fork() end up in the same record */
+  job_trace *shared;
+
+  if (!strlen(Conf_TraceFile))
+    return;
+  shared=mmap(NULL, sizeof(job_trace), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    log_event(CPERROR, "failed to share trace record with child (non fatal)");
+    return;
+  }
+  memcpy(shared, trace, sizeof(job_trace));
+  trace=shared;
+  return;
+}
 
-    (void) fflush(logfp);
+static void json_string(FILE *fp, const char *string) {
+  (void) fputc('"', fp);
+  for (; *string; string++) {
+    if (*string == '"' || *string == '\\')
+      fprintf(fp, "\\%c", *string);
+    else if ((unsigned char) *string < 0x20)
+      fprintf(fp, "\\u%04x", (unsigned char) *string);
+    else
+      (void) fputc(*string, fp);
   }
+  (void) fputc('"', fp);
+  return;
+}
+
+static void trace_write(char *job, char *user, char *cache, int status, struct rusage *usage) {
+  /* appends the trace record of this job as a single JSON line */
+  char *record=NULL;
+  size_t len=0;
+  FILE *fp;
+  int fd, i, first=1;
 
+  if (!strlen(Conf_TraceFile))
+    return;
+  fp=open_memstream(&record, &len);
+  if (fp == NULL) {
+    log_event(CPERROR, "failed to allocate memory for trace record (non fatal)");
+    return;
+  }
+  fprintf(fp, "{\"time\":%ld,\"job\":", (long) time(NULL));
+  json_string(fp, job);
+  fprintf(fp, ",\"user\":");
+  json_string(fp, user);
+  fprintf(fp, ",\"printer\":");
+  json_string(fp, (getenv("PRINTER") != NULL)?getenv("PRINTER"):"");
+  fprintf(fp, ",\"input\":\"%s\",\"streamed\":%d,\"cache\":\"%s\",\"status\":%d,\"total_ms\":%.3f,\"stages\":{",
+          (input_is_pdf)?"pdf":"postscript", input_is_streamed,
+          cache,
+          status, trace_clock()*1000);
+  for (i=0; i<END_OF_STAGES; i++)
+    if (trace->start[i] >= 0) {
+      fprintf(fp, "%s\"%s\":{\"start_ms\":%.3f,\"ms\":%.3f}", (first)?"":",", trace_names[i],
+              trace->start[i]*1000, trace->duration[i]*1000);
+      first=0;
+    }
+  fprintf(fp, "},\"bytes\":{\"input\":%lld,\"spool\":%lld,\"output\":%lld}",
+          trace->input_bytes, trace->spool_bytes, trace->output_bytes);
+  fprintf(fp, ",\"child\":{\"user_s\":%.3f,\"system_s\":%.3f,\"max_rss_kb\":%ld}}\n",
+          usage->ru_utime.tv_sec+usage->ru_utime.tv_usec/1e6,
+          usage->ru_stime.tv_sec+usage->ru_stime.tv_usec/1e6, usage->ru_maxrss);
+  if (fclose(fp)) {
+    free(record);
+    log_event(CPERROR, "failed to allocate memory for trace record (non fatal)");
+    return;
+  }
+  fd=open(Conf_TraceFile, O_WRONLY|O_APPEND|O_CREAT, 0600);
+  if (fd < 0 || write(fd, record, len) != (ssize_t) len)
+    log_event(CPERROR, "failed to write trace record: %s (non fatal)", Conf_TraceFile);
+  if (fd >= 0)
+    (void) close(fd);
+  free(record);
   return;
 }
 
 static int create_dir(char *dirname, int nolog) {
+  /* creates dirname below its deepest existing ancestor, one component at
+     a time relative to the descriptor of its parent; new directories get
+     mode and owner of their parent */
   struct stat fstatus;
-  char buffer[BUFSIZE],*delim;
-  int i;
+  cp_string path;
+  char *delim, *name, *end;
+  int fd, next, i;
 
   while ((i=strlen(dirname))>1 && dirname[i-1]=='/')
     dirname[i-1]='\0';
-  if (stat(dirname, &fstatus) || !S_ISDIR(fstatus.st_mode)) {
-    strncpy(buffer,dirname,BUFSIZE);
-    delim=strrchr(buffer,'/');
-    if (delim!=buffer)
-      delim[0]='\0';
-    else
-      delim[1]='\0';
-    if (create_dir(buffer,nolog)!=0)
-      return 1;
-    (void) stat(buffer, &fstatus);
-    if (mkdir(dirname,fstatus.st_mode)!=0) {
+  snprintf(path, BUFSIZE, "%s", dirname);
+  while ((fd=open(path, O_RDONLY|O_DIRECTORY)) < 0) {
+    delim=strrchr(path, '/');
+    if (errno != ENOENT || delim == NULL) {
       if (!nolog)
         log_event(CPERROR, "failed to create directory: %s", dirname);
       return 1;
     }
+    if (delim != path)
+      delim[0]='\0';
     else
+      delim[1]='\0';
+  }
+
+  for (name=dirname+strlen(path); *name; name=end) {
+    while (*name == '/')
+      name++;
+    end=name+strcspn(name, "/");
+    snprintf(path, BUFSIZE, "%.*s", (int) (end-name), name);
+    if (fstat(fd, &fstatus) || (mkdirat(fd, path, fstatus.st_mode) && errno != EEXIST)) {
       if (!nolog)
-        log_event(CPSTATUS, "directory created: %s", dirname);
-    if (chown(dirname,fstatus.st_uid,fstatus.st_gid)!=0)
+        log_event(CPERROR, "failed to create directory: %.*s", (int) (end-dirname), dirname);
+      (void) close(fd);
+      return 1;
+    }
+    if (!nolog)
+      log_event(CPSTATUS, "directory created: %.*s", (int) (end-dirname), dirname);
+    if (fchownat(fd, path, fstatus.st_uid, fstatus.st_gid, AT_SYMLINK_NOFOLLOW) && !nolog)
+      log_event(CPDEBUG, "failed to set owner on directory: %.*s (non fatal)", (int) (end-dirname), dirname);
+    next=openat(fd, path, O_RDONLY|O_DIRECTORY);
+    (void) close(fd);
+    if (next < 0) {
       if (!nolog)
-        log_event(CPDEBUG, "failed to set owner on directory: %s (non fatal)", dirname);
+        log_event(CPERROR, "failed to create directory: %.*s", (int) (end-dirname), dirname);
+      return 1;
+    }
+    fd=next;
   }
+  (void) close(fd);
   return 0;
 }
 
@@ -234,6 +692,100 @@ static int _assign_value(int security, char *key, char *value) {
           tmp=(int)strtol(value,NULL,8);
           Conf_UserUMask=(mode_t)tmp;
           break;
+    case GSDaemon:
+           strncpy(Conf_GSDaemon, value, BUFSIZE);
+           break;
+    case ConversionCache:
+           strncpy(Conf_ConversionCache, value, BUFSIZE);
+           break;
+    case ConversionCacheSize:
+          tmp=atoi(value);
+          Conf_ConversionCacheSize=(tmp>=1)?tmp:1;
+          break;
+    case ParallelWorkers:
+          tmp=atoi(value);
+          Conf_ParallelWorkers=(tmp>64)?64:((tmp<0)?0:tmp);
+          break;
+    case ParallelMinPages:
+          tmp=atoi(value);
+          Conf_ParallelMinPages=(tmp>=2)?tmp:2;
+          break;
+    case TraceFile:
+           strncpy(Conf_TraceFile, value, BUFSIZE);
+           break;
+    case LogRotateSize:
+          tmp=atoi(value);
+          Conf_LogRotateSize=(tmp>0)?tmp:0;
+          break;
+    case UserCacheTTL:
+          tmp=atoi(value);
+          Conf_UserCacheTTL=(tmp>0)?tmp:0;
+          break;
+    case PostProcessingQueue:
+           strncpy(Conf_PostProcessingQueue, value, BUFSIZE);
+           break;
+    case PostProcessingWorkers:
+          tmp=atoi(value);
+          Conf_PostProcessingWorkers=(tmp>64)?64:((tmp<1)?1:tmp);
+          break;
+    case PostProcessingTimeout:
+          tmp=atoi(value);
+          Conf_PostProcessingTimeout=(tmp>0)?tmp:0;
+          break;
+    case PDFOptimize:
+          tmp=atoi(value);
+          Conf_PDFOptimize=(tmp>0)?tmp:0;
+          break;
+    case PDFOptimizeThreads:
+          tmp=atoi(value);
+          Conf_PDFOptimizeThreads=(tmp>64)?64:((tmp<1)?1:tmp);
+          break;
+    case MaxConverters:
+          tmp=atoi(value);
+          Conf_MaxConverters=(tmp>ADMIT_SLOTS)?ADMIT_SLOTS:((tmp<0)?0:tmp);
+          break;
+    case ConverterLocks:
+           strncpy(Conf_ConverterLocks, value, BUFSIZE);
+           break;
+    case ConverterWeight:
+          tmp=atoi(value);
+          Conf_ConverterWeight=(tmp>100)?100:((tmp<1)?1:tmp);
+          break;
+    case ConverterNice:
+          tmp=atoi(value);
+          Conf_ConverterNice=(tmp>19)?19:((tmp<-20)?-20:tmp);
+          break;
+    case ConverterCPUs:
+           strncpy(Conf_ConverterCPUs, value, BUFSIZE);
+           break;
+    case GSProfileText:
+           strncpy(Conf_GSProfileText, value, BUFSIZE);
+           break;
+    case GSProfileImage:
+           strncpy(Conf_GSProfileImage, value, BUFSIZE);
+           break;
+    case GSProfileLarge:
+           strncpy(Conf_GSProfileLarge, value, BUFSIZE);
+           break;
+    case SpoolMemory:
+          tmp=atoi(value);
+          Conf_SpoolMemory=(tmp>SPOOL_MEMORY_MAX)?SPOOL_MEMORY_MAX:((tmp<0)?0:tmp);
+          break;
+    case SpoolCompress:
+          tmp=atoi(value);
+          Conf_SpoolCompress=(tmp>SPOOL_COMPRESS_MAX)?SPOOL_COMPRESS_MAX:((tmp<0)?0:tmp);
+          break;
+    case Capture:
+          strncpy(Conf_Capture, value, BUFSIZE);
+          break;
+    case CaptureRate:
+          tmp=atoi(value);
+          Conf_CaptureRate=(tmp>100)?100:((tmp<0)?0:tmp);
+          break;
+    case StreamPostScript:
+          tmp=atoi(value);
+          Conf_StreamPostScript=(tmp)?1:0;
+          break;
     default:
           log_event(CPERROR, "Program error: option not treated: %s = %s\n", key, value);
           return 0;
@@ -318,114 +870,598 @@ static void read_config_options(const char *lpoptions) {
   return;
 }
 
-static void dump_configuration() {
-  if (Conf_LogType & CPDEBUG) {
-    log_event(CPDEBUG, "*** Final Configuration ***");
-    log_event(CPDEBUG, "AnonDirName        = \"%s\"", Conf_AnonDirName);
-    log_event(CPDEBUG, "AnonUser           = \"%s\"", Conf_AnonUser);
-    log_event(CPDEBUG, "GhostScript        = \"%s\"", Conf_GhostScript);
-    log_event(CPDEBUG, "GSCall             = \"%s\"", Conf_GSCall);
-    log_event(CPDEBUG, "Grp                = \"%s\"", Conf_Grp);
-    log_event(CPDEBUG, "GSTmp              = \"%s\"", Conf_GSTmp);
-    log_event(CPDEBUG, "Log                = \"%s\"", Conf_Log);
-    log_event(CPDEBUG, "PDFVer             = \"%s\"", Conf_PDFVer);
-    log_event(CPDEBUG, "PostProcessing     = \"%s\"", Conf_PostProcessing);
-    log_event(CPDEBUG, "Out                = \"%s\"", Conf_Out);
-    log_event(CPDEBUG, "Spool              = \"%s\"", Conf_Spool);
-    log_event(CPDEBUG, "UserPrefix         = \"%s\"", Conf_UserPrefix);
-    log_event(CPDEBUG, "RemovePrefix       = \"%s\"", Conf_RemovePrefix);
-    log_event(CPDEBUG, "OutExtension       = \"%s\"", Conf_OutExtension);
-    log_event(CPDEBUG, "Cut                = %d", Conf_Cut);
-    log_event(CPDEBUG, "Truncate           = %d", Conf_Truncate);
-    log_event(CPDEBUG, "DirPrefix          = %d", Conf_DirPrefix);
-    log_event(CPDEBUG, "Label              = %d", Conf_Label);
-    log_event(CPDEBUG, "LogType            = %d", Conf_LogType);
-    log_event(CPDEBUG, "LowerCase          = %d", Conf_LowerCase);
-    log_event(CPDEBUG, "TitlePref          = %d", Conf_TitlePref);
-    log_event(CPDEBUG, "DecodeHexStrings   = %d", Conf_DecodeHexStrings);
-    log_event(CPDEBUG, "FixNewlines        = %d", Conf_FixNewlines);
-    log_event(CPDEBUG, "AllowUnsafeOptions = %d", Conf_AllowUnsafeOptions);
-    log_event(CPDEBUG, "AnonUMask          = %04o", Conf_AnonUMask);
-    log_event(CPDEBUG, "UserUMask          = %04o", Conf_UserUMask);
-    log_event(CPDEBUG, "*** End of Configuration ***");
-  }
+static void config_values_save(unsigned char *values) {
+  int option;
+
+  for (option=0; option<END_OF_OPTIONS; option++)
+    memcpy(values+option*sizeof(configData[0].value), &configData[option].value, sizeof(configData[0].value));
   return;
 }
 
-static int init(char *argv[]) {
-  struct stat fstatus;
-  struct group *group;
-  cp_string filename;
-  int grpstat;
-  const char *uri=cupsBackendDeviceURI(argv);
+static void config_values_restore(const unsigned char *values) {
+  int option;
 
-  if ((uri != NULL) && (strncmp(uri, "cups-pdf:/", 10) == 0) && strlen(uri) > 10) {
-    uri = uri + 10;
-    sprintf(filename, "%s/cups-pdf-%s.conf", CP_CONFIG_PATH, uri);
-  }
-  else {
-    sprintf(filename, "%s/cups-pdf.conf", CP_CONFIG_PATH);
-  }
-  read_config_file(filename);
+  for (option=0; option<END_OF_OPTIONS; option++)
+    memcpy(&configData[option].value, values+option*sizeof(configData[0].value), sizeof(configData[0].value));
+  return;
+}
 
-  read_config_ppd();
+static uint64_t snapshot_checksum(const unsigned char *data, size_t len) {
+  /* FNV-1a */
+  uint64_t hash=UINT64_C(14695981039346656037);
 
-  read_config_options(argv[5]);
+  while (len--) {
+    hash^=*data++;
+    hash*=UINT64_C(1099511628211);
+  }
+  return hash;
+}
 
-  (void) umask(0077);
+static void snapshot_identity(const char *path, snapshot_source *source) {
+  /* a missing file has an identity of its own, all zeros */
+  struct stat fstatus;
 
-  group=getgrnam(Conf_Grp);
-  grpstat=setgid(group->gr_gid);
+  memset(source, 0, sizeof(snapshot_source));
+  if (path == NULL || !strlen(path) || stat(path, &fstatus))
+    return;
+  source->dev=fstatus.st_dev;
+  source->ino=fstatus.st_ino;
+  source->size=fstatus.st_size;
+  source->mtime=fstatus.st_mtim.tv_sec;
+  source->mtime_nsec=fstatus.st_mtim.tv_nsec;
+  return;
+}
 
-  if (strlen(Conf_Log)) {
-    if (stat(Conf_Log, &fstatus) || !S_ISDIR(fstatus.st_mode)) {
-      if (create_dir(Conf_Log, 1))
-        return 1;
-      if (chmod(Conf_Log, 0700))
-        return 1;
-    }
-    snprintf(filename, BUFSIZE, "%s/%s%s%s", Conf_Log, "cups-pdf-", getenv("PRINTER"), "_log");
-    logfp=fopen(filename, "a");
-  }
+static void snapshot_header(config_snapshot *header, char *conffile, char *ppdname) {
+  memset(header, 0, sizeof(config_snapshot));
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  snprintf(header->version, sizeof(header->version), "%s", CPVERSION);
+  header->options=END_OF_OPTIONS;
+  header->valuesize=sizeof(configData[0].value);
+  snprintf(header->conf_name, BUFSIZE, "%s", conffile);
+  snprintf(header->ppd_name, BUFSIZE, "%s", (ppdname != NULL)?ppdname:"");
+  snapshot_identity("/proc/self/exe", &header->binary);
+  snapshot_identity(conffile, &header->conf);
+  snapshot_identity(ppdname, &header->ppd);
+  return;
+}
 
-  dump_configuration();
+static int load_config_snapshot(char *snapfile, char *conffile, char *ppdname) {
+  /* restores the options set by cups-pdf.conf and the PPD from a snapshot
+     compiled by an earlier job; returns 1 if the snapshot is missing,
+     stale or corrupt and the sources have to be parsed */
+  config_snapshot expected;
+  const config_snapshot *header;
+  const unsigned char *values;
+  struct stat fstatus;
+  size_t size=sizeof(config_snapshot)+END_OF_OPTIONS*sizeof(configData[0].value);
+  void *map;
+  int fd, result=1;
 
-  if (!group) {
-    log_event(CPERROR, "Grp not found: %s", Conf_Grp);
+  fd=open(snapfile, O_RDONLY|O_NOFOLLOW);
+  if (fd < 0)
     return 1;
-  }
-  else if (grpstat) {
-    log_event(CPERROR, "failed to set new gid: %s", Conf_Grp);
+  if (fstat(fd, &fstatus) || !S_ISREG(fstatus.st_mode) || fstatus.st_uid || (size_t) fstatus.st_size != size ||
+      (map=mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    (void) close(fd);
     return 1;
   }
-  else
-    log_event(CPDEBUG, "set new gid: %s", Conf_Grp);
+  (void) close(fd);
+  header=map;
+  values=(const unsigned char *) map+sizeof(config_snapshot);
+  snapshot_header(&expected, conffile, ppdname);
+  expected.checksum=header->checksum;
+  if (!memcmp(header, &expected, sizeof(config_snapshot)) &&
+      header->checksum == snapshot_checksum(values, size-sizeof(config_snapshot))) {
+    config_values_restore(values);
+    result=0;
+  }
+  (void) munmap(map, size);
+  return result;
+}
 
-  (void) umask(0022);
+static void store_config_snapshot(char *snapfile, char *conffile, char *ppdname) {
+  /* compiles the options parsed from cups-pdf.conf and the PPD into a
+     snapshot for the following jobs, replaced atomically */
+  config_snapshot header;
+  cp_string tmpfile;
+  FILE *fp;
+  unsigned char *values;
+  size_t size=END_OF_OPTIONS*sizeof(configData[0].value);
+  int fd;
 
-  if (stat(Conf_Spool, &fstatus) || !S_ISDIR(fstatus.st_mode)) {
-    if (create_dir(Conf_Spool, 0)) {
-      log_event(CPERROR, "failed to create spool directory: %s", Conf_Spool);
-      return 1;
-    }
-    if (chmod(Conf_Spool, 0751)) {
-      log_event(CPERROR, "failed to set mode on spool directory: %s", Conf_Spool);
-      return 1;
+  values=malloc(size);
+  if (values == NULL)
+    return;
+  config_values_save(values);
+  snapshot_header(&header, conffile, ppdname);
+  header.checksum=snapshot_checksum(values, size);
+
+  fd=(build_path(tmpfile, "%s.XXXXXX", snapfile))?-1:mkstemp(tmpfile);
+  if (fd < 0 || (fp=fdopen(fd, "w")) == NULL) {
+    if (fd >= 0) {
+      (void) close(fd);
+      (void) unlink(tmpfile);
     }
-    if (chown(Conf_Spool, -1, group->gr_gid))
-      log_event(CPERROR, "failed to set group id %s on spool directory: %s (non fatal)", Conf_Grp, Conf_Spool);
-    log_event(CPSTATUS, "spool directory created: %s", Conf_Spool);
+    free(values);
+    return;
   }
+  (void) fwrite(&header, sizeof(header), 1, fp);
+  (void) fwrite(values, size, 1, fp);
+  if (fclose(fp) || chmod(tmpfile, 0600) || rename(tmpfile, snapfile))
+    (void) unlink(tmpfile);
+  free(values);
+  return;
+}
 
-  (void) umask(0077);
-  return 0;
+static void server_config(char *conffile) {
+  /* parses cups-pdf.conf for the workers forked next, unless it is
+     unchanged since the last call */
+  static unsigned char *defaults=NULL;
+  snapshot_source source;
+  size_t size=END_OF_OPTIONS*sizeof(configData[0].value);
+
+  snapshot_identity(conffile, &source);
+  if (server_values != NULL && !memcmp(&source, &server_source, sizeof(source)))
+    return;
+  if (defaults == NULL && (defaults=malloc(size)) != NULL)
+    config_values_save(defaults);
+  if (server_values == NULL)
+    server_values=malloc(size);
+  if (defaults == NULL || server_values == NULL) {
+    free(server_values);
+    server_values=NULL;
+    return;
+  }
+  config_values_restore(defaults);
+  read_config_file(conffile);
+  config_values_save(server_values);
+  config_values_restore(defaults);
+  server_source=source;
+  snprintf(server_conffile, BUFSIZE, "%s", conffile);
+  return;
 }
 
-static void announce_printers() {
-  DIR *dir;
-  struct dirent *config_ent;
-  int len;
-  cp_string setup;
+static int server_config_valid(char *conffile) {
+  /* the values parsed by the server apply to jobs using the same, still
+     unchanged configuration file */
+  snapshot_source source;
+
+  if (server_values == NULL || strcmp(conffile, server_conffile))
+    return 0;
+  snapshot_identity(conffile, &source);
+  return !memcmp(&source, &server_source, sizeof(source));
+}
+
+static char *user_cache_read(int fd) {
+  struct stat fstatus;
+  char *data;
+  ssize_t count;
+
+  if (fstat(fd, &fstatus) || !S_ISREG(fstatus.st_mode) || fstatus.st_uid ||
+      (data=calloc(fstatus.st_size+1, sizeof(char))) == NULL)
+    return NULL;
+  count=pread(fd, data, fstatus.st_size, 0);
+  if (count < 0)
+    count=0;
+  data[count]='\0';
+  return data;
+}
+
+static char *user_cache_find(char type, const char *name, char *entry) {
+  /* returns the data of a fresh entry copied into entry, or NULL */
+  char *line, *end, *ptr;
+  size_t len=strlen(name);
+  time_t now=time(NULL);
+  int fd;
+
+  if (Conf_UserCacheTTL <= 0)
+    return NULL;
+  if (!user_cache_loaded) {
+    user_cache_loaded=1;
+    fd=open(USER_CACHE, O_RDONLY|O_NOFOLLOW);
+    if (fd >= 0) {
+      (void) flock(fd, LOCK_SH);
+      user_cache=user_cache_read(fd);
+      (void) close(fd);
+    }
+  }
+  for (line=user_cache; line != NULL && *line; line=(*end)?end+1:end) {
+    end=line+strcspn(line, "\n");
+    if (line[0] != type || line[1] != '\t' || strncmp(line+2, name, len) || line[2+len] != '\t')
+      continue;
+    ptr=line+3+len;
+    if (strtol(ptr, &ptr, 10)+Conf_UserCacheTTL <= now || *ptr != '\t' || end-ptr-1 >= BUFSIZE)
+      continue;
+    memcpy(entry, ptr+1, end-ptr-1);
+    entry[end-ptr-1]='\0';
+    return entry;
+  }
+  return NULL;
+}
+
+static void user_cache_store(char type, const char *name, const char *data) {
+  /* replaces the entry for name and drops expired entries, under an
+     exclusive lock on the cache file */
+  char *old, *line, *end, *ptr;
+  size_t len=strlen(name);
+  time_t now=time(NULL);
+  FILE *fp;
+  int fd;
+
+  if (Conf_UserCacheTTL <= 0 || strpbrk(name, "\t\n") != NULL || strpbrk(data, "\n") != NULL)
+    return;
+  fd=open(USER_CACHE, O_RDWR|O_CREAT|O_NOFOLLOW, 0600);
+  if (fd < 0)
+    return;
+  if (flock(fd, LOCK_EX) || (old=user_cache_read(fd)) == NULL || (fp=fdopen(dup(fd), "w")) == NULL) {
+    (void) close(fd);
+    return;
+  }
+  for (line=old; *line; line=(*end)?end+1:end) {
+    end=line+strcspn(line, "\n");
+    ptr=strchr(line, '\t');
+    if (ptr == NULL || ptr > end || (ptr=strchr(ptr+1, '\t')) == NULL || ptr > end ||
+        strtol(ptr+1, NULL, 10)+Conf_UserCacheTTL <= now)
+      continue;
+    if (line[0] == type && line[1] == '\t' && !strncmp(line+2, name, len) && line[2+len] == '\t')
+      continue;
+    (void) fwrite(line, sizeof(char), end-line, fp);
+    (void) fputc('\n', fp);
+  }
+  fprintf(fp, "%c\t%s\t%ld\t%s\n", type, name, (long) now, data);
+  (void) fflush(fp);
+  if (ftruncate(fd, ftell(fp)))
+    log_event(CPERROR, "failed to update user cache: %s (non fatal)", USER_CACHE);
+  (void) fclose(fp);
+  (void) close(fd);
+  free(old);
+  return;
+}
+
+static int lookup_not_found(int error) {
+  /* the errno values getpwnam(3) and getgrnam(3) document for an unknown
+     name; anything else (an unreachable LDAP server, say) is not cached */
+  return (error == 0 || error == ENOENT || error == ESRCH || error == EBADF || error == EPERM);
+}
+
+static struct passwd *cached_getpwnam(const char *name) {
+  /* getpwnam() answered from the user cache for UserCacheTTL seconds,
+     users reported unknown included */
+  static struct passwd cached;
+  static cp_string cached_name, cached_dir;
+  struct passwd *passwd;
+  cp_string entry, data;
+  char *ptr;
+  long uid, gid;
+
+  if ((ptr=user_cache_find('U', name, entry)) != NULL) {
+    if (ptr[0] == '0') {
+      log_event(CPDEBUG, "unknown user answered from cache: %s", name);
+      return NULL;
+    }
+    if (sscanf(ptr, "1\t%ld\t%ld\t", &uid, &gid) == 2 && (ptr=strchr(ptr+2, '\t')) != NULL &&
+        (ptr=strchr(ptr+1, '\t')) != NULL) {
+      snprintf(cached_name, BUFSIZE, "%s", name);
+      snprintf(cached_dir, BUFSIZE, "%s", ptr+1);
+      memset(&cached, 0, sizeof(cached));
+      cached.pw_name=cached_name;
+      cached.pw_passwd="x";
+      cached.pw_uid=(uid_t) uid;
+      cached.pw_gid=(gid_t) gid;
+      cached.pw_gecos="";
+      cached.pw_dir=cached_dir;
+      cached.pw_shell="";
+      log_event(CPDEBUG, "user answered from cache: %s", name);
+      return &cached;
+    }
+  }
+  errno=0;
+  passwd=getpwnam(name);
+  if (passwd == NULL && lookup_not_found(errno))
+    user_cache_store('U', name, "0");
+  else if (passwd == NULL)
+    log_event(CPERROR, "user lookup failed, not cached: %s", name);
+  else if (!strcmp(passwd->pw_name, name)) {
+    snprintf(data, BUFSIZE, "1\t%ld\t%ld\t%s", (long) passwd->pw_uid, (long) passwd->pw_gid, passwd->pw_dir);
+    user_cache_store('U', name, data);
+  }
+  return passwd;
+}
+
+static struct group *cached_getgrnam(const char *name) {
+  static struct group cached;
+  static cp_string cached_name;
+  static char *no_members[]={ NULL };
+  struct group *group;
+  cp_string entry, data;
+  char *ptr;
+  long gid;
+
+  if ((ptr=user_cache_find('G', name, entry)) != NULL) {
+    if (ptr[0] == '0')
+      return NULL;
+    if (sscanf(ptr, "1\t%ld", &gid) == 1) {
+      snprintf(cached_name, BUFSIZE, "%s", name);
+      cached.gr_name=cached_name;
+      cached.gr_passwd="x";
+      cached.gr_gid=(gid_t) gid;
+      cached.gr_mem=no_members;
+      return &cached;
+    }
+  }
+  errno=0;
+  group=getgrnam(name);
+  if (group == NULL && lookup_not_found(errno))
+    user_cache_store('G', name, "0");
+  else if (group == NULL)
+    log_event(CPERROR, "group lookup failed, not cached: %s", name);
+  else {
+    snprintf(data, BUFSIZE, "1\t%ld", (long) group->gr_gid);
+    user_cache_store('G', name, data);
+  }
+  return group;
+}
+
+static int cached_getgrouplist(const char *user, gid_t gid, gid_t **groups, int *ngroups) {
+  /* getgrouplist() that grows groups as needed, answered from the user
+     cache if the primary group matches; returns the number of groups or
+     -1 on failure */
+  cp_string entry, data;
+  char *ptr;
+  gid_t *tmp;
+  long cachedgid, value;
+  int count, i, len;
+
+  if ((ptr=user_cache_find('L', user, entry)) != NULL &&
+      sscanf(ptr, "%ld\t%d\t", &cachedgid, &count) == 2 && (gid_t) cachedgid == gid && count > 0) {
+    if (count > *ngroups) {
+      if ((tmp=realloc(*groups, count*sizeof(gid_t))) == NULL)
+        return -1;
+      *groups=tmp;
+    }
+    ptr=strchr(strchr(ptr, '\t')+1, '\t');
+    for (i=0; i<count && ptr != NULL && sscanf(ptr+1, "%ld", &value) == 1; i++) {
+      (*groups)[i]=(gid_t) value;
+      ptr=strchr(ptr+1, ',');
+    }
+    if (i == count) {
+      *ngroups=count;
+      log_event(CPDEBUG, "group list answered from cache: %s", user);
+      return count;
+    }
+  }
+
+  count=getgrouplist(user, gid, *groups, ngroups);
+  if (count == -1) {
+    if ((tmp=realloc(*groups, (*ngroups)*sizeof(gid_t))) == NULL)
+      return -1;
+    *groups=tmp;
+    count=getgrouplist(user, gid, *groups, ngroups);
+  }
+  if (count < 0)
+    return -1;
+  len=snprintf(data, BUFSIZE, "%ld\t%d", (long) gid, count);
+  for (i=0; i<count && len < BUFSIZE-24; i++)
+    len+=snprintf(data+len, BUFSIZE-len, "%c%ld", (i)?',':'\t', (long) (*groups)[i]);
+  if (i == count)
+    user_cache_store('L', user, data);
+  return count;
+}
+
+static void config_line(FILE *fp, const char *format, ...) {
+  /* one line of the configuration dump, to fp or the debug log */
+  cp_string line;
+  va_list ap;
+
+  va_start(ap, format);
+  (void) vsnprintf(line, BUFSIZE, format, ap);
+  va_end(ap);
+  if (fp != NULL)
+    fprintf(fp, "%s\n", line);
+  else
+    log_event(CPDEBUG, "%s", line);
+  return;
+}
+
+static void dump_configuration(FILE *fp) {
+  if (fp != NULL || (Conf_LogType & CPDEBUG)) {
+    config_line(fp, "*** Final Configuration ***");
+    config_line(fp, "AnonDirName        = \"%s\"", Conf_AnonDirName);
+    config_line(fp, "AnonUser           = \"%s\"", Conf_AnonUser);
+    config_line(fp, "GhostScript        = \"%s\"", Conf_GhostScript);
+    config_line(fp, "GSCall             = \"%s\"", Conf_GSCall);
+    config_line(fp, "Grp                = \"%s\"", Conf_Grp);
+    config_line(fp, "GSTmp              = \"%s\"", Conf_GSTmp);
+    config_line(fp, "Log                = \"%s\"", Conf_Log);
+    config_line(fp, "PDFVer             = \"%s\"", Conf_PDFVer);
+    config_line(fp, "PostProcessing     = \"%s\"", Conf_PostProcessing);
+    config_line(fp, "Out                = \"%s\"", Conf_Out);
+    config_line(fp, "Spool              = \"%s\"", Conf_Spool);
+    config_line(fp, "UserPrefix         = \"%s\"", Conf_UserPrefix);
+    config_line(fp, "RemovePrefix       = \"%s\"", Conf_RemovePrefix);
+    config_line(fp, "OutExtension       = \"%s\"", Conf_OutExtension);
+    config_line(fp, "Cut                = %d", Conf_Cut);
+    config_line(fp, "Truncate           = %d", Conf_Truncate);
+    config_line(fp, "DirPrefix          = %d", Conf_DirPrefix);
+    config_line(fp, "Label              = %d", Conf_Label);
+    config_line(fp, "LogType            = %d", Conf_LogType);
+    config_line(fp, "LowerCase          = %d", Conf_LowerCase);
+    config_line(fp, "TitlePref          = %d", Conf_TitlePref);
+    config_line(fp, "DecodeHexStrings   = %d", Conf_DecodeHexStrings);
+    config_line(fp, "FixNewlines        = %d", Conf_FixNewlines);
+    config_line(fp, "AllowUnsafeOptions = %d", Conf_AllowUnsafeOptions);
+    config_line(fp, "AnonUMask          = %04o", Conf_AnonUMask);
+    config_line(fp, "UserUMask          = %04o", Conf_UserUMask);
+    config_line(fp, "StreamPostScript   = %d", Conf_StreamPostScript);
+    config_line(fp, "GSDaemon           = \"%s\"", Conf_GSDaemon);
+    config_line(fp, "ConversionCache    = \"%s\"", Conf_ConversionCache);
+    config_line(fp, "ConversionCacheSize = %d", Conf_ConversionCacheSize);
+    config_line(fp, "ParallelWorkers    = %d", Conf_ParallelWorkers);
+    config_line(fp, "ParallelMinPages   = %d", Conf_ParallelMinPages);
+    config_line(fp, "TraceFile          = \"%s\"", Conf_TraceFile);
+    config_line(fp, "LogRotateSize      = %d", Conf_LogRotateSize);
+    config_line(fp, "UserCacheTTL       = %d", Conf_UserCacheTTL);
+    config_line(fp, "PostProcessingQueue = \"%s\"", Conf_PostProcessingQueue);
+    config_line(fp, "PostProcessingWorkers = %d", Conf_PostProcessingWorkers);
+    config_line(fp, "PostProcessingTimeout = %d", Conf_PostProcessingTimeout);
+    config_line(fp, "PDFOptimize        = %d", Conf_PDFOptimize);
+    config_line(fp, "PDFOptimizeThreads = %d", Conf_PDFOptimizeThreads);
+    config_line(fp, "MaxConverters      = %d", Conf_MaxConverters);
+    config_line(fp, "ConverterLocks     = \"%s\"", Conf_ConverterLocks);
+    config_line(fp, "ConverterWeight    = %d", Conf_ConverterWeight);
+    config_line(fp, "ConverterNice      = %d", Conf_ConverterNice);
+    config_line(fp, "ConverterCPUs      = \"%s\"", Conf_ConverterCPUs);
+    config_line(fp, "GSProfileText      = \"%s\"", Conf_GSProfileText);
+    config_line(fp, "GSProfileImage     = \"%s\"", Conf_GSProfileImage);
+    config_line(fp, "GSProfileLarge     = \"%s\"", Conf_GSProfileLarge);
+    config_line(fp, "SpoolMemory        = %d", Conf_SpoolMemory);
+    config_line(fp, "SpoolCompress      = %d", Conf_SpoolCompress);
+    config_line(fp, "Capture            = \"%s\"", Conf_Capture);
+    config_line(fp, "CaptureRate        = %d", Conf_CaptureRate);
+    config_line(fp, "*** End of Configuration ***");
+  }
+  return;
+}
+
+static int init(char *argv[]) {
+  struct stat fstatus;
+  struct group *group;
+  cp_string filename, snapfile;
+  int grpstat, snapped;
+  const char *uri=cupsBackendDeviceURI(argv);
+
+  if ((uri != NULL) && (strncmp(uri, "cups-pdf:/", 10) == 0) && strlen(uri) > 10) {
+    uri = uri + 10;
+    sprintf(filename, "%s/cups-pdf-%s.conf", CP_CONFIG_PATH, uri);
+  }
+  else {
+    sprintf(filename, "%s/cups-pdf.conf", CP_CONFIG_PATH);
+  }
+  trace_begin(T_CONFIG);
+  /* a truncated name could be the snapshot of another printer */
+  snapped=!build_path(snapfile, "%s/cups-pdf-%s.snapshot", CP_SNAPSHOT_PATH,
+                      (getenv("PRINTER") != NULL)?getenv("PRINTER"):"default");
+  if (server_config_valid(filename)) {
+    config_values_restore(server_values);
+    read_config_ppd();
+    config_from_server=1;
+  }
+  else if (!snapped || load_config_snapshot(snapfile, filename, getenv("PPD"))) {
+    read_config_file(filename);
+
+    read_config_ppd();
+
+    if (snapped)
+      store_config_snapshot(snapfile, filename, getenv("PPD"));
+  }
+  else
+    config_from_snapshot=1;
+
+  read_config_options(argv[5]);
+  trace_end(T_CONFIG);
+
+  trace_begin(T_SETUP);
+  (void) umask(0077);
+
+  group=cached_getgrnam(Conf_Grp);
+  grpstat=setgid(group->gr_gid);
+
+  if (strlen(Conf_Log)) {
+    if (stat(Conf_Log, &fstatus) || !S_ISDIR(fstatus.st_mode)) {
+      if (create_dir(Conf_Log, 1))
+        return 1;
+      if (chmod(Conf_Log, 0700))
+        return 1;
+    }
+    snprintf(filename, BUFSIZE, "%s/%s%s%s", Conf_Log, "cups-pdf-", getenv("PRINTER"), "_log");
+    logfp=fopen(filename, "a");
+    strcpy(log_path, filename);
+    (void) atexit(log_flush);
+  }
+
+  dump_configuration(NULL);
+  if (config_from_server)
+    log_event(CPDEBUG, "configuration inherited from server: %s", server_conffile);
+  else if (config_from_snapshot)
+    log_event(CPDEBUG, "configuration loaded from snapshot: %s", snapfile);
+  else
+    log_event(CPDEBUG, "configuration parsed, snapshot compiled: %s", snapfile);
+
+  if (!group) {
+    log_event(CPERROR, "Grp not found: %s", Conf_Grp);
+    return 1;
+  }
+  else if (grpstat) {
+    log_event(CPERROR, "failed to set new gid: %s", Conf_Grp);
+    return 1;
+  }
+  else
+    log_event(CPDEBUG, "set new gid: %s", Conf_Grp);
+
+  (void) umask(0022);
+
+  if (stat(Conf_Spool, &fstatus) || !S_ISDIR(fstatus.st_mode)) {
+    if (create_dir(Conf_Spool, 0)) {
+      log_event(CPERROR, "failed to create spool directory: %s", Conf_Spool);
+      return 1;
+    }
+    if (chmod(Conf_Spool, 0751)) {
+      log_event(CPERROR, "failed to set mode on spool directory: %s", Conf_Spool);
+      return 1;
+    }
+    if (chown(Conf_Spool, -1, group->gr_gid))
+      log_event(CPERROR, "failed to set group id %s on spool directory: %s (non fatal)", Conf_Grp, Conf_Spool);
+    log_event(CPSTATUS, "spool directory created: %s", Conf_Spool);
+  }
+
+  if (strlen(Conf_PostProcessingQueue) &&
+      (stat(Conf_PostProcessingQueue, &fstatus) || !S_ISDIR(fstatus.st_mode))) {
+    if (create_dir(Conf_PostProcessingQueue, 0)) {
+      log_event(CPERROR, "failed to create postprocessing queue: %s", Conf_PostProcessingQueue);
+      return 1;
+    }
+    if (chmod(Conf_PostProcessingQueue, 0700)) {
+      log_event(CPERROR, "failed to set mode on postprocessing queue: %s", Conf_PostProcessingQueue);
+      return 1;
+    }
+    log_event(CPSTATUS, "postprocessing queue created: %s", Conf_PostProcessingQueue);
+  }
+
+  if (Conf_MaxConverters && (stat(Conf_ConverterLocks, &fstatus) || !S_ISDIR(fstatus.st_mode))) {
+    if (create_dir(Conf_ConverterLocks, 0)) {
+      log_event(CPERROR, "failed to create converter lock directory: %s", Conf_ConverterLocks);
+      return 1;
+    }
+    if (chmod(Conf_ConverterLocks, 0700)) {
+      log_event(CPERROR, "failed to set mode on converter lock directory: %s", Conf_ConverterLocks);
+      return 1;
+    }
+    log_event(CPSTATUS, "converter lock directory created: %s", Conf_ConverterLocks);
+  }
+
+  if (strlen(Conf_Capture) && (stat(Conf_Capture, &fstatus) || !S_ISDIR(fstatus.st_mode))) {
+    if (create_dir(Conf_Capture, 0)) {
+      log_event(CPERROR, "failed to create capture directory: %s", Conf_Capture);
+      return 1;
+    }
+    if (chmod(Conf_Capture, 0700)) {
+      log_event(CPERROR, "failed to set mode on capture directory: %s", Conf_Capture);
+      return 1;
+    }
+    log_event(CPSTATUS, "capture directory created: %s", Conf_Capture);
+  }
+
+  (void) umask(0077);
+  trace_end(T_SETUP);
+  return 0;
+}
+
+static void announce_printers() {
+  DIR *dir;
+  struct dirent *config_ent;
+  int len;
+  cp_string setup;
 
   printf("file cups-pdf:/ \"Virtual PDF Printer\" \"CUPS-PDF\" \"MFG:Generic;MDL:CUPS-PDF Printer;DES:Generic CUPS-PDF Printer;CLS:PRINTER;CMD:PDF,POSTSCRIPT;\"\n");
 
@@ -675,187 +1711,4044 @@ static int preparetitle(char *title) {
   return strcmp(title, "");
 }
 
-static char *fgets2(char *fbuffer, int fbufsize, FILE *ffpsrc) {
-  /* like fgets() but linedelimiters are 0x0A, 0x0C, 0x0D (LF, FF, CR). */
-  int c, pos;
-  char *result;
+static size_t find_delimiter_scalar(const char *data, size_t len, int fix) {
+  /* returns the index of the first line delimiter in data or len:
+     LF, or with FixNewlines also FF and CR */
+  const char *ptr;
+  size_t i;
 
-  if (!Conf_FixNewlines)
-    return fgets(fbuffer, fbufsize, ffpsrc);
+  if (!fix) {
+    ptr=memchr(data, 0x0A, len);
+    return (ptr == NULL)?len:(size_t)(ptr-data);
+  }
+  for (i=0; i<len; i++)
+    if (data[i] == 0x0A || data[i] == 0x0C || data[i] == 0x0D)
+      break;
+  return i;
+}
 
-  result=NULL;
-  pos=0;
+#ifdef CP_X86_SIMD
+__attribute__((target("sse2")))
+static size_t find_delimiter_sse2(const char *data, size_t len, int fix) {
+  const __m128i lf=_mm_set1_epi8(0x0A), ff=_mm_set1_epi8(0x0C), cr=_mm_set1_epi8(0x0D);
+  __m128i block, match;
+  unsigned int mask;
+  size_t i;
 
-  while (pos < fbufsize) {      /* pos in [0..fbufsize-1] */
-    c=fgetc(ffpsrc);          /* converts CR/LF to LF in some OSses */
-    if (c == EOF)           /* EOF _or_ error */
-      break;
-    fbuffer[pos++]=c;
-    if (c == 0x0A || c == 0x0C || c == 0x0D) /* line is at an end */
-      break;
+  for (i=0; i+16 <= len; i+=16) {
+    block=_mm_loadu_si128((const __m128i *)(data+i));
+    match=_mm_cmpeq_epi8(block, lf);
+    if (fix)
+      match=_mm_or_si128(match, _mm_or_si128(_mm_cmpeq_epi8(block, ff), _mm_cmpeq_epi8(block, cr)));
+    mask=(unsigned int)_mm_movemask_epi8(match);
+    if (mask)
+      return i+__builtin_ctz(mask);
   }
+  return i+find_delimiter_scalar(data+i, len-i, fix);
+}
 
-  if (pos > 0 && !ferror(ffpsrc)) { /* at least one char read and no error */
-    fbuffer[pos]='\0';
-    result=fbuffer;
-  }
+__attribute__((target("avx2")))
+static size_t find_delimiter_avx2(const char *data, size_t len, int fix) {
+  const __m256i lf=_mm256_set1_epi8(0x0A), ff=_mm256_set1_epi8(0x0C), cr=_mm256_set1_epi8(0x0D);
+  __m256i block, match;
+  unsigned int mask;
+  size_t i;
 
-  return result;
+  for (i=0; i+32 <= len; i+=32) {
+    block=_mm256_loadu_si256((const __m256i *)(data+i));
+    match=_mm256_cmpeq_epi8(block, lf);
+    if (fix)
+      match=_mm256_or_si256(match, _mm256_or_si256(_mm256_cmpeq_epi8(block, ff), _mm256_cmpeq_epi8(block, cr)));
+    mask=(unsigned int)_mm256_movemask_epi8(match);
+    if (mask)
+      return i+__builtin_ctz(mask);
+  }
+  return i+find_delimiter_sse2(data+i, len-i, fix);
 }
+#endif
 
-static int preparespoolfile(FILE *fpsrc, char *spoolfile, char *title, char *cmdtitle,
-                     int job, struct passwd *passwd) {
-  cp_string buffer;
-  int rec_depth,is_title=0;
-  FILE *fpdest;
-  size_t bytes = 0;
+static int reader_open(line_reader *reader, int fd) {
+  struct stat fstatus;
 
-  if (fpsrc == NULL) {
-    log_event(CPERROR, "failed to open source stream");
-    return 1;
-  }
-  log_event(CPDEBUG, "source stream ready");
-  fpdest=fopen(spoolfile, "w");
-  if (fpdest == NULL) {
-    log_event(CPERROR, "failed to open spoolfile: %s", spoolfile);
-    (void) fclose(fpsrc);
-    return 1;
-  }
-  log_event(CPDEBUG, "destination stream ready: %s", spoolfile);
-  if (chown(spoolfile, passwd->pw_uid, -1)) {
-    log_event(CPERROR, "failed to set owner for spoolfile: %s", spoolfile);
-    return 1;
+  if (find_delimiter == NULL) {
+    find_delimiter=find_delimiter_scalar;
+#ifdef CP_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      find_delimiter=find_delimiter_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+      find_delimiter=find_delimiter_sse2;
+#endif
   }
-  log_event(CPDEBUG, "owner set for spoolfile: %s", spoolfile);
-  rec_depth=0;
-  if (Conf_FixNewlines)
-    log_event(CPSTATUS, "***Experimental Option: FixNewlines");
-  else
-    log_event(CPDEBUG, "using traditional fgets");
+  reader->fd=fd;
+  reader->pos=0;
+  reader->len=0;
+  reader->offset=lseek(fd, 0, SEEK_CUR);
+  if (reader->offset < 0)
+    reader->offset=0;
+  reader->line_offset=reader->offset;
+  reader->eof=0;
 
-  while (fgets2(buffer, BUFSIZE, fpsrc) != NULL) {
-    if (!strncmp(buffer, "%PDF", 4)) {
-      log_event(CPDEBUG, "found beginning of PDF code: %s", buffer);
-      input_is_pdf=1;
+  /* regular files are read rather than mapped: a file truncated while
+     mapped would raise SIGBUS */
+  if (!fstat(fd, &fstatus) && S_ISREG(fstatus.st_mode))
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  reader->size=READSIZE+BUFSIZE;
+  reader->data=malloc(reader->size);
+  return (reader->data == NULL);
+}
+
+static void reader_close(line_reader *reader) {
+  free(reader->data);
+  reader->data=NULL;
+  return;
+}
+
+static int read_line(line_reader *reader, const char **line, size_t *len) {
+  /* returns the next line in the very same pieces fgets() resp. the former
+     fgets2() for FixNewlines cut the input into: up to and including the
+     delimiter, but at most BUFSIZE-1 resp. BUFSIZE characters */
+  size_t maxlen=(Conf_FixNewlines)?BUFSIZE:BUFSIZE-1, avail, window, n;
+  ssize_t count;
+
+  while (1) {
+    avail=reader->len-reader->pos;
+    window=(avail < maxlen)?avail:maxlen;
+    n=find_delimiter(reader->data+reader->pos, window, Conf_FixNewlines);
+    if (n < window) {
+      n++;
       break;
     }
-    if (!strncmp(buffer, "%!", 2) && strncmp(buffer, "%!PS-AdobeFont", 14)) {
-      log_event(CPDEBUG, "found beginning of postscript code: %s", buffer);
+    if (avail >= maxlen || (reader->eof && avail)) {
+      n=window;
       break;
     }
+    if (reader->eof)
+      return 0;
+    if (reader->pos) {
+      memmove(reader->data, reader->data+reader->pos, avail);
+      reader->offset+=reader->pos;
+      reader->len=avail;
+      reader->pos=0;
+    }
+    count=read(reader->fd, reader->data+reader->len, reader->size-reader->len);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      reader->eof=1;
+    else {
+      reader->len+=count;
+      trace->input_bytes+=count;
+    }
   }
+  *line=reader->data+reader->pos;
+  *len=n;
+  reader->line_offset=reader->offset+reader->pos;
+  reader->pos+=n;
+  return 1;
+}
 
-  (void) fputs(buffer, fpdest);
+static size_t line_length(const char *line, size_t len) {
+  /* length of the line as a C string, i.e. as far as fputs() would write it */
+  const char *nul=memchr(line, '\0', len);
 
-  if (input_is_pdf) {
-    while((bytes = fread(buffer, sizeof(char), BUFSIZE, fpsrc)) > 0)
-      fwrite(buffer, sizeof(char), bytes, fpdest);
-  } else {
-    log_event(CPDEBUG, "now extracting postscript code");
-    while (fgets2(buffer, BUFSIZE, fpsrc) != NULL) {
-      (void) fputs(buffer, fpdest);
-      if (!is_title && !rec_depth)
-        if (sscanf(buffer, "%%%%Title: %"TBUFSIZE"c", title)==1) {
-          log_event(CPDEBUG, "found title in ps code: %s", title);
-          is_title=1;
-        }
-      if (!strncmp(buffer, "%!", 2)) {
-        log_event(CPDEBUG, "found embedded (e)ps code: %s", buffer);
-        rec_depth++;
-      }
-      else if (!strncmp(buffer, "%%EOF", 5)) {
-        if (!rec_depth) {
-          log_event(CPDEBUG, "found end of postscript code: %s", buffer);
-          break;
-        }
-        else {
-          log_event(CPDEBUG, "found end of embedded (e)ps code: %s", buffer);
-          rec_depth--;
-        }
+  return (nul == NULL)?len:(size_t)(nul-line);
+}
+
+static int line_complete(const char *line, size_t len) {
+  return (len > 0 && (line[len-1] == 0x0A || line[len-1] == 0x0C || line[len-1] == 0x0D));
+}
+
+static void index_init(void) {
+  memset(&job_index, 0, sizeof(job_index));
+  job_index.version=DSC_INDEX_VERSION;
+  job_index.declared_pages=-1;
+  job_index.prolog=-1;
+  job_index.setup_end=-1;
+  job_index.trailer=-1;
+  spool_offset=0;
+  profile_images=0;
+  profile_data=0;
+  profiling=(strlen(Conf_GSProfileText) || strlen(Conf_GSProfileImage) || strlen(Conf_GSProfileLarge));
+  index_depth=0;
+  index_line_start=1;
+  return;
+}
+
+static void index_value(char *dest, size_t size, const char *value) {
+  /* copies the value of a DSC comment without blanks and line delimiter */
+  size_t len;
+
+  while (*value == ' ' || *value == '\t')
+    value++;
+  len=strcspn(value, "\r\n\f");
+  if (len >= size)
+    len=size-1;
+  memcpy(dest, value, len);
+  dest[len]='\0';
+  return;
+}
+
+static void index_line(const char *dsc, size_t len, int complete) {
+  /* accounts for a line of len bytes written to the spool file and records
+     its offset if it is a DSC comment of interest; dsc is the line as a
+     string if it starts with %, complete tells whether it was terminated */
+  long long offset=spool_offset, *tmp;
+  int start=index_line_start, ordinal;
+
+  spool_offset+=len;
+  index_line_start=complete;
+  if (dsc == NULL || !start)
+    return;
+  if (!offset) {
+    job_index.conforming=!strncmp(dsc, "%!PS-Adobe-", 11);
+    return;
+  }
+  if (!strncmp(dsc, "%%BeginDocument", 15) || !strncmp(dsc, "%!", 2)) {
+    if (++index_depth > job_index.max_depth)
+      job_index.max_depth=index_depth;
+    return;
+  }
+  if (!strncmp(dsc, "%%EndDocument", 13) || !strncmp(dsc, "%%EOF", 5)) {
+    if (index_depth)
+      index_depth--;
+    return;
+  }
+  if (index_depth)
+    return;
+
+  if (!strncmp(dsc, "%%Page:", 7)) {
+    if (!job_index.conforming || job_index.trailer >= 0)
+      return;
+    if (sscanf(dsc, "%%%%Page: %*s %d", &ordinal) != 1 || ordinal != job_index.npages+1) {
+      log_event(CPDEBUG, "unexpected page ordinal: %s", dsc);
+      job_index.conforming=0;
+      return;
+    }
+    if (job_index.npages == job_pages_allocated) {
+      tmp=realloc(job_pages, ((job_pages_allocated)?2*job_pages_allocated:256)*sizeof(long long));
+      if (tmp == NULL) {
+        log_event(CPERROR, "failed to allocate memory for page index");
+        job_index.conforming=0;
+        return;
       }
+      job_pages=tmp;
+      job_pages_allocated=(job_pages_allocated)?2*job_pages_allocated:256;
     }
+    job_pages[job_index.npages++]=offset;
+  }
+  else if (!strncmp(dsc, "%%Trailer", 9)) {
+    if (job_index.trailer < 0)
+      job_index.trailer=offset;
+  }
+  else if (!strncmp(dsc, "%%BeginProlog", 13)) {
+    if (job_index.prolog < 0)
+      job_index.prolog=offset;
+  }
+  else if (!strncmp(dsc, "%%EndSetup", 10)) {
+    if (job_index.setup_end < 0)
+      job_index.setup_end=offset;
   }
+  else if (!strncmp(dsc, "%%Pages:", 8))
+    (void) sscanf(dsc, "%%%%Pages: %d", &job_index.declared_pages);
+  else if (!strncmp(dsc, "%%BoundingBox:", 14))
+    job_index.has_bbox=(sscanf(dsc, "%%%%BoundingBox: %d %d %d %d", &job_index.bbox[0],
+                               &job_index.bbox[1], &job_index.bbox[2], &job_index.bbox[3]) == 4);
+  else if (!strncmp(dsc, "%%Creator:", 10))
+    index_value(job_index.creator, sizeof(job_index.creator), dsc+10);
+  else if (!strncmp(dsc, "%%For:", 6))
+    index_value(job_index.user, sizeof(job_index.user), dsc+6);
+  return;
+}
 
-  (void) fclose(fpdest);
-  (void) fclose(fpsrc);
-  log_event(CPDEBUG, "all data written to spoolfile: %s", spoolfile);
+static void profile_line(const char *line, size_t len) {
+  /* counts the image operators of a line of code, or its bytes if it has
+     no blank in the first 64 and so looks like image data */
+  const char *found;
 
-  if (cmdtitle == NULL || !strcmp(cmdtitle, "(stdin)"))
-    buffer[0]='\0';
-  else
-    strncpy(buffer, cmdtitle, BUFSIZE);
-  if (title == NULL || !strcmp(title, "((stdin))"))
-    title[0]='\0';
+  if (len >= 64 && memchr(line, ' ', 64) == NULL) {
+    profile_data+=len;
+    return;
+  }
+  while ((found=memmem(line, len, "image", 5)) != NULL) {
+    profile_images++;
+    len-=found+5-line;
+    line=found+5;
+  }
+  return;
+}
 
-  if (Conf_TitlePref) {
+static void index_store(char *spoolfile, struct passwd *passwd) {
+  /* writes the DSC index next to the spool file, readable by the user the
+     job is converted for */
+  cp_string indexfile;
+  FILE *fp;
+
+  log_event(CPDEBUG, "DSC index: %d pages (%d declared), depth %d, %s, creator \"%s\", for \"%s\"",
+            job_index.npages, job_index.declared_pages, job_index.max_depth,
+            (job_index.conforming)?"conforming":"not conforming", job_index.creator, job_index.user);
+  fp=(build_path(indexfile, "%s.idx", spoolfile))?NULL:fopen(indexfile, "w");
+  if (fp == NULL) {
+    log_event(CPERROR, "failed to write DSC index: %s (non fatal)", indexfile);
+    return;
+  }
+  (void) fwrite(&job_index, sizeof(job_index), 1, fp);
+  if (job_index.npages)
+    (void) fwrite(job_pages, sizeof(long long), job_index.npages, fp);
+  if (fclose(fp) || chown(indexfile, passwd->pw_uid, -1)) {
+    log_event(CPERROR, "failed to write DSC index: %s (non fatal)", indexfile);
+    (void) unlink(indexfile);
+    return;
+  }
+  log_event(CPDEBUG, "DSC index written: %s", indexfile);
+  return;
+}
+
+static int remove_spoolfile(char *spoolfile) {
+  cp_string indexfile;
+
+  if (spool_memfd >= 0) {
+    (void) close(spool_memfd);
+    spool_memfd=-1;
+    return 0;
+  }
+  if (!build_path(indexfile, "%s.idx", spoolfile))
+    (void) unlink(indexfile);
+  return unlink(spoolfile);
+}
+
+static int write_all(int fd, const char *buffer, size_t count) {
+  ssize_t written;
+
+  while (count > 0) {
+    written=write(fd, buffer, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    buffer+=written;
+    count-=written;
+  }
+  return 0;
+}
+
+/* with SpoolMemory set the spool starts out as an anonymous memory file,
+   which is copied to the spool directory once it grows beyond the limit.
+   a spool that stays in memory is sealed and handed to the converter as
+   /proc/self/fd/<n>. with SpoolCompress set, a spool growing beyond that
+   limit is rewritten as gzip data of the fastest zlib level and is fed to
+   the converter through a pipe */
+
+typedef struct {
+  char *spoolfile;
+  uid_t uid;
+  int fd;                       /* spool_memfd or the file on disk */
+  off_t size;                   /* postscript data spooled so far */
+  off_t limit, compress;        /* thresholds, -1: not any more */
+  z_stream zstream;
+  char *zbuffer;                /* NULL unless compressing */
+  long long zbytes;             /* compressed data written */
+  double ztime;                 /* spent in deflate() */
+} spool_sink;
+
+static int spool_deflate(spool_sink *sink, int fd, const char *data, size_t len, int flush) {
+  double start=trace_clock();
+
+  sink->zstream.next_in=(Bytef *) data;
+  sink->zstream.avail_in=len;
+  do {
+    sink->zstream.next_out=(Bytef *) sink->zbuffer;
+    sink->zstream.avail_out=READSIZE;
+    if (deflate(&sink->zstream, flush) == Z_STREAM_ERROR)
+      return 1;
+    len=READSIZE-sink->zstream.avail_out;
+    if (write_all(fd, sink->zbuffer, len))
+      return 1;
+    sink->zbytes+=len;
+  } while (!sink->zstream.avail_out);
+  sink->ztime+=trace_clock()-start;
+  return 0;
+}
+
+static int spool_copy(spool_sink *sink, int fd) {
+  /* copies the data spooled so far to fd, compressing it once a zbuffer
+     is set */
+  char buffer[READSIZE];
+  off_t offset=0;
+  ssize_t count;
+
+  while (offset < sink->size) {
+    count=pread(sink->fd, buffer, (sink->size-offset < READSIZE)?sink->size-offset:READSIZE, offset);
+    if (count <= 0)
+      return 1;
+    if ((sink->zbuffer != NULL)?spool_deflate(sink, fd, buffer, count, Z_NO_FLUSH):
+                                write_all(fd, buffer, count))
+      return 1;
+    offset+=count;
+  }
+  return 0;
+}
+
+static int spool_move(spool_sink *sink, int compress) {
+  /* replaces the spool by a new spool file, compressed or not; on failure
+     the job stays where it is */
+  cp_string newfile;
+  int fd=-1;
+
+  if (build_path(newfile, "%s.new", sink->spoolfile)) {
+    log_event(CPERROR, "spool file name too long to move spool to %s: %s (non fatal)",
+              (compress)?"compressed file":"disk", sink->spoolfile);
+    return 1;
+  }
+  if (compress) {
+    sink->zbuffer=malloc(READSIZE);
+    if (sink->zbuffer != NULL && deflateInit2(&sink->zstream, Z_BEST_SPEED, Z_DEFLATED, 15+16, 8,
+                                              Z_DEFAULT_STRATEGY) != Z_OK) {
+      free(sink->zbuffer);
+      sink->zbuffer=NULL;
+    }
+  }
+  if ((compress && sink->zbuffer == NULL) ||
+      (fd=open(newfile, O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0 || fchown(fd, sink->uid, -1) ||
+      spool_copy(sink, fd) || rename(newfile, sink->spoolfile)) {
+    log_event(CPERROR, "failed to move spool to %s: %s (non fatal)",
+              (compress)?"compressed file":"disk", sink->spoolfile);
+    if (fd >= 0) {
+      (void) close(fd);
+      (void) unlink(newfile);
+    }
+    if (sink->zbuffer != NULL) {
+      (void) deflateEnd(&sink->zstream);
+      free(sink->zbuffer);
+      sink->zbuffer=NULL;
+      sink->zbytes=0;
+      sink->ztime=0;
+    }
+    return 1;
+  }
+  (void) close(sink->fd);
+  if (sink->fd == spool_memfd)
+    spool_memfd=-1;
+  sink->fd=fd;
+  log_event(CPDEBUG, "spool moved to %s after %lld bytes: %s", (compress)?"compressed file":"disk",
+            (long long) sink->size, sink->spoolfile);
+  return 0;
+}
+
+static ssize_t spool_write(void *cookie, const char *data, size_t len) {
+  spool_sink *sink=cookie;
+
+  if (sink->zbuffer == NULL && sink->compress >= 0 && sink->size+(off_t) len > sink->compress &&
+      spool_move(sink, 1))
+    sink->compress=-1;
+  if (spool_memfd >= 0 && sink->limit >= 0 && sink->size+(off_t) len > sink->limit &&
+      spool_move(sink, 0))
+    sink->limit=-1;
+  if ((sink->zbuffer != NULL)?spool_deflate(sink, sink->fd, data, len, Z_NO_FLUSH):
+                              write_all(sink->fd, data, len))
+    return -1;
+  sink->size+=len;
+  return len;
+}
+
+static int spool_close(void *cookie) {
+  spool_sink *sink=cookie;
+  int status=0;
+
+  if (sink->zbuffer != NULL) {
+    if (spool_deflate(sink, sink->fd, NULL, 0, Z_FINISH)) {
+      log_event(CPERROR, "failed to write compressed spool: %s", sink->spoolfile);
+      status=EOF;
+    }
+    (void) deflateEnd(&sink->zstream);
+    free(sink->zbuffer);
+    spool_compressed=1;
+    log_event(CPDEBUG, "spool compressed: %lld bytes into %lld bytes (%.1f%%) at %.1f MB/s",
+              (long long) sink->size, sink->zbytes, sink->zbytes*100.0/sink->size,
+              (sink->ztime > 0)?sink->size/sink->ztime/1048576:0);
+  }
+  if (spool_memfd < 0) {
+    if (close(sink->fd))
+      status=EOF;
+  }
+#ifdef F_ADD_SEALS
+  else if (fcntl(spool_memfd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL))
+    log_event(CPERROR, "failed to seal memory spool (non fatal)");
+#endif
+  log_event(CPDEBUG, "spool closed: %lld bytes %s", (long long) sink->size,
+            (spool_memfd >= 0)?"in memory":"on disk");
+  free(sink);
+  return status;
+}
+
+static FILE *spool_open(char *spoolfile, struct passwd *passwd) {
+  /* returns NULL if the job has to be spooled by a plain stdio stream */
+  cookie_io_functions_t io={ NULL, spool_write, NULL, spool_close };
+  spool_sink *sink;
+  FILE *fp=NULL;
+
+  if (!Conf_SpoolMemory && !Conf_SpoolCompress)
+    return NULL;
+  sink=calloc(1, sizeof(spool_sink));
+  if (sink == NULL)
+    return NULL;
+  sink->spoolfile=spoolfile;
+  sink->uid=passwd->pw_uid;
+  sink->fd=-1;
+  sink->limit=(off_t) Conf_SpoolMemory*1024;
+  sink->compress=(Conf_SpoolCompress)?(off_t) Conf_SpoolCompress*1048576:-1;
+#ifdef MFD_ALLOW_SEALING
+  if (Conf_SpoolMemory) {
+    spool_memfd=memfd_create("cups2pdf-spool", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+    if (spool_memfd >= 0 && fchown(spool_memfd, passwd->pw_uid, -1)) {
+      (void) close(spool_memfd);
+      spool_memfd=-1;
+    }
+    sink->fd=spool_memfd;
+  }
+#endif
+  if (Conf_SpoolMemory && spool_memfd < 0)
+    log_event(CPDEBUG, "memory spool not available, spooling to disk");
+  if (sink->fd < 0) {
+    sink->fd=open(spoolfile, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if (sink->fd >= 0 && fchown(sink->fd, passwd->pw_uid, -1)) {
+      log_event(CPERROR, "failed to set owner for spoolfile: %s", spoolfile);
+      (void) close(sink->fd);
+      sink->fd=-1;
+    }
+  }
+  if (sink->fd >= 0)
+    fp=fopencookie(sink, "w", io);
+  if (fp == NULL) {
+    if (sink->fd >= 0)
+      (void) close(sink->fd);
+    spool_memfd=-1;
+    free(sink);
+    return NULL;
+  }
+  if (spool_memfd >= 0)
+    log_event(CPDEBUG, "destination stream ready in memory up to %d kB", Conf_SpoolMemory);
+  else
+    log_event(CPDEBUG, "destination stream ready: %s", spoolfile);
+  if (sink->compress >= 0)
+    log_event(CPDEBUG, "spool compressed beyond %d MB", Conf_SpoolCompress);
+  return fp;
+}
+
+static int extract_postscript(FILE *fpdest, char *title, int header_only) {
+  /* copies postscript code up to the final %%EOF, looking for a title as long
+     as title is not NULL; with header_only set it stops after the DSC header.
+     only lines starting with % are inspected for DSC comments.
+     returns 1 when the end of the postscript code has been reached */
+  char buffer[BUFSIZE+1];
+  const char *line;
+  size_t len;
+  int complete;
+
+  while (read_line(&src_reader, &line, &len)) {
+    complete=line_complete(line, len);
+    len=line_length(line, len);
+    (void) fwrite(line, sizeof(char), len, fpdest);
+    if (spool_hashing)
+      sha256_update(&spool_hash, line, len);
+    if (!len || line[0] != '%') {
+      index_line(NULL, len, complete);
+      if (profiling)
+        profile_line(line, len);
+      if (header_only && !ps_rec_depth) {
+        log_event(CPDEBUG, "found end of postscript header");
+        return 0;
+      }
+      continue;
+    }
+    memcpy(buffer, line, len);
+    buffer[len]='\0';
+    index_line(buffer, len, complete);
+    if (title != NULL && !ps_rec_depth)
+      if (sscanf(buffer, "%%%%Title: %"TBUFSIZE"c", title)==1) {
+        log_event(CPDEBUG, "found title in ps code: %s", title);
+        title=NULL;
+      }
+    if (!strncmp(buffer, "%!", 2)) {
+      log_event(CPDEBUG, "found embedded (e)ps code: %s", buffer);
+      ps_rec_depth++;
+    }
+    else if (!strncmp(buffer, "%%EOF", 5)) {
+      if (!ps_rec_depth) {
+        log_event(CPDEBUG, "found end of postscript code: %s", buffer);
+        return 1;
+      }
+      else {
+        log_event(CPDEBUG, "found end of embedded (e)ps code: %s", buffer);
+        ps_rec_depth--;
+      }
+    }
+    if (header_only && !ps_rec_depth &&
+        (strncmp(buffer, "%%", 2) || !strncmp(buffer, "%%EndComments", 13))) {
+      log_event(CPDEBUG, "found end of postscript header: %s", buffer);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* a minimal PDF lexer, shared by the title lookup and the optimiser */
+
+static int pdf_space(int c) {
+  return (c == 0 || c == '\t' || c == '\n' || c == '\f' || c == '\r' || c == ' ');
+}
+
+static int pdf_delimiter(int c) {
+  return (c == '(' || c == ')' || c == '<' || c == '>' || c == '[' || c == ']' ||
+          c == '{' || c == '}' || c == '/' || c == '%');
+}
+
+static size_t pdf_skip_space(const char *d, size_t len, size_t pos) {
+  while (pos < len) {
+    if (d[pos] == '%')
+      while (pos < len && d[pos] != '\n' && d[pos] != '\r')
+        pos++;
+    else if (pdf_space(d[pos]))
+      pos++;
+    else
+      break;
+  }
+  return pos;
+}
+
+static size_t pdf_token(const char *d, size_t len, size_t pos) {
+  /* returns the end of the token starting at pos */
+  int depth=0;
+
+  if (pos >= len)
+    return len;
+  switch (d[pos]) {
+    case '(':
+      for (; pos < len; pos++) {
+        if (d[pos] == '\\')
+          pos++;
+        else if (d[pos] == '(')
+          depth++;
+        else if (d[pos] == ')' && !--depth)
+          return pos+1;
+      }
+      return len;
+    case '<':
+      if (pos+1 < len && d[pos+1] == '<')
+        return pos+2;
+      while (pos < len && d[pos] != '>')
+        pos++;
+      return (pos < len)?pos+1:len;
+    case '>':
+      return (pos+1 < len && d[pos+1] == '>')?pos+2:pos+1;
+    case ')': case '[': case ']': case '{': case '}':
+      return pos+1;
+    case '/':
+      pos++;
+      /* fall through */
+    default:
+      while (pos < len && !pdf_space(d[pos]) && !pdf_delimiter(d[pos]))
+        pos++;
+      return pos;
+  }
+}
+
+static int pdf_is(const char *d, size_t start, size_t end, const char *word) {
+  return (end-start == strlen(word) && !memcmp(d+start, word, end-start));
+}
+
+static int pdf_integer(const char *d, size_t start, size_t end, long *value) {
+  size_t pos;
+
+  if (start == end || end-start > 18)
+    return 0;
+  *value=0;
+  for (pos=start; pos<end; pos++) {
+    if (!isdigit((unsigned char) d[pos]))
+      return 0;
+    *value=*value*10+d[pos]-'0';
+  }
+  return 1;
+}
+
+static size_t pdf_object_end(const char *d, size_t len, size_t pos) {
+  /* skips the object at pos, an indirect reference "n g R" included */
+  size_t end, pos2, end2, pos3, end3;
+  long value;
+  int depth;
+
+  pos=pdf_skip_space(d, len, pos);
+  end=pdf_token(d, len, pos);
+  if (pdf_is(d, pos, end, "<<") || pdf_is(d, pos, end, "[")) {
+    for (depth=1; depth && end < len; ) {
+      pos=pdf_skip_space(d, len, end);
+      end=pdf_token(d, len, pos);
+      if (pdf_is(d, pos, end, "<<") || pdf_is(d, pos, end, "["))
+        depth++;
+      else if (pdf_is(d, pos, end, ">>") || pdf_is(d, pos, end, "]"))
+        depth--;
+    }
+    return end;
+  }
+  if (pdf_integer(d, pos, end, &value)) {
+    pos2=pdf_skip_space(d, len, end);
+    end2=pdf_token(d, len, pos2);
+    pos3=pdf_skip_space(d, len, end2);
+    end3=pdf_token(d, len, pos3);
+    if (pdf_integer(d, pos2, end2, &value) && pdf_is(d, pos3, end3, "R"))
+      return end3;
+  }
+  return end;
+}
+
+static int pdf_dict_value(const char *d, size_t start, size_t end, const char *key,
+                          size_t *kstart, size_t *vstart, size_t *vend) {
+  /* looks key up in the dictionary at start; kstart, vstart and vend
+     receive the position of the key and the extent of its value */
+  size_t pos, tend;
+
+  pos=pdf_skip_space(d, end, start);
+  tend=pdf_token(d, end, pos);
+  if (!pdf_is(d, pos, tend, "<<"))
+    return 0;
+  for (;;) {
+    pos=pdf_skip_space(d, end, tend);
+    tend=pdf_token(d, end, pos);
+    if (tend == pos || d[pos] != '/')
+      return 0;
+    *kstart=pos;
+    *vstart=pdf_skip_space(d, end, tend);
+    *vend=pdf_object_end(d, end, tend);
+    if (pdf_is(d, pos, tend, key))
+      return 1;
+    tend=*vend;
+  }
+}
+
+static void pdf_trim(const char *d, size_t *start, size_t *end) {
+  while (*start < *end && pdf_space(d[*start]))
+    (*start)++;
+  while (*end > *start && pdf_space(d[*end-1]))
+    (*end)--;
+  return;
+}
+
+/* PDF titles are taken from the document information dictionary or the
+   XMP metadata, found through the cross-reference data at the end of a
+   seekable PDF; only the few blocks needed for that are read */
+
+#define PDF_READSIZE 4096
+#define PDF_PEEKSIZE 1024               /* first read of objects and trailers */
+#define PDF_LINESIZE 64
+#define PDF_READLIMIT 262144            /* bytes read per lookup at most */
+#define PDF_SECTIONS 16                 /* revisions followed through /Prev */
+#define PDF_SUBSECTIONS 32
+
+struct pdf_section {
+  int is_stream, nsub, entrylen, w[3], predictor, columns, flate;
+  long first[PDF_SUBSECTIONS], count[PDF_SUBSECTIONS], info, root;
+  off_t entries[PDF_SUBSECTIONS], data, prev;
+  size_t length;
+};
+
+struct pdf_stream {
+  z_stream z;
+  off_t pos, end;
+  int flate;
+  unsigned char in[PDF_READSIZE+1];
+};
+
+static struct pdf_section pdf_sections[PDF_SECTIONS];
+static int pdf_nsections, pdf_fd;
+static off_t pdf_base, pdf_size;
+static size_t pdf_read_total;
+
+static const unsigned short pdf_doc_encoding[] = {  /* 0x80 to 0xA0 */
+  0x2022, 0x2020, 0x2021, 0x2026, 0x2014, 0x2013, 0x0192, 0x2044, 0x2039, 0x203A, 0x2212,
+  0x2030, 0x201E, 0x201C, 0x201D, 0x2018, 0x2019, 0x201A, 0x2122, 0xFB01, 0xFB02, 0x0141,
+  0x0152, 0x0160, 0x0178, 0x017D, 0x0131, 0x0142, 0x0153, 0x0161, 0x017E, 0xFFFD, 0x20AC };
+
+static const unsigned short pdf_doc_accents[] = {   /* 0x18 to 0x1F */
+  0x02D8, 0x02C7, 0x02C6, 0x02D9, 0x02DD, 0x02DB, 0x02DA, 0x02DC };
+
+static size_t pdf_read(char *buffer, size_t size, off_t offset) {
+  /* reads up to size-1 bytes at offset within the PDF and terminates them */
+  ssize_t count;
+
+  buffer[0]='\0';
+  if (offset < 0 || offset >= pdf_size || pdf_read_total >= PDF_READLIMIT)
+    return 0;
+  if ((off_t)(size-1) > pdf_size-offset)
+    size=pdf_size-offset+1;
+  do
+    count=pread(pdf_fd, buffer, size-1, pdf_base+offset);
+  while (count < 0 && errno == EINTR);
+  if (count <= 0)
+    return 0;
+  pdf_read_total+=count;
+  buffer[count]='\0';
+  return count;
+}
+
+static size_t pdf_read_rest(char *buffer, size_t size, size_t len, off_t offset) {
+  /* continues a read of PDF_PEEKSIZE bytes at offset unless the object
+     in buffer ends within them */
+  if (len < PDF_PEEKSIZE-1 || memmem(buffer, len, "endobj", 6) != NULL ||
+      memmem(buffer, len, "stream", 6) != NULL || memmem(buffer, len, "startxref", 9) != NULL)
+    return len;
+  return len+pdf_read(buffer+len, size-len, offset+len);
+}
+
+static int pdf_ref(const char *d, size_t start, size_t end, long *num) {
+  /* parses the indirect reference "n g R" */
+  size_t pos, tend;
+  long gen;
+
+  tend=pdf_token(d, end, start);
+  if (!pdf_integer(d, start, tend, num))
+    return 0;
+  pos=pdf_skip_space(d, end, tend);
+  tend=pdf_token(d, end, pos);
+  if (!pdf_integer(d, pos, tend, &gen))
+    return 0;
+  pos=pdf_skip_space(d, end, tend);
+  return pdf_is(d, pos, pdf_token(d, end, pos), "R");
+}
+
+static long pdf_dict_integer(const char *d, size_t start, size_t end, const char *key, long fallback) {
+  size_t kstart, vstart, vend;
+  long value;
+
+  if (pdf_dict_value(d, start, end, key, &kstart, &vstart, &vend) && pdf_integer(d, vstart, vend, &value))
+    return value;
+  return fallback;
+}
+
+static long pdf_dict_ref(const char *d, size_t start, size_t end, const char *key) {
+  size_t kstart, vstart, vend;
+  long num;
+
+  if (pdf_dict_value(d, start, end, key, &kstart, &vstart, &vend) && pdf_ref(d, vstart, vend, &num))
+    return num;
+  return -1;
+}
+
+static int pdf_stream_open(struct pdf_stream *stream, off_t data, size_t length, int flate) {
+  memset(&stream->z, 0, sizeof(stream->z));
+  stream->pos=data;
+  stream->end=data+length;
+  stream->flate=flate;
+  return (flate && inflateInit(&stream->z) != Z_OK);
+}
+
+static size_t pdf_stream_read(struct pdf_stream *stream, char *out, size_t size) {
+  /* decodes up to size bytes of the stream, fewer only at its end */
+  size_t count, done=0;
+  int result;
+
+  while (done < size) {
+    if (!stream->flate || !stream->z.avail_in) {
+      count=PDF_READSIZE;
+      if ((off_t)count > stream->end-stream->pos)
+        count=stream->end-stream->pos;
+      if (!stream->flate && count > size-done)
+        count=size-done;
+      /* pdf_read() terminates its buffer, hence the extra byte */
+      count=(count)?pdf_read((char *) stream->in, count+1, stream->pos):0;
+      stream->pos+=count;
+      if (!stream->flate) {
+        if (!count)
+          break;
+        memcpy(out+done, stream->in, count);
+        done+=count;
+        continue;
+      }
+      stream->z.next_in=stream->in;
+      stream->z.avail_in=count;
+    }
+    /* without further input inflate() may still have output pending */
+    stream->z.next_out=(Bytef *) out+done;
+    stream->z.avail_out=size-done;
+    result=inflate(&stream->z, Z_NO_FLUSH);
+    done=size-stream->z.avail_out;
+    if (result != Z_OK)
+      break;
+  }
+  return done;
+}
+
+static void pdf_stream_close(struct pdf_stream *stream) {
+  if (stream->flate)
+    (void) inflateEnd(&stream->z);
+  return;
+}
+
+static int pdf_stream_info(const char *d, size_t len, off_t start, off_t *data, size_t *length, int *flate) {
+  /* finds position, length and filter of the stream whose dictionary d was
+     read at start; only unfiltered and Flate streams can be read */
+  size_t pos, end, kstart, vstart, vend;
+  long value;
+
+  end=pdf_object_end(d, len, 0);
+  pos=pdf_skip_space(d, len, end);
+  if (!pdf_is(d, pos, pdf_token(d, len, pos), "stream") ||
+      (value=pdf_dict_integer(d, 0, end, "/Length", -1)) < 0)
+    return 1;
+  pos+=6;
+  if (pos < len && d[pos] == '\r')
+    pos++;
+  if (pos < len && d[pos] == '\n')
+    pos++;
+  *data=start+pos;
+  *length=value;
+  *flate=0;
+  if (pdf_dict_value(d, 0, end, "/Filter", &kstart, &vstart, &vend)) {
+    if (d[vstart] == '[') {
+      vstart=pdf_skip_space(d, vend, vstart+1);
+      pos=pdf_skip_space(d, vend, pdf_token(d, vend, vstart));
+      if (!pdf_is(d, pos, vend, "]"))
+        return 1;
+    }
+    if (!pdf_is(d, vstart, pdf_token(d, vend, vstart), "/FlateDecode"))
+      return 1;
+    *flate=1;
+  }
+  return 0;
+}
+
+static int pdf_load_section(struct pdf_section *section, off_t pos) {
+  /* reads the cross-reference table or stream at pos along with its
+     trailer entries */
+  char buffer[PDF_READSIZE+1];
+  size_t len, p, end, kstart, vstart, vend;
+  long num, count;
+  int i;
+
+  memset(section, 0, sizeof(struct pdf_section));
+  section->prev=-1;
+  len=pdf_read(buffer, PDF_PEEKSIZE, pos);
+  p=pdf_skip_space(buffer, len, 0);
+  end=pdf_token(buffer, len, p);
+
+  if (pdf_is(buffer, p, end, "xref")) {
+    for (;;) {
+      pos+=pdf_skip_space(buffer, len, end);
+      len=pdf_read(buffer, PDF_LINESIZE, pos);
+      end=pdf_token(buffer, len, 0);
+      if (pdf_is(buffer, 0, end, "trailer")) {
+        len=pdf_read_rest(buffer, sizeof(buffer), pdf_read(buffer, PDF_PEEKSIZE, pos), pos);
+        break;
+      }
+      p=pdf_skip_space(buffer, len, end);
+      if (!pdf_integer(buffer, 0, end, &num) ||
+          !pdf_integer(buffer, p, pdf_token(buffer, len, p), &count) ||
+          section->nsub == PDF_SUBSECTIONS)
+        return 1;
+      p=pdf_token(buffer, len, p);
+      while (p < len && pdf_space(buffer[p]) && buffer[p] != '\r' && buffer[p] != '\n')
+        p++;
+      if (p < len && buffer[p] == '\r')
+        p++;
+      if (p < len && buffer[p] == '\n')
+        p++;
+      /* entries are 20 bytes, some writers use 19 with a single EOL */
+      section->entrylen=(p+19 < len && count && isdigit((unsigned char) buffer[p+19]))?19:20;
+      section->first[section->nsub]=num;
+      section->count[section->nsub]=count;
+      section->entries[section->nsub++]=pos+p;
+      pos+=p+count*section->entrylen;
+      len=pdf_read(buffer, PDF_LINESIZE, pos);
+      end=0;
+    }
+    end=pdf_object_end(buffer, len, end);
+    p=pdf_token(buffer, len, 0);
+  }
+  else {
+    if (!pdf_integer(buffer, p, end, &num))
+      return 1;
+    len=pdf_read_rest(buffer, sizeof(buffer), len, pos);
+    p=pdf_skip_space(buffer, len, end);
+    p=pdf_skip_space(buffer, len, pdf_token(buffer, len, p));
+    end=pdf_token(buffer, len, p);
+    if (!pdf_is(buffer, p, end, "obj"))
+      return 1;
+    memmove(buffer, buffer+end, len-end+1);
+    len-=end;
+    pos+=end;
+    p=0;
+    end=pdf_object_end(buffer, len, 0);
+    if (!pdf_dict_value(buffer, 0, end, "/Type", &kstart, &vstart, &vend) ||
+        !pdf_is(buffer, vstart, vend, "/XRef") ||
+        !pdf_dict_value(buffer, 0, end, "/W", &kstart, &vstart, &vend) ||
+        pdf_stream_info(buffer, len, pos, &section->data, &section->length, &section->flate))
+      return 1;
+    p=vstart+1;
+    for (i=0; i<3; i++) {
+      p=pdf_skip_space(buffer, vend, p);
+      if (!pdf_integer(buffer, p, pdf_token(buffer, vend, p), &num) || num > 8)
+        return 1;
+      section->w[i]=num;
+      p=pdf_token(buffer, vend, p);
+    }
+    if (pdf_dict_value(buffer, 0, end, "/Index", &kstart, &vstart, &vend)) {
+      for (p=vstart+1; section->nsub < PDF_SUBSECTIONS; ) {
+        p=pdf_skip_space(buffer, vend, p);
+        if (!pdf_integer(buffer, p, pdf_token(buffer, vend, p), &section->first[section->nsub]))
+          break;
+        p=pdf_skip_space(buffer, vend, pdf_token(buffer, vend, p));
+        if (!pdf_integer(buffer, p, pdf_token(buffer, vend, p), &section->count[section->nsub++]))
+          return 1;
+        p=pdf_token(buffer, vend, p);
+      }
+    }
+    else {
+      section->first[0]=0;
+      section->count[0]=pdf_dict_integer(buffer, 0, end, "/Size", 0);
+      section->nsub=1;
+    }
+    if (pdf_dict_value(buffer, 0, end, "/DecodeParms", &kstart, &vstart, &vend)) {
+      section->predictor=pdf_dict_integer(buffer, vstart, vend, "/Predictor", 1);
+      section->columns=pdf_dict_integer(buffer, vstart, vend, "/Columns", 1);
+      if (section->predictor > 1 && (section->predictor < 10 ||
+          section->columns != section->w[0]+section->w[1]+section->w[2]))
+        return 1;
+    }
+    section->is_stream=1;
+    p=0;
+  }
+  section->info=pdf_dict_ref(buffer, p, end, "/Info");
+  section->root=pdf_dict_ref(buffer, p, end, "/Root");
+  section->prev=pdf_dict_integer(buffer, p, end, "/Prev", -1);
+  return 0;
+}
+
+static int pdf_xref_row(struct pdf_section *section, long row, long *fields) {
+  /* decodes row of a cross-reference stream, undoing PNG predictors */
+  struct pdf_stream stream;
+  unsigned char prev[25], cur[25];
+  int width=section->w[0]+section->w[1]+section->w[2], png=(section->predictor >= 10), a, b, c, p, i, k;
+  long r;
+
+  if (pdf_stream_open(&stream, section->data, section->length, section->flate))
+    return 1;
+  memset(prev, 0, sizeof(prev));
+  for (r=0; r<=row; r++) {
+    if (pdf_stream_read(&stream, (char *) cur, width+png) != (size_t)(width+png)) {
+      pdf_stream_close(&stream);
+      return 1;
+    }
+    for (i=png; png && i<width+1; i++) {
+      a=(i > 1)?cur[i-1]:0;
+      b=prev[i];
+      c=(i > 1)?prev[i-1]:0;
+      switch (cur[0]) {
+        case 1: cur[i]+=a; break;
+        case 2: cur[i]+=b; break;
+        case 3: cur[i]+=(a+b)/2; break;
+        case 4:
+          p=a+b-c;
+          cur[i]+=(abs(p-a) <= abs(p-b) && abs(p-a) <= abs(p-c))?a:((abs(p-b) <= abs(p-c))?b:c);
+          break;
+      }
+    }
+    memcpy(prev, cur, sizeof(cur));
+  }
+  pdf_stream_close(&stream);
+  for (i=0, p=png; i<3; i++) {
+    fields[i]=(i || section->w[0])?0:1;
+    for (k=0; k<section->w[i]; k++)
+      fields[i]=(fields[i] << 8) | cur[p++];
+  }
+  return 0;
+}
+
+static int pdf_lookup(long num, off_t *offset, long *stream, long *index) {
+  /* returns 1 with the offset of object num, 2 with the object stream and
+     index holding it, or 0 if it does not exist */
+  struct pdf_section *section;
+  char buffer[32];
+  long fields[3], row;
+  int s, i;
+
+  for (s=0; s<pdf_nsections; s++) {
+    section=&pdf_sections[s];
+    for (i=0, row=0; i<section->nsub; row+=section->count[i++]) {
+      if (num < section->first[i] || num >= section->first[i]+section->count[i])
+        continue;
+      if (!section->is_stream) {
+        if (pdf_read(buffer, 21, section->entries[i]+(num-section->first[i])*section->entrylen) < 18)
+          return 0;
+        *offset=strtoll(buffer, NULL, 10);
+        return (buffer[17] == 'n')?1:0;
+      }
+      if (pdf_xref_row(section, row+num-section->first[i], fields))
+        return 0;
+      *offset=*stream=fields[1];
+      *index=fields[2];
+      return (fields[0] == 1 || fields[0] == 2)?fields[0]:0;
+    }
+  }
+  return 0;
+}
+
+static size_t pdf_load_object(long num, char *buffer, size_t size, off_t *start) {
+  /* reads the beginning of object num without "n g obj" into buffer; start
+     is set to its position for objects not within an object stream */
+  struct pdf_stream stream;
+  char header[PDF_READSIZE+1];
+  size_t len, slen, pos, end;
+  off_t offset, data;
+  long stm, index, value, first;
+  int flate, type;
+
+  type=pdf_lookup(num, &offset, &stm, &index);
+  *start=-1;
+  if (type == 1) {
+    len=pdf_read(buffer, (size < PDF_PEEKSIZE)?size:PDF_PEEKSIZE, offset);
+    len=pdf_read_rest(buffer, size, len, offset);
+    pos=pdf_skip_space(buffer, len, 0);
+    end=pdf_token(buffer, len, pos);
+    if (!pdf_integer(buffer, pos, end, &value) || value != num)
+      return 0;
+    pos=pdf_skip_space(buffer, len, pdf_token(buffer, len, pdf_skip_space(buffer, len, end)));
+    end=pdf_token(buffer, len, pos);
+    if (!pdf_is(buffer, pos, end, "obj"))
+      return 0;
+    memmove(buffer, buffer+end, len-end+1);
+    *start=offset+end;
+    return len-end;
+  }
+  if (type != 2 || pdf_lookup(stm, &offset, &value, &value) != 1)
+    return 0;
+  /* the object stream: pairs of number and offset, then the objects */
+  len=pdf_load_object(stm, header, sizeof(header), &offset);
+  end=pdf_object_end(header, len, 0);
+  first=pdf_dict_integer(header, 0, end, "/First", -1);
+  if (first < 0 || first > PDF_READSIZE || pdf_stream_info(header, len, offset, &data, &slen, &flate) ||
+      pdf_stream_open(&stream, data, slen, flate))
+    return 0;
+  len=pdf_stream_read(&stream, header, first);
+  header[len]='\0';
+  for (pos=0, value=-1; index >= 0; index--) {
+    pos=pdf_skip_space(header, len, pdf_token(header, len, pdf_skip_space(header, len, pos)));
+    end=pdf_token(header, len, pos);
+    if (!pdf_integer(header, pos, end, &value))
+      break;
+    pos=end;
+  }
+  len=0;
+  for (offset=0; value >= 0 && offset < value; offset+=len)
+    if ((len=pdf_stream_read(&stream, buffer, (value-offset < (off_t)size-1)?value-offset:size-1)) == 0)
+      break;
+  len=(value >= 0 && offset == value)?pdf_stream_read(&stream, buffer, size-1):0;
+  buffer[len]='\0';
+  pdf_stream_close(&stream);
+  return len;
+}
+
+static size_t pdf_utf8(char *out, size_t size, unsigned long c) {
+  /* appends character c to out, which has room for size bytes */
+  if (c < 0x80 && size > 1) {
+    out[0]=c;
+    return 1;
+  }
+  if (c < 0x800 && size > 2) {
+    out[0]=0xC0|(c >> 6);
+    out[1]=0x80|(c & 0x3F);
+    return 2;
+  }
+  if (c < 0x10000 && size > 3) {
+    out[0]=0xE0|(c >> 12);
+    out[1]=0x80|((c >> 6) & 0x3F);
+    out[2]=0x80|(c & 0x3F);
+    return 3;
+  }
+  if (c < 0x110000 && size > 4) {
+    out[0]=0xF0|(c >> 18);
+    out[1]=0x80|((c >> 12) & 0x3F);
+    out[2]=0x80|((c >> 6) & 0x3F);
+    out[3]=0x80|(c & 0x3F);
+    return 4;
+  }
+  return 0;
+}
+
+static int pdf_string(const char *d, size_t start, size_t end, char *title) {
+  /* decodes the literal or hex string at start into UTF-8 from
+     PDFDocEncoding or UTF-16BE and UTF-8 text with byte order mark */
+  unsigned char bytes[BUFSIZE];
+  size_t n=0, pos, out=0;
+  unsigned long c;
+  int depth=0, digits, i;
+
+  if (d[start] == '(') {
+    for (pos=start+1; pos<end && n<BUFSIZE; pos++) {
+      if (d[pos] == '(')
+        depth++;
+      else if (d[pos] == ')' && !depth--)
+        break;
+      if (d[pos] != '\\' || pos+1 >= end) {
+        bytes[n++]=(d[pos] == '\r')?'\n':d[pos];
+        continue;
+      }
+      switch (d[++pos]) {
+        case 'n': bytes[n++]='\n'; break;
+        case 'r': bytes[n++]='\r'; break;
+        case 't': bytes[n++]='\t'; break;
+        case 'b': bytes[n++]='\b'; break;
+        case 'f': bytes[n++]='\f'; break;
+        case '\r':
+          if (pos+1 < end && d[pos+1] == '\n')
+            pos++;
+          break;
+        case '\n':
+          break;
+        default:
+          if (d[pos] >= '0' && d[pos] <= '7') {
+            for (c=0, digits=0; digits<3 && pos<end && d[pos] >= '0' && d[pos] <= '7'; digits++)
+              c=c*8+d[pos++]-'0';
+            pos--;
+            bytes[n++]=c & 0xFF;
+          }
+          else
+            bytes[n++]=d[pos];
+      }
+    }
+  }
+  else if (d[start] == '<') {
+    for (pos=start+1, digits=0, c=0; pos<end && d[pos] != '>' && n<BUFSIZE; pos++) {
+      if (!isxdigit((unsigned char) d[pos]))
+        continue;
+      c=c*16+(isdigit((unsigned char) d[pos])?d[pos]-'0':(tolower((unsigned char) d[pos])-'a'+10));
+      if (++digits == 2) {
+        bytes[n++]=c;
+        digits=0;
+        c=0;
+      }
+    }
+    if (digits && n<BUFSIZE)
+      bytes[n++]=c*16;
+  }
+  else
+    return 0;
+
+  if (n >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF) {
+    for (i=2; i+1<(int)n; i+=2) {
+      c=(bytes[i] << 8) | bytes[i+1];
+      if (c >= 0xD800 && c < 0xDC00 && i+3<(int)n) {
+        c=0x10000+((c-0xD800) << 10)+(((bytes[i+2] << 8) | bytes[i+3])-0xDC00);
+        i+=2;
+      }
+      out+=pdf_utf8(title+out, BUFSIZE-out, c);
+    }
+  }
+  else if (n >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+    memcpy(title, bytes+3, n-3);
+    out=n-3;
+  }
+  else
+    for (i=0; i<(int)n; i++) {
+      c=bytes[i];
+      if (c >= 0x18 && c <= 0x1F)
+        c=pdf_doc_accents[c-0x18];
+      else if (c >= 0x80 && c <= 0xA0)
+        c=pdf_doc_encoding[c-0x80];
+      out+=pdf_utf8(title+out, BUFSIZE-out, c);
+    }
+  title[out]='\0';
+  return out;
+}
+
+static int pdf_xmp_title(const char *xmp, char *title) {
+  /* takes the first dc:title entry of XMP metadata; references without
+     a terminating ';' inside the entry are copied literally */
+  const char *start, *end, *semi, *next;
+  char *digits;
+  size_t out=0;
+  unsigned long c;
+
+  if ((start=strstr(xmp, "<dc:title")) == NULL || (start=strstr(start, "<rdf:li")) == NULL ||
+      (start=strchr(start, '>')) == NULL || (end=strstr(++start, "</rdf:li>")) == NULL)
+    return 0;
+  while (start < end && out < BUFSIZE-5) {
+    if (*start != '&' || (semi=memchr(start, ';', end-start)) == NULL) {
+      title[out++]=*start++;
+      continue;
+    }
+    next=semi+1;
+    if (!strncmp(start, "&amp;", 5))
+      c='&';
+    else if (!strncmp(start, "&lt;", 4))
+      c='<';
+    else if (!strncmp(start, "&gt;", 4))
+      c='>';
+    else if (!strncmp(start, "&quot;", 6))
+      c='"';
+    else if (!strncmp(start, "&apos;", 6))
+      c='\'';
+    else if (start[1] == '#') {
+      if (start[2] == 'x')
+        c=strtoul(start+3, &digits, 16);
+      else
+        c=strtoul(start+2, &digits, 10);
+      if (digits != semi)
+        c=0;
+    }
+    else
+      c=0;
+    if (!c) {
+      c='&';
+      next=start+1;
+    }
+    out+=pdf_utf8(title+out, BUFSIZE-out, c);
+    start=next;
+  }
+  title[out]='\0';
+  return out;
+}
+
+static int pdf_title(int fd, off_t base, off_t size, char *title) {
+  /* looks up the title of the PDF at base in fd */
+  char buffer[PDF_READSIZE+1], *xmp, *found;
+  struct pdf_stream stream;
+  size_t len, pos, end, kstart, vstart, vend;
+  off_t offset, data;
+  long info=-1, root=-1, metadata, value;
+  int flate, i;
+
+  pdf_fd=fd;
+  pdf_base=base;
+  pdf_size=size;
+  pdf_read_total=0;
+  pdf_nsections=0;
+  title[0]='\0';
+
+  len=pdf_read(buffer, 1025, (size > 1024)?size-1024:0);
+  for (xmp=NULL, pos=0; pos < len && (found=memmem(buffer+pos, len-pos, "startxref", 9)) != NULL;
+       pos=found-buffer+9)
+    xmp=found;
+  if (xmp == NULL)
+    return 0;
+  offset=strtoll(xmp+9, NULL, 10);
+  while (offset > 0 && pdf_nsections < PDF_SECTIONS && !pdf_load_section(&pdf_sections[pdf_nsections], offset)) {
+    offset=pdf_sections[pdf_nsections].prev;
+    for (i=0; i<pdf_nsections; i++)
+      if (pdf_sections[i].prev == offset)
+        offset=0;
+    if (info < 0)
+      info=pdf_sections[pdf_nsections].info;
+    if (root < 0)
+      root=pdf_sections[pdf_nsections].root;
+    pdf_nsections++;
+  }
+
+  if (info >= 0 && (len=pdf_load_object(info, buffer, sizeof(buffer), &offset)) > 0 &&
+      pdf_dict_value(buffer, 0, len, "/Title", &kstart, &vstart, &vend)) {
+    if (pdf_ref(buffer, vstart, vend, &value) &&
+        (len=pdf_load_object(value, buffer, sizeof(buffer), &offset)) > 0) {
+      vstart=pdf_skip_space(buffer, len, 0);
+      vend=pdf_token(buffer, len, vstart);
+    }
+    if (pdf_string(buffer, vstart, vend, title))
+      log_event(CPDEBUG, "title found in PDF document information: %s", title);
+  }
+
+  if (!title[0] && root >= 0 && (len=pdf_load_object(root, buffer, sizeof(buffer), &offset)) > 0 &&
+      (metadata=pdf_dict_ref(buffer, 0, len, "/Metadata")) >= 0 &&
+      (len=pdf_load_object(metadata, buffer, sizeof(buffer), &offset)) > 0 && offset >= 0 &&
+      !pdf_stream_info(buffer, len, offset, &data, &len, &flate) &&
+      (xmp=malloc(4*PDF_READSIZE+1)) != NULL) {
+    if (!pdf_stream_open(&stream, data, len, flate)) {
+      end=pdf_stream_read(&stream, xmp, 4*PDF_READSIZE);
+      xmp[end]='\0';
+      pdf_stream_close(&stream);
+      if (pdf_xmp_title(xmp, title))
+        log_event(CPDEBUG, "title found in PDF XMP metadata: %s", title);
+    }
+    free(xmp);
+  }
+  log_event(CPDEBUG, "PDF title looked up in %d revisions reading %lu bytes", pdf_nsections,
+            (unsigned long) pdf_read_total);
+  return strlen(title);
+}
+
+static int preparespoolfile(FILE *fpsrc, char *spoolfile, char *title, char *cmdtitle,
+                     int job, struct passwd *passwd) {
+  char buffer[BUFSIZE+1];
+  FILE *fpdest;
+  struct stat fstatus;
+  const char *line;
+  size_t len;
+  int seekable, complete=1;
+
+  if (fpsrc == NULL) {
+    log_event(CPERROR, "failed to open source stream");
+    return 1;
+  }
+  if (reader_open(&src_reader, fileno(fpsrc))) {
+    log_event(CPERROR, "failed to allocate memory for source stream");
+    (void) fclose(fpsrc);
+    return 1;
+  }
+  log_event(CPDEBUG, "source stream ready");
+  seekable=(!fstat(fileno(fpsrc), &fstatus) && S_ISREG(fstatus.st_mode));
+  ps_rec_depth=0;
+  if (Conf_FixNewlines)
+    log_event(CPSTATUS, "***Experimental Option: FixNewlines");
+  else
+    log_event(CPDEBUG, "using traditional fgets");
+
+  buffer[0]='\0';
+  while (read_line(&src_reader, &line, &len)) {
+    complete=line_complete(line, len);
+    len=line_length(line, len);
+    memcpy(buffer, line, len);
+    buffer[len]='\0';
+    if (!strncmp(buffer, "%PDF", 4)) {
+      log_event(CPDEBUG, "found beginning of PDF code: %s", buffer);
+      input_is_pdf=1;
+      break;
+    }
+    if (!strncmp(buffer, "%!", 2) && strncmp(buffer, "%!PS-AdobeFont", 14)) {
+      log_event(CPDEBUG, "found beginning of postscript code: %s", buffer);
+      break;
+    }
+  }
+
+  if (input_is_pdf) {
+    pdf_offset=(seekable)?(long)src_reader.line_offset:-1;
+    src_reader.pos=src_reader.line_offset-src_reader.offset;
+    log_event(CPDEBUG, "PDF data left in source stream for passthrough (offset %ld)", pdf_offset);
+    if (!seekable)
+      log_event(CPDEBUG, "PDF read from a stream, no title lookup");
+    else if (!pdf_title(fileno(fpsrc), pdf_offset, fstatus.st_size-pdf_offset, title))
+      log_event(CPDEBUG, "no title found in PDF");
+  }
+  else if (Conf_StreamPostScript) {
+    fpdest=open_memstream(&ps_header, &ps_header_len);
+    if (fpdest == NULL) {
+      log_event(CPERROR, "failed to allocate memory for postscript header");
+      reader_close(&src_reader);
+      (void) fclose(fpsrc);
+      return 1;
+    }
+    (void) fputs(buffer, fpdest);
+    index_init();
+    index_line((buffer[0] == '%')?buffer:NULL, strlen(buffer), complete);
+    log_event(CPDEBUG, "now extracting postscript header");
+    ps_finished=extract_postscript(fpdest, title, 1);
+    if (ps_finished)
+      log_event(CPDEBUG, "postscript code ended within the header");
+    input_is_streamed=1;
+    (void) fclose(fpdest);
+    log_event(CPDEBUG, "postscript header read: %lu bytes", (unsigned long) ps_header_len);
+  }
+  else {
+    fpdest=spool_open(spoolfile, passwd);
+    if (fpdest == NULL) {
+      fpdest=fopen(spoolfile, "w");
+      if (fpdest == NULL) {
+        log_event(CPERROR, "failed to open spoolfile: %s", spoolfile);
+        reader_close(&src_reader);
+        (void) fclose(fpsrc);
+        return 1;
+      }
+      log_event(CPDEBUG, "destination stream ready: %s", spoolfile);
+      if (chown(spoolfile, passwd->pw_uid, -1)) {
+        log_event(CPERROR, "failed to set owner for spoolfile: %s", spoolfile);
+        return 1;
+      }
+      log_event(CPDEBUG, "owner set for spoolfile: %s", spoolfile);
+    }
+
+    if (strlen(Conf_ConversionCache)) {
+      sha256_init(&spool_hash);
+      sha256_update(&spool_hash, buffer, strlen(buffer));
+      spool_hashing=1;
+    }
+    (void) fputs(buffer, fpdest);
+    index_init();
+    index_line((buffer[0] == '%')?buffer:NULL, strlen(buffer), complete);
+
+    log_event(CPDEBUG, "now extracting postscript code");
+    (void) extract_postscript(fpdest, title, 0);
+    if (spool_hashing) {
+      sha256_final(&spool_hash, cache_key);
+      spool_hashing=0;
+      log_event(CPDEBUG, "postscript code hashed: %s", cache_key);
+    }
+
+    (void) fclose(fpdest);
+    reader_close(&src_reader);
+    (void) fclose(fpsrc);
+    if (spool_memfd >= 0)
+      log_event(CPDEBUG, "all data kept in memory spool, no DSC index written");
+    else {
+      log_event(CPDEBUG, "all data written to spoolfile: %s (%lld bytes)", spoolfile, spool_offset);
+      index_store(spoolfile, passwd);
+    }
+  }
+
+  if (cmdtitle == NULL || !strcmp(cmdtitle, "(stdin)"))
+    buffer[0]='\0';
+  else
+    strncpy(buffer, cmdtitle, BUFSIZE);
+  if (title == NULL || !strcmp(title, "((stdin))"))
+    title[0]='\0';
+
+  if (Conf_TitlePref) {
     log_event(CPDEBUG, "trying to use commandline title: %s", buffer);
     if (!preparetitle(buffer)) {
       log_event(CPDEBUG, "empty commandline title, using PS title: %s", title);
       if (!preparetitle(title))
         log_event(CPDEBUG, "empty PS title");
     }
-    else
-      snprintf(title, BUFSIZE, "%s", buffer);
+    else
+      snprintf(title, BUFSIZE, "%s", buffer);
+  }
+  else {
+    log_event(CPDEBUG, "trying to use PS title: %s", title);
+    if (!preparetitle(title)) {
+      log_event(CPDEBUG, "empty PS title, using commandline title: %s", buffer);
+      if (!preparetitle(buffer))
+        log_event(CPDEBUG, "empty commandline title");
+      else
+        snprintf(title, BUFSIZE, "%s", buffer);
+    }
+  }
+
+  if (!strcmp(title, "")) {
+    if (Conf_Label == 2)
+      snprintf(title, BUFSIZE, "untitled_document-job_%i", job);
+    else
+      snprintf(title, BUFSIZE, "job_%i-untitled_document", job);
+    log_event(CPDEBUG, "no title found - using default value: %s", title);
+  }
+  else {
+    if (Conf_Label) {
+      strcpy(buffer, title);
+      if (Conf_Label == 2)
+        snprintf(title, BUFSIZE, "%s-job_%i", buffer, job);
+      else
+        snprintf(title, BUFSIZE, "job_%i-%s", job, buffer);
+    }
+    log_event(CPDEBUG, "title successfully retrieved: %s", title);
+  }
+  return 0;
+}
+
+static int copy_file_data(int fdin, off_t offset, off_t size, int fdout) {
+  /* copies size bytes from offset in the regular file fdin to fdout,
+     letting the kernel do the work where possible */
+  cp_string buffer;
+  ssize_t count;
+
+#ifdef FICLONE
+  struct stat fstatus;
+
+  if (!offset && !fstat(fdin, &fstatus) && fstatus.st_size == size &&
+      !ioctl(fdout, FICLONE, fdin)) {
+    log_event(CPDEBUG, "file data cloned");
+    return 0;
+  }
+#endif
+#ifdef __linux__
+  while (offset < size) {
+    count=copy_file_range(fdin, &offset, fdout, NULL, size-offset, 0);
+    if (count <= 0)
+      break;
+  }
+  if (offset < size)
+    log_event(CPDEBUG, "copy_file_range not available, trying sendfile");
+  while (offset < size) {
+    count=sendfile(fdout, fdin, &offset, size-offset);
+    if (count <= 0)
+      break;
+  }
+#endif
+  while (offset < size) {
+    count=pread(fdin, buffer, BUFSIZE, offset);
+    if (count <= 0 || write_all(fdout, buffer, count))
+      break;
+    offset+=count;
+  }
+  return (offset < size);
+}
+
+/* optional optimisation of passthrough PDFs: streams without a filter or
+   with just an ASCIIHex, ASCII85, LZW or RunLength filter are (re)compressed
+   with Flate by a pool of threads, all other objects are packed
+   into object streams and indexed by a cross-reference stream. PDFs that
+   are encrypted, already use object streams or do not parse cleanly are
+   passed through unchanged */
+
+#define PDF_MINSTREAM 64                /* smaller streams stay as they are */
+#define PDF_OBJSTM 100                  /* objects per object stream */
+#define PDF_MAXOBJECTS 8388608
+#define PDF_MAXDECODED (256L<<20)       /* larger streams are not decoded */
+
+enum pdfFilters { F_NONE, F_ASCIIHEX, F_ASCII85, F_LZW, F_RUNLENGTH };
+
+struct pdf_object {
+  size_t body, end;             /* object body up to "stream" or "endobj" */
+  size_t data, length;          /* stream data */
+  long length_ref;              /* object holding an indirect /Length */
+  int gen, defined, listed, is_stream, task, filter;
+};
+
+struct pdf_task {
+  const char *in;
+  char *out;                    /* NULL if compression did not pay off */
+  size_t inlen, outlen;
+  int filter;                   /* to be decoded before compression */
+};
+
+struct pdf_buffer {
+  char *data;
+  size_t len, size;
+};
+
+struct pdf_layout {
+  struct pdf_object *objects;
+  struct pdf_task *tasks;       /* compressed streams, then object streams */
+  char **contents;              /* of the object streams */
+  size_t trailer, root[2], info[2], id[2], *firsts;
+  off_t *offsets;               /* of the objects in the output */
+  long *plain, *indexes;        /* objects packed and their position */
+  long nobjects, nplain, nstm, size;
+  int ntasks;
+};
+
+struct pdf_pool {
+  struct pdf_task *tasks;
+  int ntasks, next;
+};
+
+static int pdf_endstream(const char *d, size_t len, size_t pos) {
+  /* checks that stream data ending at pos is followed by "endstream" */
+  if (pos > len)
+    return 0;
+  while (pos < len && pdf_space(d[pos]))
+    pos++;
+  return (len-pos >= 9 && !memcmp(d+pos, "endstream", 9));
+}
+
+static long pdf_find_length(const char *d, size_t len, size_t data, size_t ref, size_t refend) {
+  /* looks for the integer object an indirect stream /Length refers to and
+     returns the length if it fits the stream at data, otherwise -1 */
+  const char *found;
+  char pattern[48];
+  size_t start, pos, end, plen;
+  long num, gen, value;
+
+  pos=pdf_token(d, refend, ref);
+  if (!pdf_integer(d, ref, pos, &num))
+    return -1;
+  ref=pdf_skip_space(d, refend, pos);
+  pos=pdf_token(d, refend, ref);
+  if (!pdf_integer(d, ref, pos, &gen))
+    return -1;
+  plen=snprintf(pattern, sizeof(pattern), "%ld %ld obj", num, gen);
+  /* the length object mostly follows the stream, so look there first */
+  for (start=data; ; start=0) {
+    for (pos=start; (found=memmem(d+pos, len-pos, pattern, plen)) != NULL; pos=found-d+plen) {
+      if (found > d && !pdf_space(found[-1]))
+        continue;
+      pos=pdf_skip_space(d, len, found-d+plen);
+      end=pdf_token(d, len, pos);
+      if (pdf_integer(d, pos, end, &value) && data+value <= len && pdf_endstream(d, len, data+value))
+        return value;
+      if (!start && found-d >= (long) data)
+        break;
+    }
+    if (!start)
+      return -1;
+  }
+}
+
+static int pdf_filter(const char *d, size_t start, size_t end) {
+  /* returns the filter of the stream dictionary at start if it is none or
+     one that is worth replacing by Flate, otherwise -1 */
+  static const char *names[]={ "/ASCIIHexDecode", "/ASCII85Decode", "/LZWDecode", "/RunLengthDecode" };
+  size_t kstart, vstart, vend;
+  int i;
+
+  if (!pdf_dict_value(d, start, end, "/Filter", &kstart, &vstart, &vend))
+    return F_NONE;
+  if (vend-vstart >= 2 && d[vstart] == '[' && d[vend-1] == ']') {
+    vstart++;
+    vend--;
+    pdf_trim(d, &vstart, &vend);
+  }
+  for (i=0; i<4; i++)
+    if (pdf_is(d, vstart, vend, names[i]))
+      return F_ASCIIHEX+i;
+  return -1;
+}
+
+static int pdf_put(struct pdf_buffer *out, const char *data, size_t len) {
+  /* appends data, or just makes room for len bytes if it is NULL */
+  char *tmp;
+  size_t size;
+
+  if (out->len+len > out->size) {
+    if (out->len+len > PDF_MAXDECODED)
+      return 1;
+    for (size=(out->size)?out->size:4096; size < out->len+len; size*=2);
+    if ((tmp=realloc(out->data, size)) == NULL)
+      return 1;
+    out->data=tmp;
+    out->size=size;
+  }
+  if (data != NULL)
+    memcpy(out->data+out->len, data, len);
+  out->len+=len;
+  return 0;
+}
+
+static int pdf_hex(char c) {
+  if (c >= '0' && c <= '9')
+    return c-'0';
+  if (c >= 'a' && c <= 'f')
+    return c-'a'+10;
+  if (c >= 'A' && c <= 'F')
+    return c-'A'+10;
+  return -1;
+}
+
+static int pdf_decode_hex(const char *in, size_t len, struct pdf_buffer *out) {
+  size_t pos;
+  int digit, n=0;
+  char c=0;
+
+  for (pos=0; pos<len && in[pos] != '>'; pos++) {
+    if (pdf_space(in[pos]))
+      continue;
+    if ((digit=pdf_hex(in[pos])) < 0)
+      return 1;
+    c=(n)?c|digit:digit<<4;
+    if ((n=!n) == 0 && pdf_put(out, &c, 1))
+      return 1;
+  }
+  return (pos == len || (n && pdf_put(out, &c, 1)));
+}
+
+static int pdf_decode_85(const char *in, size_t len, struct pdf_buffer *out) {
+  unsigned long value=0;
+  size_t pos;
+  char group[4];
+  int i, n=0;
+
+  /* some producers keep the "<~" of PostScript */
+  pos=pdf_skip_space(in, len, 0);
+  if (len-pos >= 2 && !memcmp(in+pos, "<~", 2))
+    pos+=2;
+  for (; pos<len && in[pos] != '~'; pos++) {
+    if (pdf_space(in[pos]))
+      continue;
+    if (in[pos] == 'z' && !n) {
+      if (pdf_put(out, "\0\0\0\0", 4))
+        return 1;
+      continue;
+    }
+    if (in[pos] < '!' || in[pos] > 'u')
+      return 1;
+    value=value*85+(in[pos]-'!');
+    if (++n < 5)
+      continue;
+    if (value > 0xffffffffUL)
+      return 1;
+    for (i=0; i<4; i++)
+      group[i]=(value>>(24-8*i))&0xff;
+    if (pdf_put(out, group, 4))
+      return 1;
+    value=0;
+    n=0;
+  }
+  if (pos == len || n == 1)
+    return 1;
+  if (n) {
+    /* a final partial group is padded with the highest digit */
+    for (i=n; i<5; i++)
+      value=value*85+84;
+    for (i=0; i<n-1; i++)
+      group[i]=(value>>(24-8*i))&0xff;
+    if (pdf_put(out, group, n-1))
+      return 1;
+  }
+  return 0;
+}
+
+static int pdf_decode_lzw(const char *in, size_t len, struct pdf_buffer *out) {
+  /* variable width codes of 9 to 12 bits, the width growing one code
+     early as the default /EarlyChange 1 has it */
+  static __thread short prefix[4096];
+  static __thread unsigned short length[4096];
+  static __thread unsigned char suffix[4096], first[4096];
+  unsigned long bits=0;
+  size_t pos;
+  int nbits=0, width=9, next=258, prev=-1, code, i;
+  char *p;
+
+  for (i=0; i<256; i++) {
+    prefix[i]=-1;
+    length[i]=1;
+    suffix[i]=first[i]=i;
+  }
+  for (pos=0; pos<len; pos++) {
+    bits=((bits<<8)|(unsigned char) in[pos])&0xfffff;
+    nbits+=8;
+    while (nbits >= width) {
+      nbits-=width;
+      code=(bits>>nbits)&((1<<width)-1);
+      if (code == 256) {
+        width=9;
+        next=258;
+        prev=-1;
+        continue;
+      }
+      if (code == 257)
+        return 0;
+      if (code > next || (prev < 0 && code > 255) || (code == next && next == 4096))
+        return 1;
+      if (prev >= 0 && next < 4096) {
+        prefix[next]=prev;
+        suffix[next]=(code < next)?first[code]:first[prev];
+        first[next]=first[prev];
+        length[next]=length[prev]+1;
+        if (++next+1 >= (1<<width) && width < 12)
+          width++;
+      }
+      /* the string of a code is built backwards along its prefixes */
+      if (pdf_put(out, NULL, length[code]))
+        return 1;
+      p=out->data+out->len;
+      for (i=code; i >= 0; i=prefix[i])
+        *--p=suffix[i];
+      prev=code;
+    }
+  }
+  return 0;
+}
+
+static int pdf_decode_runlength(const char *in, size_t len, struct pdf_buffer *out) {
+  unsigned char run;
+  size_t pos=0;
+  char block[128];
+
+  while (pos < len) {
+    run=in[pos++];
+    if (run == 128)
+      return 0;
+    if (run < 128) {
+      if (pos+run+1 > len || pdf_put(out, in+pos, run+1))
+        return 1;
+      pos+=run+1;
+      continue;
+    }
+    if (pos == len)
+      return 1;
+    memset(block, in[pos++], 257-run);
+    if (pdf_put(out, block, 257-run))
+      return 1;
+  }
+  return 0;
+}
+
+static void *pdf_compress(void *arg) {
+  /* compresses tasks until none is left, decoding weakly filtered streams
+     first; a stream that does not decode cleanly stays as it is */
+  struct pdf_pool *pool=arg;
+  struct pdf_task *task;
+  struct pdf_buffer decoded;
+  const char *in;
+  uLongf outlen;
+  size_t inlen;
+  int i, failed;
+
+  while ((i=__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->ntasks) {
+    task=&pool->tasks[i];
+    memset(&decoded, 0, sizeof(decoded));
+    in=task->in;
+    inlen=task->inlen;
+    failed=0;
+    switch (task->filter) {
+      case F_ASCIIHEX:
+        failed=pdf_decode_hex(in, inlen, &decoded);
+        break;
+      case F_ASCII85:
+        failed=pdf_decode_85(in, inlen, &decoded);
+        break;
+      case F_LZW:
+        failed=pdf_decode_lzw(in, inlen, &decoded);
+        break;
+      case F_RUNLENGTH:
+        failed=pdf_decode_runlength(in, inlen, &decoded);
+        break;
+    }
+    if (task->filter != F_NONE) {
+      in=decoded.data;
+      inlen=decoded.len;
+    }
+    outlen=compressBound(inlen);
+    if (!failed && (task->out=malloc(outlen)) != NULL &&
+        (compress2((Bytef *) task->out, &outlen, (const Bytef *) in, inlen, Z_DEFAULT_COMPRESSION) != Z_OK ||
+         outlen >= task->inlen)) {
+      free(task->out);
+      task->out=NULL;
+    }
+    if (task->out != NULL)
+      task->outlen=outlen;
+    free(decoded.data);
+  }
+  return NULL;
+}
+
+static void pdf_run_pool(struct pdf_task *tasks, int ntasks) {
+  struct pdf_pool pool;
+  pthread_t threads[64];
+  int nthreads, i;
+
+  pool.tasks=tasks;
+  pool.ntasks=ntasks;
+  pool.next=0;
+  nthreads=(Conf_PDFOptimizeThreads < ntasks)?Conf_PDFOptimizeThreads:ntasks;
+  for (i=0; i<nthreads-1; i++)
+    if (pthread_create(&threads[i], NULL, pdf_compress, &pool))
+      break;
+  nthreads=i;
+  (void) pdf_compress(&pool);
+  for (i=0; i<nthreads; i++)
+    (void) pthread_join(threads[i], NULL);
+  return;
+}
+
+static int pdf_scan(const char *d, size_t len, struct pdf_object **objects, long *nobjects, size_t *trailer) {
+  /* collects the objects of all revisions and the position of the last
+     trailer; objects listed in a cross-reference table have to be found */
+  struct pdf_object *obj, *tmp;
+  const char *found;
+  size_t pos=0, end, prev[2][2]={{0,0},{0,0}}, kstart, vstart, vend;
+  long num, gen, value, count, i, size=0;
+
+  *objects=NULL;
+  *nobjects=0;
+  *trailer=0;
+  for (;;) {
+    pos=pdf_skip_space(d, len, pos);
+    end=pdf_token(d, len, pos);
+    if (end == pos)
+      break;
+
+    if (pdf_is(d, pos, end, "xref")) {
+      for (;;) {
+        pos=pdf_skip_space(d, len, end);
+        end=pdf_token(d, len, pos);
+        if (!pdf_integer(d, pos, end, &num))
+          break;
+        pos=pdf_skip_space(d, len, end);
+        end=pdf_token(d, len, pos);
+        if (!pdf_integer(d, pos, end, &count))
+          return 1;
+        for (i=0; i<3*count; i++) {
+          pos=pdf_skip_space(d, len, end);
+          end=pdf_token(d, len, pos);
+          if (i%3 == 2 && pdf_is(d, pos, end, "n")) {
+            if (num+i/3 >= PDF_MAXOBJECTS)
+              return 1;
+            if (num+i/3 >= size) {
+              tmp=realloc(*objects, (num+i/3+1024)*sizeof(struct pdf_object));
+              if (tmp == NULL)
+                return 1;
+              memset(tmp+size, 0, (num+i/3+1024-size)*sizeof(struct pdf_object));
+              *objects=tmp;
+              size=num+i/3+1024;
+            }
+            (*objects)[num+i/3].listed=1;
+            if (num+i/3 >= *nobjects)
+              *nobjects=num+i/3+1;
+          }
+        }
+      }
+      prev[0][0]=prev[0][1]=prev[1][0]=prev[1][1]=0;
+      continue;
+    }
+    if (pdf_is(d, pos, end, "trailer"))
+      *trailer=end;
+
+    if (!pdf_is(d, pos, end, "obj")) {
+      prev[0][0]=prev[1][0];
+      prev[0][1]=prev[1][1];
+      prev[1][0]=pos;
+      prev[1][1]=end;
+      pos=end;
+      continue;
+    }
+    if (!pdf_integer(d, prev[0][0], prev[0][1], &num) || !pdf_integer(d, prev[1][0], prev[1][1], &gen) ||
+        num >= PDF_MAXOBJECTS || gen > 65535)
+      return 1;
+    if (num >= size) {
+      tmp=realloc(*objects, (num+1024)*sizeof(struct pdf_object));
+      if (tmp == NULL)
+        return 1;
+      memset(tmp+size, 0, (num+1024-size)*sizeof(struct pdf_object));
+      *objects=tmp;
+      size=num+1024;
+    }
+    if (num >= *nobjects)
+      *nobjects=num+1;
+    obj=&(*objects)[num];
+    obj->gen=gen;
+    obj->defined=1;
+    obj->is_stream=0;
+    obj->length_ref=-1;
+    obj->body=end;
+
+    for (pos=end; ; pos=end) {
+      pos=pdf_skip_space(d, len, pos);
+      end=pdf_token(d, len, pos);
+      if (end == pos || pdf_is(d, pos, end, "obj"))
+        return 1;
+      if (pdf_is(d, pos, end, "endobj") || pdf_is(d, pos, end, "stream"))
+        break;
+    }
+    obj->end=pos;
+    if (pdf_is(d, pos, end, "stream")) {
+      obj->is_stream=1;
+      if (end < len && d[end] == '\r')
+        end++;
+      if (end < len && d[end] == '\n')
+        end++;
+      obj->data=end;
+      if (!pdf_dict_value(d, obj->body, obj->end, "/Length", &kstart, &vstart, &vend))
+        return 1;
+      if (pdf_integer(d, vstart, vend, &value)) {
+        if (!pdf_endstream(d, len, end+value))
+          return 1;
+        obj->length=value;
+      }
+      else {
+        if (!pdf_integer(d, vstart, pdf_token(d, vend, vstart), &obj->length_ref))
+          return 1;
+        value=pdf_find_length(d, len, end, vstart, vend);
+        obj->length=(value >= 0)?(size_t)value:len-end;
+      }
+      end=obj->data+obj->length;
+      if (obj->length_ref >= 0 && obj->length == len-obj->data) {
+        /* the actual length is checked once all objects are known */
+        found=memmem(d+obj->data, obj->length, "endstream", 9);
+        if (found == NULL)
+          return 1;
+        end=found-d;
+      }
+      pos=pdf_skip_space(d, len, end);
+      end=pdf_token(d, len, pos);
+      if (pdf_is(d, pos, end, "endstream")) {
+        pos=pdf_skip_space(d, len, end);
+        end=pdf_token(d, len, pos);
+      }
+      if (!pdf_is(d, pos, end, "endobj"))
+        end=pos;
+    }
+    pos=end;
+    prev[0][0]=prev[0][1]=prev[1][0]=prev[1][1]=0;
+  }
+  return (*trailer == 0);
+}
+
+static int pdf_resolve_lengths(const char *d, size_t len, struct pdf_object *objects, long nobjects) {
+  struct pdf_object *obj, *ref;
+  size_t start, end;
+  long i, value;
+
+  for (i=0; i<nobjects; i++) {
+    obj=&objects[i];
+    if (!obj->defined || !obj->is_stream || obj->length_ref < 0)
+      continue;
+    if (obj->length_ref >= nobjects || !objects[obj->length_ref].defined)
+      return 1;
+    ref=&objects[obj->length_ref];
+    start=ref->body;
+    end=ref->end;
+    pdf_trim(d, &start, &end);
+    if (ref->is_stream || !pdf_integer(d, start, end, &value) ||
+        obj->data+value > len || !pdf_endstream(d, len, obj->data+value))
+      return 1;
+    obj->length=value;
+  }
+  return 0;
+}
+
+static void pdf_free(struct pdf_layout *layout) {
+  long j;
+
+  for (j=0; layout->tasks != NULL && j<layout->ntasks+layout->nstm; j++)
+    free(layout->tasks[j].out);
+  for (j=0; layout->contents != NULL && j<layout->nstm; j++)
+    free(layout->contents[j]);
+  free(layout->tasks);
+  free(layout->contents);
+  free(layout->firsts);
+  free(layout->offsets);
+  free(layout->plain);
+  free(layout->indexes);
+  free(layout->objects);
+  return;
+}
+
+static int pdf_prepare(const char *d, size_t len, struct pdf_layout *layout) {
+  /* parses the PDF, picks the streams to compress and fills the object
+     streams; a non-zero return leaves the PDF as it is */
+  struct pdf_object *obj;
+  size_t start, end, kstart, vstart, vend, clen, body;
+  long i, j, k;
+
+  if (len < 8 || memcmp(d, "%PDF-", 5) || !isdigit((unsigned char) d[5]) || d[6] != '.' ||
+      !isdigit((unsigned char) d[7]) || memmem(d, len, "/Encrypt", 8) != NULL ||
+      memmem(d, len, "/ObjStm", 7) != NULL || memmem(d, len, "/XRef", 5) != NULL)
+    return 1;
+  if (pdf_scan(d, len, &layout->objects, &layout->nobjects, &layout->trailer) ||
+      pdf_resolve_lengths(d, len, layout->objects, layout->nobjects) ||
+      !pdf_dict_value(d, layout->trailer, len, "/Root", &kstart, &layout->root[0], &layout->root[1]))
+    return 1;
+  (void) pdf_dict_value(d, layout->trailer, len, "/Info", &kstart, &layout->info[0], &layout->info[1]);
+  (void) pdf_dict_value(d, layout->trailer, len, "/ID", &kstart, &layout->id[0], &layout->id[1]);
+
+  layout->plain=calloc(layout->nobjects+1, sizeof(long));
+  layout->indexes=calloc(layout->nobjects+1, sizeof(long));
+  if (layout->plain == NULL || layout->indexes == NULL)
+    return 1;
+  for (i=0; i<layout->nobjects; i++) {
+    obj=&layout->objects[i];
+    obj->task=-1;
+    if (obj->listed && !obj->defined)
+      return 1;
+    if (!obj->defined)
+      continue;
+    if (!obj->is_stream && !obj->gen)
+      layout->plain[layout->nplain++]=i;
+    else if (obj->is_stream && obj->length >= PDF_MINSTREAM &&
+             (obj->filter=pdf_filter(d, obj->body, obj->end)) >= 0 &&
+             !pdf_dict_value(d, obj->body, obj->end, "/DecodeParms", &kstart, &vstart, &vend) &&
+             !(pdf_dict_value(d, obj->body, obj->end, "/Type", &kstart, &vstart, &vend) &&
+               pdf_is(d, vstart, vend, "/Metadata")))
+      obj->task=layout->ntasks++;
+  }
+  layout->nstm=(layout->nplain+PDF_OBJSTM-1)/PDF_OBJSTM;
+  layout->size=layout->nobjects+layout->nstm+1;
+
+  layout->tasks=calloc(layout->ntasks+layout->nstm+1, sizeof(struct pdf_task));
+  layout->contents=calloc(layout->nstm+1, sizeof(char *));
+  layout->firsts=calloc(layout->nstm+1, sizeof(size_t));
+  layout->offsets=calloc(layout->size, sizeof(off_t));
+  if (layout->tasks == NULL || layout->contents == NULL || layout->firsts == NULL || layout->offsets == NULL)
+    return 1;
+  for (i=0; i<layout->nobjects; i++)
+    if (layout->objects[i].task >= 0) {
+      layout->tasks[layout->objects[i].task].in=d+layout->objects[i].data;
+      layout->tasks[layout->objects[i].task].inlen=layout->objects[i].length;
+      layout->tasks[layout->objects[i].task].filter=layout->objects[i].filter;
+    }
+
+  /* an object stream holds pairs of object number and offset, followed by
+     the object bodies; offsets[] of a packed object is its object stream */
+  for (j=0; j<layout->nstm; j++) {
+    clen=0;
+    for (k=j*PDF_OBJSTM; k<layout->nplain && k<(j+1)*PDF_OBJSTM; k++)
+      clen+=layout->objects[layout->plain[k]].end-layout->objects[layout->plain[k]].body+48;
+    layout->contents[j]=malloc(clen);
+    if (layout->contents[j] == NULL)
+      return 1;
+    clen=0;
+    body=0;
+    for (k=j*PDF_OBJSTM; k<layout->nplain && k<(j+1)*PDF_OBJSTM; k++) {
+      obj=&layout->objects[layout->plain[k]];
+      start=obj->body;
+      end=obj->end;
+      pdf_trim(d, &start, &end);
+      clen+=sprintf(layout->contents[j]+clen, "%ld %zu%c", layout->plain[k], body,
+                    (k+1 < layout->nplain && k+1 < (j+1)*PDF_OBJSTM)?' ':'\n');
+      body+=((end > start)?end-start:4)+1;
+      layout->indexes[layout->plain[k]]=k-j*PDF_OBJSTM;
+      layout->offsets[layout->plain[k]]=layout->nobjects+j;
+    }
+    layout->firsts[j]=clen;
+    for (k=j*PDF_OBJSTM; k<layout->nplain && k<(j+1)*PDF_OBJSTM; k++) {
+      obj=&layout->objects[layout->plain[k]];
+      start=obj->body;
+      end=obj->end;
+      pdf_trim(d, &start, &end);
+      if (end > start)
+        memcpy(layout->contents[j]+clen, d+start, end-start);
+      else
+        memcpy(layout->contents[j]+clen, "null", 4);
+      clen+=(end > start)?end-start:4;
+      layout->contents[j][clen++]='\n';
+    }
+    layout->tasks[layout->ntasks+j].in=layout->contents[j];
+    layout->tasks[layout->ntasks+j].inlen=clen;
+  }
+  return 0;
+}
+
+static int pdf_write_xref(struct pdf_layout *layout, const char *d, FILE *fp) {
+  /* writes the cross-reference stream, whose entries hold type, offset or
+     object stream, and generation or index within the object stream */
+  struct pdf_object *obj;
+  char *xref, *xz, *entry;
+  uLongf xlen;
+  off_t offset;
+  long i, k, field2, field3, xrefnum=layout->size-1;
+  int width;
+
+  offset=layout->offsets[xrefnum]=ftello(fp);
+  width=(offset > 0xFFFFFFFFLL)?8:4;
+  xref=calloc(layout->size, 3+width);
+  xlen=compressBound(layout->size*(3+width));
+  xz=malloc(xlen);
+  if (xref == NULL || xz == NULL) {
+    free(xref);
+    free(xz);
+    return 1;
+  }
+  for (i=0; i<layout->size; i++) {
+    obj=(i < layout->nobjects)?&layout->objects[i]:NULL;
+    entry=xref+i*(3+width);
+    field2=layout->offsets[i];
+    field3=0;
+    if (obj == NULL || (obj->defined && (obj->is_stream || obj->gen))) {
+      entry[0]=1;
+      field3=(obj != NULL)?obj->gen:0;
+    }
+    else if (obj->defined) {
+      entry[0]=2;
+      field3=layout->indexes[i];
+    }
+    else if (!i)
+      field3=65535;
+    for (k=0; k<width; k++)
+      entry[1+k]=(field2 >> (8*(width-1-k))) & 0xFF;
+    entry[1+width]=(field3 >> 8) & 0xFF;
+    entry[2+width]=field3 & 0xFF;
+  }
+  if (compress2((Bytef *) xz, &xlen, (const Bytef *) xref, layout->size*(3+width), Z_DEFAULT_COMPRESSION) != Z_OK) {
+    free(xref);
+    free(xz);
+    return 1;
+  }
+  fprintf(fp, "%ld 0 obj\n<< /Type /XRef /Size %ld /W [1 %d 2] /Root %.*s", xrefnum, layout->size, width,
+          (int) (layout->root[1]-layout->root[0]), d+layout->root[0]);
+  if (layout->info[1] > layout->info[0])
+    fprintf(fp, " /Info %.*s", (int) (layout->info[1]-layout->info[0]), d+layout->info[0]);
+  if (layout->id[1] > layout->id[0])
+    fprintf(fp, " /ID %.*s", (int) (layout->id[1]-layout->id[0]), d+layout->id[0]);
+  fprintf(fp, " /Filter /FlateDecode /Length %lu >>\nstream\n", (unsigned long) xlen);
+  fwrite(xz, 1, xlen, fp);
+  fprintf(fp, "\nendstream\nendobj\nstartxref\n%lld\n%%%%EOF\n", (long long) offset);
+  free(xref);
+  free(xz);
+  return 0;
+}
+
+static int pdf_write(struct pdf_layout *layout, const char *d, FILE *fp) {
+  struct pdf_object *obj;
+  struct pdf_task *task;
+  size_t start, end, kstart, vstart, vend, skip[2][2];
+  long i, j;
+
+  fprintf(fp, "%%PDF-%c.%c\n%%\342\343\317\323\n", d[5], (d[5] == '1' && d[7] < '5')?'5':d[7]);
+  for (i=0; i<layout->nobjects; i++) {
+    obj=&layout->objects[i];
+    if (!obj->defined || (!obj->is_stream && !obj->gen))
+      continue;
+    layout->offsets[i]=ftello(fp);
+    fprintf(fp, "%ld %d obj\n", i, obj->gen);
+    start=obj->body;
+    end=obj->end;
+    pdf_trim(d, &start, &end);
+    if (!obj->is_stream) {
+      fwrite(d+start, 1, end-start, fp);
+      fputs("\nendobj\n", fp);
+      continue;
+    }
+    /* the stream dictionary gets a direct /Length and possibly a filter */
+    task=(obj->task >= 0 && layout->tasks[obj->task].out != NULL)?&layout->tasks[obj->task]:NULL;
+    if (end-start < 4 || memcmp(d+end-2, ">>", 2) ||
+        !pdf_dict_value(d, start, end, "/Length", &kstart, &vstart, &vend))
+      return 1;
+    /* a filter that was decoded goes as well */
+    skip[0][0]=kstart;
+    skip[0][1]=vend;
+    skip[1][0]=skip[1][1]=end-2;
+    if (task != NULL && task->filter != F_NONE &&
+        pdf_dict_value(d, start, end, "/Filter", &kstart, &vstart, &vend)) {
+      if (kstart > skip[0][0]) {
+        skip[1][0]=kstart;
+        skip[1][1]=vend;
+      }
+      else {
+        skip[1][0]=skip[0][0];
+        skip[1][1]=skip[0][1];
+        skip[0][0]=kstart;
+        skip[0][1]=vend;
+      }
+    }
+    fwrite(d+start, 1, skip[0][0]-start, fp);
+    fwrite(d+skip[0][1], 1, skip[1][0]-skip[0][1], fp);
+    fwrite(d+skip[1][1], 1, end-2-skip[1][1], fp);
+    fprintf(fp, "%s /Length %zu>>\nstream\n", (task != NULL)?" /Filter /FlateDecode":"",
+            (task != NULL)?task->outlen:obj->length);
+    if (task != NULL)
+      fwrite(task->out, 1, task->outlen, fp);
+    else
+      fwrite(d+obj->data, 1, obj->length, fp);
+    fputs("\nendstream\nendobj\n", fp);
+  }
+  for (j=0; j<layout->nstm; j++) {
+    task=&layout->tasks[layout->ntasks+j];
+    layout->offsets[layout->nobjects+j]=ftello(fp);
+    fprintf(fp, "%ld 0 obj\n<< /Type /ObjStm /N %ld /First %zu%s /Length %zu >>\nstream\n",
+            layout->nobjects+j, ((j+1)*PDF_OBJSTM < layout->nplain)?PDF_OBJSTM:layout->nplain-j*PDF_OBJSTM,
+            layout->firsts[j], (task->out != NULL)?" /Filter /FlateDecode":"",
+            (task->out != NULL)?task->outlen:task->inlen);
+    fwrite((task->out != NULL)?task->out:task->in, 1, (task->out != NULL)?task->outlen:task->inlen, fp);
+    fputs("\nendstream\nendobj\n", fp);
+  }
+  return pdf_write_xref(layout, d, fp);
+}
+
+static int optimize_pdf(const char *d, size_t len, int fdout) {
+  /* writes the optimised PDF to fdout; returns -1 without writing anything
+     if the PDF has to be passed through as it is */
+  struct pdf_layout layout;
+  FILE *fp;
+  long i, compressed=0;
+  int result;
+
+  memset(&layout, 0, sizeof(layout));
+  if (pdf_prepare(d, len, &layout)) {
+    pdf_free(&layout);
+    return -1;
+  }
+  pdf_run_pool(layout.tasks, layout.ntasks+layout.nstm);
+  for (i=0; i<layout.ntasks; i++)
+    compressed+=(layout.tasks[i].out != NULL);
+
+  if ((fp=fdopen(dup(fdout), "w")) == NULL) {
+    pdf_free(&layout);
+    return 1;
+  }
+  result=pdf_write(&layout, d, fp);
+  if (ferror(fp))
+    result=1;
+  if (fclose(fp))
+    result=1;
+  if (!result)
+    log_event(CPDEBUG, "PDF optimised: %ld streams compressed, %ld objects packed into %ld object streams",
+              compressed, layout.nplain, layout.nstm);
+  pdf_free(&layout);
+  return result;
+}
+
+static int passthrough_optimized(int fdin, int fdout) {
+  /* loads the PDF into memory and writes it optimised if it reaches the
+     PDFOptimize size; returns -1 if the input was left untouched for the
+     plain copy */
+  struct stat fstatus;
+  cp_string buffer;
+  char *data=NULL, *tmp;
+  size_t len, size;
+  ssize_t count;
+  int result;
+
+  if (pdf_offset >= 0 && !fstat(fdin, &fstatus) && S_ISREG(fstatus.st_mode)) {
+    if (fstatus.st_size-pdf_offset < (off_t)Conf_PDFOptimize*1024)
+      return -1;
+    /* read rather than mapped, the file may be truncated meanwhile */
+    size=fstatus.st_size-pdf_offset;
+    if ((off_t) size != fstatus.st_size-pdf_offset || (data=malloc(size)) == NULL)
+      return -1;
+    for (len=0; len < size; len+=count) {
+      count=pread(fdin, data+len, size-len, (off_t)pdf_offset+len);
+      if (count < 0 && errno == EINTR)
+        count=0;
+      else if (count <= 0)
+        break;
+    }
+    if (len < size) {
+      free(data);
+      return -1;
+    }
+    if (fstatus.st_size > src_reader.offset+(off_t)src_reader.len)
+      trace->input_bytes+=fstatus.st_size-(src_reader.offset+src_reader.len);
+  }
+  else {
+    len=src_reader.len-src_reader.pos;
+    size=len+1048576;
+    if ((data=malloc(size)) == NULL)
+      return -1;
+    memcpy(data, src_reader.data+src_reader.pos, len);
+    while ((count=read(fdin, data+len, size-len)) != 0) {
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count < 0) {
+        free(data);
+        return 1;
+      }
+      trace->input_bytes+=count;
+      len+=count;
+      if (len == size) {
+        if ((tmp=realloc(data, size*2)) == NULL) {
+          /* no room for the whole PDF, copy what there is and the rest */
+          result=write_all(fdout, data, len);
+          free(data);
+          while (!result && (count=read(fdin, buffer, BUFSIZE)) != 0) {
+            if (count < 0 && errno == EINTR)
+              continue;
+            result=(count < 0 || write_all(fdout, buffer, count));
+            trace->input_bytes+=(count > 0)?count:0;
+          }
+          return result;
+        }
+        data=tmp;
+        size*=2;
+      }
+    }
+  }
+
+  result=(len >= (size_t)Conf_PDFOptimize*1024)?optimize_pdf(data, len, fdout):-1;
+  if (result < 0)
+    result=write_all(fdout, data, len);
+  free(data);
+  return result;
+}
+
+static int passthrough_pdf(FILE *fpsrc, char *outfile) {
+  /* copies the PDF data left in fpsrc by preparespoolfile() straight into
+     outfile - has to be called with the privileges of the target user */
+  cp_string buffer;
+  struct stat fstatus;
+  ssize_t count;
+  int fdin, fdout;
+
+  fdout=open(outfile, O_WRONLY|O_CREAT|O_EXCL, 0600);
+  if (fdout < 0) {
+    log_event(CPERROR, "failed to create output file: %s", outfile);
+    return 1;
+  }
+  fdin=fileno(fpsrc);
+
+  if (Conf_PDFOptimize > 0 && (count=passthrough_optimized(fdin, fdout)) >= 0) {
+    if (count) {
+      log_event(CPERROR, "failed to write PDF data to output file: %s", outfile);
+      (void) close(fdout);
+      return 1;
+    }
+  }
+  else if (pdf_offset >= 0 && !fstat(fdin, &fstatus) && S_ISREG(fstatus.st_mode)) {
+    if (copy_file_data(fdin, (off_t)pdf_offset, fstatus.st_size, fdout)) {
+      log_event(CPERROR, "failed to copy PDF data to output file: %s", outfile);
+      (void) close(fdout);
+      return 1;
+    }
+    if (fstatus.st_size > src_reader.offset+(off_t)src_reader.len)
+      trace->input_bytes+=fstatus.st_size-(src_reader.offset+src_reader.len);
+  }
+  else {
+    if (write_all(fdout, src_reader.data+src_reader.pos, src_reader.len-src_reader.pos)) {
+      log_event(CPERROR, "failed to write PDF data to output file: %s", outfile);
+      (void) close(fdout);
+      return 1;
+    }
+#ifdef __linux__
+    /* the rest of a pipe is moved into the output file by the kernel */
+    while ((count=splice(fdin, NULL, fdout, NULL, READSIZE, SPLICE_F_MOVE|SPLICE_F_MORE)) != 0) {
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count < 0)
+        break;
+      trace->input_bytes+=count;
+    }
+    if (count < 0 && errno != EINVAL) {
+      log_event(CPERROR, "failed to write PDF data to output file: %s", outfile);
+      (void) close(fdout);
+      return 1;
+    }
+    if (count < 0)
+      log_event(CPDEBUG, "splice not available, copying PDF data");
+#endif
+    while ((count=read(fdin, buffer, BUFSIZE)) != 0) {
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count < 0 || write_all(fdout, buffer, count)) {
+        log_event(CPERROR, "failed to write PDF data to output file: %s", outfile);
+        (void) close(fdout);
+        return 1;
+      }
+      trace->input_bytes+=count;
+    }
+  }
+
+  log_event(CPDEBUG, "PDF data written to output file: %s", outfile);
+  return close(fdout);
+}
+
+static void stream_postscript(FILE *fpsrc, int fd) {
+  /* feeds the header read by preparespoolfile() and the remaining
+     postscript code into the pipe to the converter */
+  FILE *fpdest;
+
+  fpdest=fdopen(fd, "w");
+  if (fpdest == NULL) {
+    log_event(CPERROR, "failed to open pipe to GhostScript");
+    (void) close(fd);
+    (void) fclose(fpsrc);
+    return;
+  }
+  (void) fwrite(ps_header, sizeof(char), ps_header_len, fpdest);
+  free(ps_header);
+  ps_header=NULL;
+  if (!ps_finished) {
+    log_event(CPDEBUG, "now streaming postscript code");
+    (void) extract_postscript(fpdest, NULL, 0);
+  }
+  reader_close(&src_reader);
+  if (ferror(fpdest))
+    log_event(CPERROR, "GhostScript stopped reading postscript code");
+  (void) fclose(fpdest);
+  (void) fclose(fpsrc);
+  log_event(CPDEBUG, "all data streamed to GhostScript");
+  return;
+}
+
+static void stream_spool(char *spoolfile, int fd) {
+  /* decompresses the compressed spool file into the pipe to the converter */
+  char buffer[READSIZE];
+  long long total=0;
+  double start, elapsed=0;
+  gzFile gz;
+  int count;
+
+  gz=gzopen(spoolfile, "rb");
+  if (gz == NULL) {
+    log_event(CPERROR, "failed to open compressed spoolfile: %s", spoolfile);
+    (void) close(fd);
+    return;
+  }
+  (void) gzbuffer(gz, READSIZE);
+  for (;;) {
+    start=trace_clock();
+    count=gzread(gz, buffer, READSIZE);
+    elapsed+=trace_clock()-start;
+    if (count <= 0)
+      break;
+    if (write_all(fd, buffer, count)) {
+      log_event(CPERROR, "GhostScript stopped reading postscript code");
+      break;
+    }
+    total+=count;
+  }
+  if (count < 0)
+    log_event(CPERROR, "failed to decompress spoolfile: %s", spoolfile);
+  (void) gzclose(gz);
+  (void) close(fd);
+  log_event(CPDEBUG, "spool decompressed into GhostScript: %lld bytes at %.1f MB/s", total,
+            (elapsed > 0)?total/elapsed/1048576:0);
+  return;
+}
+
+/* GhostScript profiles: the arguments of GSProfile<class> are inserted
+   into GSCall after the GhostScript executable, with the resources left to
+   one conversion by CPU affinity, cgroup limits and MaxConverters */
+
+#define PROFILE_IMAGE_SHARE 50          /* percent of image data of an image job */
+#define PROFILE_LARGE_PAGES 100
+#define PROFILE_LARGE_BYTES (64LL << 20)
+#define PROFILE_BUFFERSPACE (256LL << 20) /* highest ${BUFFERSPACE} */
+#define PROFILE_MAXBITMAP (1LL << 30)   /* highest ${MAXBITMAP} */
+
+static long long cgroup_value(const char *base, const char *dir, const char *name, long long *second) {
+  /* reads a cgroup file holding a number or "max", -1 for max or error;
+     second is set to a second number on the same line */
+  cp_string path, line;
+  FILE *fp;
+  long long value=-1;
+
+  line[0]='\0';
+  if (build_path(path, "%s%s/%s", base, dir, name) || (fp=fopen(path, "r")) == NULL)
+    return -1;
+  if (fgets(line, BUFSIZE, fp) != NULL && strncmp(line, "max", 3))
+    value=atoll(line);
+  if (second != NULL && strchr(line, ' ') != NULL)
+    *second=atoll(strchr(line, ' ')+1);
+  (void) fclose(fp);
+  return value;
+}
+
+static void cgroup_limits(const char *base, char *dir, int v2, long *threads, long long *memory) {
+  /* lowers threads and memory to the limits of cgroup dir below base and
+     of its parents, found in the files of cgroup v2 or v1 */
+  long long quota, period=0, limit, usage;
+  char *slash;
+
+  for (;;) {
+    if (v2)
+      quota=cgroup_value(base, dir, "cpu.max", &period);
+    else {
+      quota=cgroup_value(base, dir, "cpu.cfs_quota_us", NULL);
+      period=cgroup_value(base, dir, "cpu.cfs_period_us", NULL);
+    }
+    if (quota > 0 && period > 0 && (quota+period-1)/period < *threads)
+      *threads=(quota+period-1)/period;
+    limit=cgroup_value(base, dir, (v2)?"memory.max":"memory.limit_in_bytes", NULL);
+    usage=cgroup_value(base, dir, (v2)?"memory.current":"memory.usage_in_bytes", NULL);
+    if (limit > 0 && (*memory < 0 || limit-usage < *memory))
+      *memory=(limit > usage)?limit-usage:0;
+    if (strlen(dir) <= 1 || (slash=strrchr(dir, '/')) == NULL)
+      break;
+    *slash='\0';
+  }
+  return;
+}
+
+static void gs_resources(long *threads, long long *memory) {
+  /* CPUs and bytes of memory left to a single conversion */
+  cpu_set_t cpus;
+  cp_string line, base;
+  FILE *fp;
+  char *controllers, *dir;
+
+  *threads=(!sched_getaffinity(0, sizeof(cpus), &cpus))?CPU_COUNT(&cpus):sysconf(_SC_NPROCESSORS_ONLN);
+  *memory=-1;
+  if ((fp=fopen("/proc/meminfo", "r")) != NULL) {
+    while (fgets(line, BUFSIZE, fp) != NULL)
+      if (sscanf(line, "MemAvailable: %lld", memory) == 1) {
+        *memory*=1024;
+        break;
+      }
+    (void) fclose(fp);
+  }
+
+  /* lines are "0::dir" for cgroup v2, "n:controllers:dir" for v1 */
+  if ((fp=fopen("/proc/self/cgroup", "r")) != NULL) {
+    while (fgets(line, BUFSIZE, fp) != NULL) {
+      line[strcspn(line, "\n")]='\0';
+      if ((controllers=strchr(line, ':')) == NULL || (dir=strchr(++controllers, ':')) == NULL)
+        continue;
+      *dir++='\0';
+      if (!strlen(controllers))
+        cgroup_limits("/sys/fs/cgroup", dir, 1, threads, memory);
+      else if (!strcmp(controllers, "memory") || !strncmp(controllers, "cpu,", 4) ||
+               !strcmp(controllers, "cpu")) {
+        if (!build_path(base, "/sys/fs/cgroup/%s", controllers))
+          cgroup_limits(base, dir, 0, threads, memory);
+      }
+    }
+    (void) fclose(fp);
+  }
+
+  if (Conf_MaxConverters > 1) {
+    *threads/=Conf_MaxConverters;
+    *memory/=Conf_MaxConverters;
+  }
+  if (*threads < 1)
+    *threads=1;
+  return;
+}
+
+static char *gs_profile(cp_string template) {
+  /* classifies the spooled job and returns GSCall with the arguments of
+     its profile in template, or GSCall itself if there are none */
+  const char *name, *profile, *src, *first;
+  long long memory, buffer, bitmap, value;
+  long threads;
+  int pages=(job_index.npages)?job_index.npages:job_index.declared_pages;
+  size_t len;
+
+  if (!profiling)
+    return Conf_GSCall;
+  if (pages < 0)
+    pages=0;
+  if (spool_offset && (profile_data*100/spool_offset >= PROFILE_IMAGE_SHARE ||
+      (pages && profile_images >= pages))) {
+    name="image";
+    profile=Conf_GSProfileImage;
+  }
+  else if (pages >= PROFILE_LARGE_PAGES || spool_offset >= PROFILE_LARGE_BYTES) {
+    name="large";
+    profile=Conf_GSProfileLarge;
+  }
+  else {
+    name="text";
+    profile=Conf_GSProfileText;
+  }
+  log_event(CPSTATUS, "GhostScript profile %s: %d pages, %lld bytes, %lld image operators, %lld bytes image data",
+            name, pages, spool_offset, profile_images, profile_data);
+  if (!strlen(profile) || (first=strstr(Conf_GSCall, "%s")) == NULL)
+    return Conf_GSCall;
+
+  gs_resources(&threads, &memory);
+  if (memory < 0)
+    memory=256LL << 20;
+  buffer=(memory/8 < PROFILE_BUFFERSPACE)?memory/8:PROFILE_BUFFERSPACE;
+  bitmap=(memory/4 < PROFILE_MAXBITMAP)?memory/4:PROFILE_MAXBITMAP;
+  log_event(CPDEBUG, "resources for GhostScript: %ld threads, %lld bytes memory", threads, memory);
+
+  len=first+2-Conf_GSCall;
+  memcpy(template, Conf_GSCall, len);
+  template[len++]=' ';
+  for (src=profile; *src && len < BUFSIZE-64; ) {
+    value=-1;
+    if (!strncmp(src, "${THREADS}", 10))
+      value=threads;
+    else if (!strncmp(src, "${BUFFERSPACE}", 14))
+      value=buffer;
+    else if (!strncmp(src, "${MAXBITMAP}", 12))
+      value=bitmap;
+    if (value >= 0) {
+      len+=sprintf(template+len, "%lld", value);
+      src=strchr(src, '}')+1;
+    }
+    else if (*src == '%') {
+      /* the template is used as a format string */
+      template[len++]='%';
+      template[len++]=*src++;
+    }
+    else
+      template[len++]=*src++;
+  }
+  if (*src || snprintf(template+len, BUFSIZE-len, "%s", first+2) >= BUFSIZE-len) {
+    log_event(CPERROR, "GhostScript call with profile %s too long, using GSCall", name);
+    return Conf_GSCall;
+  }
+  log_event(CPDEBUG, "GhostScript call with profile %s: %s", name, template);
+  return template;
+}
+
+static void free_argv(char **args) {
+  int i;
+
+  if (args == NULL)
+    return;
+  for (i=0; args[i] != NULL; i++)
+    free(args[i]);
+  free(args);
+  return;
+}
+
+static char **build_argv(char *template, char *values[], int nvalues) {
+  /* splits a command line template like GSCall into an argument vector,
+     substituting %s after splitting so values never need quoting;
+     returns NULL if the template relies on other shell features */
+  char **args, **tmp, *arg, *src;
+  int nargs=0, len, quoted, next=0, i;
+  char quote;
+
+  if ((args=calloc(1, sizeof(char *))) == NULL)
+    return NULL;
+  src=template;
+  while (1) {
+    while (*src == ' ' || *src == '\t')
+      src++;
+    if (!*src)
+      break;
+    len=0;
+    for (i=0; i<nvalues; i++)
+      len+=strlen(values[i]);
+    if ((arg=calloc(strlen(src)+len+1, sizeof(char))) == NULL) {
+      free_argv(args);
+      return NULL;
+    }
+    len=0;
+    quoted=0;
+    quote='\0';
+    for (; *src && (quote || (*src != ' ' && *src != '\t')); src++) {
+      if (quote && *src == quote)
+        quote='\0';
+      else if (!quote && (*src == '"' || *src == '\'')) {
+        quote=*src;
+        quoted=1;
+      }
+      else if (quote != '\'' && *src == '\\' && src[1] && strchr("\"\\ ", src[1]))
+        arg[len++]=*++src;
+      else if (*src == '%' && src[1] == 's') {
+        if (next < nvalues) {
+          strcpy(arg+len, values[next]);
+          len+=strlen(values[next]);
+        }
+        next++;
+        src++;
+      }
+      else if (*src == '%' && src[1] == '%')
+        arg[len++]=*src++;
+      else if ((quote != '\'' && strchr("$`", *src)) || (!quote && strchr("|&;<>()*?[~\\", *src))) {
+        free(arg);
+        free_argv(args);
+        return NULL;
+      }
+      else
+        arg[len++]=*src;
+    }
+    if (quote) {
+      free(arg);
+      free_argv(args);
+      return NULL;
+    }
+    if (!len && !quoted) {
+      free(arg);
+      continue;
+    }
+    if ((tmp=realloc(args, (nargs+2)*sizeof(char *))) == NULL) {
+      free(arg);
+      free_argv(args);
+      return NULL;
+    }
+    args=tmp;
+    args[nargs++]=arg;
+    args[nargs]=NULL;
+  }
+  if (!nargs) {
+    free(args);
+    return NULL;
+  }
+  return args;
+}
+
+static void log_usage(int status, struct rusage *usage, char *name) {
+  if (WIFEXITED(status))
+    log_event(CPSTATUS, "exit status %d, user %ld.%03lds, system %ld.%03lds, max RSS %ld kB",
+              WEXITSTATUS(status), (long) usage->ru_utime.tv_sec, (long) usage->ru_utime.tv_usec/1000,
+              (long) usage->ru_stime.tv_sec, (long) usage->ru_stime.tv_usec/1000, usage->ru_maxrss);
+  else if (WIFSIGNALED(status))
+    log_event(CPERROR, "terminated by signal %d: %s", WTERMSIG(status), name);
+  return;
+}
+
+static pid_t spawn_command(char **args) {
+  pid_t pid;
+  int error;
+
+  error=posix_spawnp(&pid, args[0], NULL, NULL, args, environ);
+  if (error) {
+    errno=error;
+    log_event(CPERROR, "failed to start: %s", args[0]);
+    return -1;
+  }
+  return pid;
+}
+
+static int wait_command(pid_t pid, char *name) {
+  struct rusage usage;
+  int status;
+
+  while (wait4(pid, &status, 0, &usage) < 0)
+    if (errno != EINTR) {
+      log_event(CPERROR, "failed to wait for: %s", name);
+      return -1;
+    }
+  log_usage(status, &usage, name);
+  return status;
+}
+
+static int run_command(char **args, char *command) {
+  /* runs args directly, or command through the shell if there is no
+     argument vector, and logs exit status and resource usage */
+  struct rusage usage;
+  pid_t pid;
+  int status;
+
+  if (args == NULL) {
+    log_event(CPDEBUG, "running through the shell: %s", command);
+    status=system(command);
+    if (getrusage(RUSAGE_CHILDREN, &usage))
+      memset(&usage, 0, sizeof(usage));
+    log_usage(status, &usage, command);
+    return status;
+  }
+  if ((pid=spawn_command(args)) < 0)
+    return -1;
+  return wait_command(pid, args[0]);
+}
+
+/* the partial PDFs of a parallel conversion are merged without converting
+   them again: their objects are renumbered one part after the other and a
+   new page tree root takes the page trees of all parts as its kids; the
+   catalog, document information and ID are those of the first part, so
+   later parts with document level entries in their catalog (bookmarks,
+   named destinations, page labels, forms) cannot be merged this way */
+
+static const char *pdf_document_keys[] = { "/Outlines", "/Names", "/Dests", "/PageLabels",
+  "/AcroForm", "/StructTreeRoot", NULL };
+
+struct pdf_part {
+  const char *d;
+  size_t len, trailer;
+  struct pdf_object *objects;
+  long nobjects, base, catalog, pages, count;
+};
+
+static int pdf_reference(const char *d, size_t start, size_t end, long *num) {
+  long gen;
+  size_t pos;
+
+  pos=pdf_token(d, end, start);
+  if (!pdf_integer(d, start, pos, num))
+    return 0;
+  start=pdf_skip_space(d, end, pos);
+  pos=pdf_token(d, end, start);
+  if (!pdf_integer(d, start, pos, &gen))
+    return 0;
+  start=pdf_skip_space(d, end, pos);
+  return pdf_is(d, start, pdf_token(d, end, start), "R");
+}
+
+static void pdf_renumber(FILE *fp, const char *d, size_t start, size_t end, long base) {
+  /* copies object text, adding base to the indirect references in it */
+  size_t copied=start, pos=start, tend, pos2, end2, pos3, end3;
+  long num, gen;
+
+  while ((pos=pdf_skip_space(d, end, pos)) < end) {
+    tend=pdf_token(d, end, pos);
+    if (pdf_integer(d, pos, tend, &num)) {
+      pos2=pdf_skip_space(d, end, tend);
+      end2=pdf_token(d, end, pos2);
+      pos3=pdf_skip_space(d, end, end2);
+      end3=pdf_token(d, end, pos3);
+      if (pdf_integer(d, pos2, end2, &gen) && pdf_is(d, pos3, end3, "R")) {
+        fwrite(d+copied, 1, pos-copied, fp);
+        fprintf(fp, "%ld %ld R", num+base, gen);
+        copied=tend=end3;
+      }
+    }
+    pos=tend;
+  }
+  fwrite(d+copied, 1, end-copied, fp);
+  return;
+}
+
+static int pdf_merge_prepare(struct pdf_part *part) {
+  /* finds catalog and page tree root of a part; encrypted parts and parts
+     with cross-reference streams are not merged */
+  struct pdf_object *obj;
+  size_t kstart, vstart, vend, start, end;
+
+  if (part->len < 8 || memcmp(part->d, "%PDF-", 5) ||
+      pdf_scan(part->d, part->len, &part->objects, &part->nobjects, &part->trailer) ||
+      pdf_resolve_lengths(part->d, part->len, part->objects, part->nobjects) ||
+      pdf_dict_value(part->d, part->trailer, part->len, "/Encrypt", &kstart, &vstart, &vend) ||
+      !pdf_dict_value(part->d, part->trailer, part->len, "/Root", &kstart, &vstart, &vend) ||
+      !pdf_reference(part->d, vstart, vend, &part->catalog) ||
+      part->catalog >= part->nobjects || !part->objects[part->catalog].defined)
+    return 1;
+  obj=&part->objects[part->catalog];
+  if (!pdf_dict_value(part->d, obj->body, obj->end, "/Pages", &kstart, &vstart, &vend) ||
+      !pdf_reference(part->d, vstart, vend, &part->pages) ||
+      part->pages >= part->nobjects || !part->objects[part->pages].defined)
+    return 1;
+  obj=&part->objects[part->pages];
+  start=obj->body;
+  end=obj->end;
+  pdf_trim(part->d, &start, &end);
+  return (obj->is_stream || end-start < 4 || memcmp(part->d+end-2, ">>", 2) ||
+          pdf_dict_value(part->d, start, end, "/Parent", &kstart, &vstart, &vend) ||
+          !pdf_dict_value(part->d, start, end, "/Count", &kstart, &vstart, &vend) ||
+          !pdf_integer(part->d, vstart, pdf_token(part->d, vend, vstart), &part->count));
+}
+
+static const char *pdf_document_entry(struct pdf_part *part) {
+  /* the first document level entry in the catalog of a part, if any */
+  struct pdf_object *obj=&part->objects[part->catalog];
+  size_t kstart, vstart, vend;
+  int i;
+
+  for (i=0; pdf_document_keys[i] != NULL; i++)
+    if (pdf_dict_value(part->d, obj->body, obj->end, pdf_document_keys[i], &kstart, &vstart, &vend))
+      return pdf_document_keys[i];
+  return NULL;
+}
+
+static int pdf_merge_write(struct pdf_part *parts, int nparts, FILE *fp) {
+  struct pdf_part *part;
+  struct pdf_object *obj;
+  off_t *offsets;
+  size_t start, end, kstart, vstart, vend;
+  long i, root, size, count=0;
+  int k, *gens;
+
+  root=parts[nparts-1].base+parts[nparts-1].nobjects;
+  size=root+1;
+  offsets=calloc(size, sizeof(off_t));
+  gens=calloc(size, sizeof(int));
+  if (offsets == NULL || gens == NULL) {
+    free(offsets);
+    free(gens);
+    return 1;
+  }
+  part=&parts[0];
+  fprintf(fp, "%%PDF-%c.%c\n%%\342\343\317\323\n", part->d[5], part->d[7]);
+  for (k=0; k<nparts; k++) {
+    part=&parts[k];
+    for (i=0; i<part->nobjects; i++) {
+      obj=&part->objects[i];
+      if (!obj->defined || (k && i == part->catalog))
+        continue;
+      offsets[part->base+i]=ftello(fp);
+      gens[part->base+i]=obj->gen;
+      fprintf(fp, "%ld %d obj\n", part->base+i, obj->gen);
+      start=obj->body;
+      end=obj->end;
+      pdf_trim(part->d, &start, &end);
+      if (i == part->pages) {
+        pdf_renumber(fp, part->d, start, end-2, part->base);
+        fprintf(fp, " /Parent %ld 0 R>>", root);
+      }
+      else if (i == part->catalog) {
+        (void) pdf_dict_value(part->d, start, end, "/Pages", &kstart, &vstart, &vend);
+        pdf_renumber(fp, part->d, start, vstart, part->base);
+        fprintf(fp, "%ld 0 R", root);
+        pdf_renumber(fp, part->d, vend, end, part->base);
+      }
+      else
+        pdf_renumber(fp, part->d, start, end, part->base);
+      if (obj->is_stream) {
+        fputs("\nstream\n", fp);
+        fwrite(part->d+obj->data, 1, obj->length, fp);
+        fputs("\nendstream", fp);
+      }
+      fputs("\nendobj\n", fp);
+    }
+  }
+  offsets[root]=ftello(fp);
+  fprintf(fp, "%ld 0 obj\n<< /Type /Pages /Kids [", root);
+  for (k=0; k<nparts; k++) {
+    fprintf(fp, "%s%ld 0 R", (k)?" ":"", parts[k].base+parts[k].pages);
+    count+=parts[k].count;
+  }
+  fprintf(fp, "] /Count %ld >>\nendobj\n", count);
+
+  start=ftello(fp);
+  fprintf(fp, "xref\n0 %ld\n", size);
+  for (i=0; i<size; i++)
+    if (offsets[i])
+      fprintf(fp, "%010lld %05d n \n", (long long) offsets[i], gens[i]);
+    else
+      fputs("0000000000 65535 f \n", fp);
+  part=&parts[0];
+  fprintf(fp, "trailer\n<< /Size %ld /Root %ld 0 R", size, part->catalog);
+  if (pdf_dict_value(part->d, part->trailer, part->len, "/Info", &kstart, &vstart, &vend)) {
+    fputs(" /Info ", fp);
+    pdf_renumber(fp, part->d, vstart, vend, 0);
+  }
+  if (pdf_dict_value(part->d, part->trailer, part->len, "/ID", &kstart, &vstart, &vend)) {
+    fputs(" /ID ", fp);
+    fwrite(part->d+vstart, 1, vend-vstart, fp);
+  }
+  fprintf(fp, " >>\nstartxref\n%zu\n%%%%EOF\n", start);
+  free(offsets);
+  free(gens);
+  return 0;
+}
+
+static int pdf_merge(char **names, int nparts, char *outfile) {
+  /* merges the PDF files into outfile; returns non-zero if they cannot be
+     merged this way */
+  struct pdf_part parts[64];
+  struct stat fstatus;
+  const char *key;
+  FILE *fp;
+  int k, fd, result=1;
+
+  memset(parts, 0, sizeof(parts));
+  for (k=0; k<nparts; k++) {
+    if ((fd=open(names[k], O_RDONLY)) < 0)
+      break;
+    if (!fstat(fd, &fstatus) && fstatus.st_size > 0) {
+      parts[k].d=mmap(NULL, fstatus.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      parts[k].len=(parts[k].d != MAP_FAILED)?(size_t) fstatus.st_size:0;
+    }
+    (void) close(fd);
+    if (!parts[k].len || pdf_merge_prepare(&parts[k])) {
+      log_event(CPDEBUG, "partial PDF file cannot be merged directly: %s", names[k]);
+      break;
+    }
+    if (k && (key=pdf_document_entry(&parts[k])) != NULL) {
+      log_event(CPDEBUG, "partial PDF file has %s in its catalog: %s", key, names[k]);
+      break;
+    }
+    parts[k].base=(k)?parts[k-1].base+parts[k-1].nobjects:0;
+  }
+  if (k == nparts && (fp=fopen(outfile, "w")) != NULL) {
+    result=pdf_merge_write(parts, nparts, fp);
+    if (ferror(fp))
+      result=1;
+    if (fclose(fp))
+      result=1;
+  }
+  for (k=0; k<nparts; k++) {
+    if (parts[k].len)
+      (void) munmap((void *) parts[k].d, parts[k].len);
+    free(parts[k].objects);
+  }
+  return result;
+}
+
+static int gs_executable(char *template) {
+  /* position of the GhostScript executable in the argument vector of a
+     GSCall template (after any wrapper like nice or env), -1 if it is not
+     an argument of its own */
+  char **args, *values[4];
+  int i;
+
+  values[0]=Conf_GhostScript;
+  values[1]=Conf_PDFVer;
+  values[2]=values[3]="-";
+  args=build_argv(template, values, 4);
+  for (i=0; args != NULL && args[i] != NULL && strcmp(args[i], Conf_GhostScript); i++);
+  i=(args != NULL && args[i] != NULL)?i:-1;
+  free_argv(args);
+  return i;
+}
+
+static int parallel_ranges(void) {
+  /* number of page ranges the spooled job is to be converted in, 0 if it
+     is converted as a whole */
+  if (Conf_ParallelWorkers < 2 || spool_compressed || !job_index.conforming ||
+      job_index.npages < 2 || job_index.npages < Conf_ParallelMinPages || gs_executable(Conf_GSCall) < 0)
+    return 0;
+  return (job_index.npages < Conf_ParallelWorkers)?job_index.npages:Conf_ParallelWorkers;
+}
+
+static int convert_parallel(char *spoolfile, char *outfile, char *gsformat, int ranges) {
+  /* converts at most ranges page ranges of the spool file concurrently and
+     merges the partial PDFs into outfile; returns -1 if the job has to be
+     converted as a whole */
+  cp_string dir, chunk, part;
+  struct stat fstatus;
+  long long *pages=job_pages, trailer=job_index.trailer;
+  off_t start, stop;
+  pid_t *pids=NULL;
+  char **args=NULL, **tmp, *values[4], *parts[64];
+  int npages=job_index.npages, nchunks, spoolfd=-1, fd, k, nargs, gs, status=-1;
+
+  if (Conf_ParallelWorkers < 2)
+    return -1;
+  if (spool_compressed) {
+    log_event(CPDEBUG, "converting compressed spool as a whole");
+    return -1;
+  }
+  nchunks=parallel_ranges();
+  if (!nchunks) {
+    log_event(CPDEBUG, "converting job as a whole (%d pages with usable DSC structure, "
+              "GhostScript %sfound in GSCall)", npages, (gs_executable(Conf_GSCall) < 0)?"not ":"");
+    return -1;
+  }
+  if (ranges < 2) {
+    log_event(CPDEBUG, "converting job as a whole (one converter slot for %d page ranges)", nchunks);
+    return -1;
+  }
+  nchunks=(ranges < nchunks)?ranges:nchunks;
+  /* GSProfile arguments follow the executable, which stays in place */
+  gs=gs_executable(gsformat);
+  log_event(CPDEBUG, "converting %d pages in %d parallel ranges", npages, nchunks);
+
+  if (build_path(dir, "%s/cups2pdf-XXXXXX", (getenv("TMPDIR") != NULL)?getenv("TMPDIR"):"/tmp")) {
+    log_event(CPERROR, "temporary directory name too long: %s", dir);
+    return -1;
+  }
+  if (mkdtemp(dir) == NULL || (spoolfd=open(spoolfile, O_RDONLY)) < 0 || fstat(spoolfd, &fstatus) ||
+      (pids=calloc(nchunks, sizeof(pid_t))) == NULL) {
+    log_event(CPERROR, "failed to prepare parallel conversion in: %s", dir);
+    if (spoolfd >= 0)
+      (void) close(spoolfd);
+    (void) rmdir(dir);
+    return -1;
+  }
+
+  status=0;
+  for (k=0; k<nchunks; k++) {
+    pids[k]=-1;
+    start=pages[k*npages/nchunks];
+    stop=((k+1)*npages/nchunks < npages)?pages[(k+1)*npages/nchunks]:((trailer >= 0)?trailer:fstatus.st_size);
+    fd=-1;
+    if (build_path(chunk, "%s/chunk%03d.ps", dir, k) || build_path(part, "%s/part%03d.pdf", dir, k) ||
+        (fd=open(chunk, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0 || copy_file_data(spoolfd, 0, pages[0], fd) || copy_file_data(spoolfd, start, stop, fd) ||
+        (trailer >= 0 && copy_file_data(spoolfd, trailer, fstatus.st_size, fd))) {
+      log_event(CPERROR, "failed to write page range: %s", chunk);
+      if (fd >= 0)
+        (void) close(fd);
+      status=-1;
+      break;
+    }
+    (void) close(fd);
+    values[0]=Conf_GhostScript;
+    values[1]=Conf_PDFVer;
+    values[2]=part;
+    values[3]=chunk;
+    /* cross-reference tables rather than streams, so the parts can be
+       merged; older GhostScript versions write them anyway */
+    args=build_argv(gsformat, values, 4);
+    for (nargs=0; args != NULL && args[nargs] != NULL; nargs++);
+    if (args != NULL && gs >= 0 && gs < nargs && (tmp=realloc(args, (nargs+3)*sizeof(char *))) != NULL) {
+      args=tmp;
+      memmove(args+gs+3, args+gs+1, (nargs-gs)*sizeof(char *));
+      args[gs+1]=strdup("-dWriteXRefStm=false");
+      args[gs+2]=strdup("-dWriteObjStms=false");
+    }
+    else {
+      free_argv(args);
+      args=NULL;
+    }
+    if (args == NULL || args[gs+1] == NULL || args[gs+2] == NULL || (pids[k]=spawn_command(args)) < 0)
+      status=-1;
+    free_argv(args);
+    args=NULL;
+    if (status)
+      break;
+  }
+  (void) close(spoolfd);
+  for (k=0; k<nchunks; k++)
+    if (pids[k] > 0 && wait_command(pids[k], "ghostscript page range"))
+      status=-1;
+
+  if (!status) {
+    for (k=0; k<nchunks; k++) {
+      parts[k]=(build_path(part, "%s/part%03d.pdf", dir, k))?NULL:strdup(part);
+      if (parts[k] == NULL)
+        status=-1;
+    }
+    log_event(CPDEBUG, "merging %d partial PDF files", nchunks);
+    if (!status)
+      status=pdf_merge(parts, nchunks, outfile);
+    for (k=0; k<nchunks; k++)
+      free(parts[k]);
+    if (status) {
+      log_event(CPDEBUG, "partial PDF files not merged, converting job as a whole");
+      status=-1;
+    }
+  }
+
+  for (k=0; k<nchunks; k++) {
+    if (!build_path(chunk, "%s/chunk%03d.ps", dir, k))
+      (void) unlink(chunk);
+    if (!build_path(part, "%s/part%03d.pdf", dir, k))
+      (void) unlink(part);
+  }
+  if (rmdir(dir))
+    log_event(CPERROR, "failed to remove temporary directory: %s (non fatal)", dir);
+  free(pids);
+  return status;
+}
+
+static int gsd_timeouts(int fd, int seconds) {
+  struct timeval timeout;
+
+  timeout.tv_sec=seconds;
+  timeout.tv_usec=0;
+  return (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+          setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)));
+}
+
+static int gsd_connect(void) {
+  /* connects to cups-pdf-gsd, whose socket is only open to root and the
+     CUPS group, so this is done before dropping privileges; -1 if the
+     job is to be converted with GSCall */
+  struct sockaddr_un addr;
+  int fd;
+
+  if (!strlen(Conf_GSDaemon))
+    return -1;
+  if (strlen(Conf_GSDaemon) >= sizeof(addr.sun_path)) {
+    log_event(CPERROR, "GhostScript daemon socket name too long: %s", Conf_GSDaemon);
+    return -1;
+  }
+  fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path, Conf_GSDaemon);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) || gsd_timeouts(fd, GSD_TIMEOUT)) {
+    log_event(CPDEBUG, "GhostScript daemon not available: %s", Conf_GSDaemon);
+    (void) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int convert_with_daemon(int fd, char *outfile, char *infile) {
+  /* hands the conversion to cups-pdf-gsd over fd from gsd_connect(), sent
+     with our credentials once privileges are dropped; returns -1 if the
+     daemon did not take the job within GSD_TIMEOUT seconds, once it has
+     the job (and any data from standard input) belongs to the daemon */
+  struct gsd_request request;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  int result;
+
+  if (fd < 0)
+    return -1;
+  if (strlen(Conf_PDFVer) >= sizeof(request.pdfver) || strlen(outfile) >= BUFSIZE ||
+      (infile != NULL && strlen(infile) >= BUFSIZE)) {
+    log_event(CPDEBUG, "job does not fit a GhostScript daemon request, converting directly");
+    (void) close(fd);
+    return -1;
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.version=GSD_VERSION;
+  strcpy(request.pdfver, Conf_PDFVer);
+  strcpy(request.outfile, outfile);
+  strcpy(request.infile, (infile == NULL)?"-":infile);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base=&request;
+  iov.iov_len=sizeof(request);
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  if (infile == NULL) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control=control;
+    msg.msg_controllen=sizeof(control);
+    cmsg=CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level=SOL_SOCKET;
+    cmsg->cmsg_type=SCM_RIGHTS;
+    cmsg->cmsg_len=CMSG_LEN(sizeof(int));
+    *(int *) CMSG_DATA(cmsg)=STDIN_FILENO;
+  }
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof(request)) {
+    log_event(CPERROR, "failed to send job to GhostScript daemon: %s", Conf_GSDaemon);
+    (void) close(fd);
+    return -1;
+  }
+  /* the daemon only starts converting after our confirmation, so giving
+     up before it leaves the job to us alone */
+  if (recv(fd, &result, sizeof(result), MSG_WAITALL) != (ssize_t) sizeof(result) || result ||
+      send(fd, &result, sizeof(result), MSG_NOSIGNAL) != (ssize_t) sizeof(result)) {
+    log_event(CPERROR, "GhostScript daemon did not take the job in time, converting directly: %s",
+              Conf_GSDaemon);
+    (void) close(fd);
+    return -1;
+  }
+  /* the conversion itself may take as long as with GSCall */
+  (void) gsd_timeouts(fd, 0);
+  if (recv(fd, &result, sizeof(result), MSG_WAITALL) != (ssize_t) sizeof(result)) {
+    log_event(CPERROR, "lost connection to GhostScript daemon: %s", Conf_GSDaemon);
+    (void) close(fd);
+    return 1;
+  }
+  (void) close(fd);
+  log_event(CPDEBUG, "GhostScript daemon has finished: %d", result);
+  return (result != 0);
+}
+
+/* admission control: at most MaxConverters conversions run at a time on
+   the whole machine, each one holding the lock of a file slot.<n> in
+   ConverterLocks. Jobs waiting for a slot are announced by a locked file
+   wait.<pid> with their spool size divided by ConverterWeight; the free
+   slots go to the smallest of them, and the size of a waiting job halves
+   every ADMIT_AGING seconds so that large jobs are not starved */
+
+static long long admit_key(long long size, time_t since, time_t now) {
+  long aged=(now > since)?(now-since)/ADMIT_AGING:0;
+
+  return (aged > 62)?0:size >> aged;
+}
+
+static int admit_rank(long long size, time_t since) {
+  /* counts the waiting jobs that go before this one */
+  DIR *dir;
+  struct dirent *entry;
+  cp_string path;
+  FILE *fp;
+  long long osize;
+  long osince;
+  time_t now=time(NULL);
+  int fd, pid, rank=0;
+
+  if ((dir=opendir(Conf_ConverterLocks)) == NULL)
+    return 0;
+  while ((entry=readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "wait.", 5) || (pid=atoi(entry->d_name+5)) == getpid())
+      continue;
+    if (build_path(path, "%s/%s", Conf_ConverterLocks, entry->d_name) ||
+        (fd=open(path, O_RDONLY|O_CLOEXEC)) < 0)
+      continue;
+    if (!flock(fd, LOCK_SH|LOCK_NB)) {
+      log_event(CPDEBUG, "removing stale converter wait entry: %s", path);
+      (void) unlink(path);
+      (void) close(fd);
+      continue;
+    }
+    if ((fp=fdopen(fd, "r")) == NULL) {
+      (void) close(fd);
+      continue;
+    }
+    if (fscanf(fp, "%lld %ld", &osize, &osince) == 2) {
+      if (admit_key(osize, osince, now) < admit_key(size, since, now) ||
+          (admit_key(osize, osince, now) == admit_key(size, since, now) &&
+           (osince < since || (osince == since && pid < getpid()))))
+        rank++;
+    }
+    (void) fclose(fp);
+  }
+  (void) closedir(dir);
+  return rank;
+}
+
+static int admit_announce(long long size, time_t since) {
+  /* creates the locked wait entry of this job */
+  cp_string path, tmp;
+  char line[64];
+  int fd;
+
+  if (build_path(tmp, "%s/.wait.%d", Conf_ConverterLocks, (int) getpid()) ||
+      build_path(path, "%s/wait.%d", Conf_ConverterLocks, (int) getpid()))
+    return -1;
+  fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+  snprintf(line, sizeof(line), "%lld %ld\n", size, (long) since);
+  if (flock(fd, LOCK_EX) || write_all(fd, line, strlen(line)) || rename(tmp, path)) {
+    (void) unlink(tmp);
+    (void) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int converter_admit(off_t size) {
+  /* waits for a free converter slot and returns its locked file, or -1
+     if the number of conversions is not limited */
+  cp_string path;
+  time_t since=time(NULL);
+  long long key=(long long) size/Conf_ConverterWeight;
+  int fds[ADMIT_SLOTS], waitfd=-1, slot, nfree, rank, i;
+
+  if (!Conf_MaxConverters)
+    return -1;
+  for (i=0; i<Conf_MaxConverters; i++) {
+    fds[i]=(build_path(path, "%s/slot.%d", Conf_ConverterLocks, i))?-1:open(path, O_RDONLY|O_CREAT|O_CLOEXEC, 0600);
+    if (fds[i] < 0) {
+      log_event(CPERROR, "failed to open converter slot: %s (non fatal)", path);
+      while (i--)
+        (void) close(fds[i]);
+      return -1;
+    }
+  }
+
+  for (;;) {
+    rank=admit_rank(key, since);
+    slot=-1;
+    nfree=0;
+    for (i=0; i<Conf_MaxConverters; i++)
+      if (!flock(fds[i], LOCK_EX|LOCK_NB)) {
+        nfree++;
+        if (slot < 0)
+          slot=i;
+        else
+          (void) flock(fds[i], LOCK_UN);
+      }
+    if (slot >= 0 && rank < nfree)
+      break;
+    if (slot >= 0)
+      (void) flock(fds[slot], LOCK_UN);
+    if (waitfd < 0) {
+      waitfd=admit_announce(key, since);
+      log_event(CPSTATUS, "waiting for a converter slot (%d jobs ahead)", rank);
+    }
+    (void) usleep(ADMIT_POLL);
+  }
+
+  if (waitfd >= 0) {
+    if (!build_path(path, "%s/wait.%d", Conf_ConverterLocks, (int) getpid()))
+      (void) unlink(path);
+    (void) close(waitfd);
+    log_event(CPSTATUS, "converter slot %d taken after %ld s", slot, (long) (time(NULL)-since));
+  }
+  else
+    log_event(CPDEBUG, "converter slot taken: %d", slot);
+  for (i=0; i<Conf_MaxConverters; i++)
+    if (i != slot)
+      (void) close(fds[i]);
+  return fds[slot];
+}
+
+static int converter_extra(int *fds, int want) {
+  /* takes up to want further converter slots for the page ranges of a
+     parallel conversion without waiting, leaving a free slot to each job
+     that waits; returns the number of slots taken */
+  cp_string path;
+  int waiting, taken=0, fd, i;
+
+  waiting=admit_rank(LLONG_MAX, time(NULL));
+  for (i=0; i<Conf_MaxConverters && taken<want; i++) {
+    if (build_path(path, "%s/slot.%d", Conf_ConverterLocks, i) || (fd=open(path, O_RDONLY|O_CLOEXEC)) < 0)
+      continue;
+    if (flock(fd, LOCK_EX|LOCK_NB) || waiting-- > 0) {
+      (void) close(fd);
+      continue;
+    }
+    fds[taken++]=fd;
+  }
+  log_event(CPDEBUG, "converter slots taken for page ranges: %d of %d", taken, want);
+  return taken;
+}
+
+static void converter_limits() {
+  /* applies ConverterNice and ConverterCPUs to the converting process */
+  cpu_set_t cpus;
+  char *p, *end;
+  long first, last;
+
+  if (Conf_ConverterNice && setpriority(PRIO_PROCESS, 0, Conf_ConverterNice))
+    log_event(CPERROR, "failed to set nice level for conversion: %d (non fatal)", Conf_ConverterNice);
+  if (!strlen(Conf_ConverterCPUs))
+    return;
+  CPU_ZERO(&cpus);
+  for (p=Conf_ConverterCPUs; ; p=end+1) {
+    first=strtol(p, &end, 10);
+    last=first;
+    if (end == p)
+      break;
+    if (*end == '-') {
+      p=end+1;
+      last=strtol(p, &end, 10);
+      if (end == p)
+        break;
+    }
+    for (; first>=0 && first<=last && first<CPU_SETSIZE; first++)
+      CPU_SET(first, &cpus);
+    if (*end != ',')
+      break;
+  }
+  if (*end || !CPU_COUNT(&cpus) || sched_setaffinity(0, sizeof(cpus), &cpus))
+    log_event(CPERROR, "failed to restrict conversion to CPUs: %s (non fatal)", Conf_ConverterCPUs);
+  else
+    log_event(CPDEBUG, "conversion restricted to CPUs: %s", Conf_ConverterCPUs);
+  return;
+}
+
+static void cache_count(int hit) {
+  /* updates and logs the hit/miss counters kept in the cache directory */
+  cp_string buffer;
+  unsigned long hits=0, misses=0;
+  ssize_t count;
+  int fd;
+
+  if (build_path(buffer, "%s/stats", Conf_ConversionCache))
+    return;
+  fd=open(buffer, O_RDWR|O_CREAT|O_NOFOLLOW, 0600);
+  if (fd >= 0 && !flock(fd, LOCK_EX)) {
+    count=pread(fd, buffer, BUFSIZE-1, 0);
+    buffer[(count > 0)?count:0]='\0';
+    (void) sscanf(buffer, "%lu %lu", &hits, &misses);
+    if (hit)
+      hits++;
+    else
+      misses++;
+    snprintf(buffer, BUFSIZE, "%lu %lu\n", hits, misses);
+    if (ftruncate(fd, 0) || pwrite(fd, buffer, strlen(buffer), 0) < 0)
+      log_event(CPDEBUG, "failed to update conversion cache statistics (non fatal)");
+  }
+  if (fd >= 0)
+    (void) close(fd);
+  log_event(CPSTATUS, "conversion cache %s: %s (hits: %lu, misses: %lu)",
+            (hit)?"hit":"miss", cache_key, hits, misses);
+  return;
+}
+
+static int cache_lookup(int *fillfd, uid_t uid, const char *gsformat, int path) {
+  /* returns a descriptor of the cached output for the current job, or -1
+     with *fillfd set to a new cache entry for the converter to fill in.
+     the entry is filled from the output of the job owner's converter, so
+     the key holds the owner and entries are never shared between users;
+     it also holds everything else that reaches the converter and the path
+     it is converted on, the daemon ignoring GSCall */
+  sha256_ctx ctx;
+  struct stat fstatus;
+  char options[64];
+  int fd;
+
+  *fillfd=-1;
+  if (!strlen(Conf_ConversionCache) || !strlen(cache_key))
+    return -1;
+  sha256_init(&ctx);
+  sha256_update(&ctx, cache_key, strlen(cache_key)+1);
+  snprintf(options, sizeof(options), "%ld %d %d %d", (long) uid, Conf_ParallelWorkers,
+           Conf_ParallelMinPages, spool_compressed);
+  sha256_update(&ctx, options, strlen(options)+1);
+  sha256_update(&ctx, Conf_GhostScript, strlen(Conf_GhostScript)+1);
+  sha256_update(&ctx, gsformat, strlen(gsformat)+1);
+  sha256_update(&ctx, Conf_PDFVer, strlen(Conf_PDFVer)+1);
+  sha256_update(&ctx, Conf_GSDaemon, strlen(Conf_GSDaemon)+1);
+  sha256_update(&ctx, convert_path_names[path], strlen(convert_path_names[path])+1);
+  sha256_final(&ctx, cache_key);
+  log_event(CPDEBUG, "conversion cache key: %s", cache_key);
+  if (stat(Conf_ConversionCache, &fstatus) || !S_ISDIR(fstatus.st_mode)) {
+    if (create_dir(Conf_ConversionCache, 0) || chmod(Conf_ConversionCache, 0700)) {
+      log_event(CPERROR, "failed to create conversion cache: %s (non fatal)", Conf_ConversionCache);
+      return -1;
+    }
+    log_event(CPSTATUS, "conversion cache created: %s", Conf_ConversionCache);
+  }
+  if (build_path(cache_entry, "%s/%s.pdf", Conf_ConversionCache, cache_key) ||
+      build_path(cache_tmp, "%s/%s.%d.tmp", Conf_ConversionCache, cache_key, (int) getpid())) {
+    log_event(CPERROR, "conversion cache path too long: %s (non fatal)", Conf_ConversionCache);
+    return -1;
+  }
+  fd=open(cache_entry, O_RDONLY|O_NOFOLLOW);
+  if (fd >= 0) {
+    if (utime(cache_entry, NULL))
+      log_event(CPDEBUG, "failed to update access time of cache entry: %s", cache_entry);
+    cache_count(1);
+    return fd;
+  }
+  cache_count(0);
+  *fillfd=open(cache_tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+  if (*fillfd < 0)
+    log_event(CPERROR, "failed to create cache entry: %s (non fatal)", cache_tmp);
+  return -1;
+}
+
+static int cache_copy(int fd, char *outfile, int to_output) {
+  /* copies between a cache descriptor and outfile in the given direction */
+  struct stat fstatus;
+  int fdfile, result;
+
+  if (to_output)
+    fdfile=open(outfile, O_WRONLY|O_CREAT|O_EXCL, 0600);
+  else
+    fdfile=open(outfile, O_RDONLY|O_NOFOLLOW);
+  if (fdfile < 0)
+    return 1;
+  if (to_output)
+    result=(fstat(fd, &fstatus) || copy_file_data(fd, 0, fstatus.st_size, fdfile));
+  else
+    result=(fstat(fdfile, &fstatus) || !S_ISREG(fstatus.st_mode) ||
+            copy_file_data(fdfile, 0, fstatus.st_size, fd));
+  if (close(fdfile))
+    result=1;
+  return result;
+}
+
+struct cache_file {
+  time_t mtime;
+  off_t size;
+  char name[256];
+};
+
+static int cache_file_older(const void *a, const void *b) {
+  time_t ta=((const struct cache_file *)a)->mtime, tb=((const struct cache_file *)b)->mtime;
+
+  return (ta > tb)-(ta < tb);
+}
+
+static void cache_evict() {
+  /* removes least recently used entries until the size limit is met */
+  DIR *dir;
+  struct dirent *entry;
+  struct stat fstatus;
+  struct cache_file *files=NULL, *tmp;
+  cp_string path;
+  off_t total=0, limit=(off_t)Conf_ConversionCacheSize*1024*1024;
+  int nfiles=0, i, len;
+
+  if ((dir=opendir(Conf_ConversionCache)) == NULL)
+    return;
+  while ((entry=readdir(dir)) != NULL) {
+    len=strlen(entry->d_name);
+    if (len < 5 || len >= 256 || strcmp(entry->d_name+len-4, ".pdf"))
+      continue;
+    if (build_path(path, "%s/%s", Conf_ConversionCache, entry->d_name) ||
+        lstat(path, &fstatus) || !S_ISREG(fstatus.st_mode))
+      continue;
+    if ((tmp=realloc(files, (nfiles+1)*sizeof(struct cache_file))) == NULL)
+      break;
+    files=tmp;
+    files[nfiles].mtime=fstatus.st_mtime;
+    files[nfiles].size=fstatus.st_size;
+    strcpy(files[nfiles].name, entry->d_name);
+    total+=fstatus.st_size;
+    nfiles++;
+  }
+  closedir(dir);
+
+  if (total > limit) {
+    qsort(files, nfiles, sizeof(struct cache_file), cache_file_older);
+    for (i=0; i<nfiles && total>limit; i++) {
+      if (!build_path(path, "%s/%s", Conf_ConversionCache, files[i].name) && !unlink(path)) {
+        total-=files[i].size;
+        log_event(CPDEBUG, "cache entry evicted: %s", path);
+      }
+    }
+  }
+  free(files);
+  return;
+}
+
+static void cache_store(int fillfd, int success) {
+  /* commits the cache entry filled in by the child, or discards it */
+  struct stat fstatus;
+
+  if (fillfd < 0)
+    return;
+  if (fstat(fillfd, &fstatus) || !fstatus.st_size)
+    success=0;
+  if (close(fillfd))
+    success=0;
+  if (success && !rename(cache_tmp, cache_entry)) {
+    log_event(CPDEBUG, "cache entry stored: %s", cache_entry);
+    cache_evict();
+    return;
+  }
+  if (unlink(cache_tmp))
+    log_event(CPERROR, "failed to remove cache entry: %s (non fatal)", cache_tmp);
+  return;
+}
+
+static int postprocess_enqueue(char *outfile, char *user, char *original) {
+  /* stores the postprocessing of a finished job in PostProcessingQueue;
+     an entry holds command, PDF, user and original user separated by NUL
+     and only gets its .job name once it is safely on disk */
+  cp_string tmpname, name;
+  char *fields[4];
+  int fd, dirfd, i, failed=0;
+
+  fields[0]=Conf_PostProcessing;
+  fields[1]=outfile;
+  fields[2]=user;
+  fields[3]=original;
+  if (build_path(name, "%s/%010ld-%d.job", Conf_PostProcessingQueue, (long) time(NULL), (int) getpid()) ||
+      build_path(tmpname, "%s.tmp", name)) {
+    log_event(CPERROR, "postprocessing queue name too long: %s", Conf_PostProcessingQueue);
+    return 1;
+  }
+  fd=open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd < 0) {
+    log_event(CPERROR, "failed to create postprocessing queue entry: %s", tmpname);
+    return 1;
+  }
+  for (i=0; i<4 && !failed; i++)
+    failed=(write(fd, fields[i], strlen(fields[i])+1) != (ssize_t) strlen(fields[i])+1);
+  if (fsync(fd))
+    failed=1;
+  if (close(fd) || failed || rename(tmpname, name)) {
+    log_event(CPERROR, "failed to write postprocessing queue entry: %s", name);
+    (void) unlink(tmpname);
+    return 1;
+  }
+  if ((dirfd=open(Conf_PostProcessingQueue, O_RDONLY|O_DIRECTORY)) >= 0) {
+    (void) fsync(dirfd);
+    (void) close(dirfd);
+  }
+  log_event(CPDEBUG, "postprocessing queued: %s", name);
+  return 0;
+}
+
+static int postprocess_filter(const struct dirent *entry) {
+  int len=strlen(entry->d_name);
+
+  return (len > 4 && len < 64 && !strcmp(entry->d_name+len-4, ".job"));
+}
+
+static pid_t postprocess_start(char *name) {
+  /* starts the queue entry name through the shell with the privileges of
+     the user it was queued for, in a process group of its own */
+  struct passwd *passwd;
+  cp_string path;
+  char data[4*BUFSIZE+4], *fields[4], *ppcall;
+  ssize_t len;
+  size_t size;
+  pid_t pid;
+  int fd, i;
+
+  fd=(build_path(path, "%s/%s", Conf_PostProcessingQueue, name))?-1:open(path, O_RDONLY|O_NOFOLLOW);
+  len=(fd < 0)?-1:read(fd, data, sizeof(data)-1);
+  if (fd >= 0)
+    (void) close(fd);
+  if (len <= 0)
+    return -1;
+  data[len]='\0';
+  fields[0]=data;
+  for (i=1; i<4; i++) {
+    fields[i]=fields[i-1]+strlen(fields[i-1])+1;
+    if (fields[i] >= data+len)
+      return -1;
+  }
+  passwd=getpwnam(fields[2]);
+  if (passwd == NULL)
+    return -1;
+  size=strlen(fields[0])+strlen(fields[1])+strlen(fields[2])+strlen(fields[3])+4;
+  ppcall=calloc(size, sizeof(char));
+  if (ppcall == NULL)
+    return -1;
+  snprintf(ppcall, size, "%s %s %s %s", fields[0], fields[1], fields[2], fields[3]);
+  log_event(CPDEBUG, "postprocessing commandline built: %s", ppcall);
+  log_flush();
+
+  pid=fork();
+  if (!pid) {
+    (void) setpgid(0, 0);
+    if (setgid(passwd->pw_gid) || initgroups(passwd->pw_name, passwd->pw_gid) ||
+        setuid(passwd->pw_uid)) {
+      log_event(CPERROR, "failed to set privileges for postprocessing: %s", passwd->pw_name);
+      log_flush();
+      _exit(126);
+    }
+    (void) umask(0077);
+    (void) execl("/bin/sh", "sh", "-c", ppcall, (char *) NULL);
+    _exit(127);
+  }
+  free(ppcall);
+  return pid;
+}
+
+static void postprocess_wakeup(int sig) {
+  (void) sig;
+  return;
+}
+
+static int postprocess_pending() {
+  struct dirent **entries;
+  int nentries, i;
+
+  nentries=scandir(Conf_PostProcessingQueue, &entries, postprocess_filter, alphasort);
+  for (i=0; i<nentries; i++)
+    free(entries[i]);
+  if (nentries >= 0)
+    free(entries);
+  return nentries;
+}
+
+static void postprocess_run() {
+  /* works off the queue with at most PostProcessingWorkers scripts at a
+     time; scripts running longer than PostProcessingTimeout seconds are
+     killed. An entry is only removed once its script has ended, so that
+     entries of a drainer that died are run again by the next one */
+  struct dirent **entries;
+  struct rusage usage;
+  cp_string path;
+  char names[64][64];
+  time_t started[64], now;
+  pid_t pids[64], pid;
+  int running=0, nentries, status, i, j, k;
+
+  for (i=0; i<64; i++)
+    pids[i]=0;
+  for (;;) {
+    while ((pid=wait4(-1, &status, WNOHANG, &usage)) > 0)
+      for (i=0; i<64; i++)
+        if (pids[i] == pid) {
+          log_event(CPDEBUG, "postprocessing has finished: %s", names[i]);
+          log_usage(status, &usage, names[i]);
+          if (!build_path(path, "%s/%s", Conf_PostProcessingQueue, names[i]))
+            (void) unlink(path);
+          pids[i]=0;
+          running--;
+        }
+
+    now=time(NULL);
+    for (i=0; i<64; i++)
+      if (pids[i] > 0 && Conf_PostProcessingTimeout > 0 &&
+          now-started[i] >= Conf_PostProcessingTimeout) {
+        log_event(CPERROR, "postprocessing timed out: %s", names[i]);
+        (void) kill(-pids[i], SIGKILL);
+        started[i]=now;
+      }
+
+    nentries=scandir(Conf_PostProcessingQueue, &entries, postprocess_filter, alphasort);
+    for (j=0; j<nentries; j++) {
+      for (i=0; i<64; i++)
+        if (pids[i] > 0 && !strcmp(names[i], entries[j]->d_name))
+          break;
+      if (i == 64 && running < Conf_PostProcessingWorkers) {
+        for (k=0; pids[k] > 0; k++);
+        strcpy(names[k], entries[j]->d_name);
+        pids[k]=postprocess_start(names[k]);
+        if (pids[k] > 0) {
+          started[k]=now;
+          running++;
+        }
+        else {
+          log_event(CPERROR, "failed to start postprocessing, entry dropped: %s", names[k]);
+          if (!build_path(path, "%s/%s", Conf_PostProcessingQueue, names[k]))
+            (void) unlink(path);
+          pids[k]=0;
+        }
+      }
+      free(entries[j]);
+    }
+    if (nentries >= 0)
+      free(entries);
+    log_flush();
+    if (!running)
+      return;
+    (void) sleep(1);
   }
-  else {
-    log_event(CPDEBUG, "trying to use PS title: %s", title);
-    if (!preparetitle(title)) {
-      log_event(CPDEBUG, "empty PS title, using commandline title: %s", buffer);
-      if (!preparetitle(buffer))
-        log_event(CPDEBUG, "empty commandline title");
-      else
-        snprintf(title, BUFSIZE, "%s", buffer);
-    }
+}
+
+static void postprocess_drain() {
+  /* hands the queue to a detached drainer; only one drainer works at a
+     time, a drainer that finds the queue locked leaves it to the owner,
+     which looks for new entries once more after releasing the lock */
+  struct sigaction action;
+  cp_string path;
+  pid_t pid;
+  int fd, status;
+
+  log_flush();
+  pid=fork();
+  if (pid < 0) {
+    log_event(CPERROR, "failed to start postprocessing queue drainer");
+    return;
+  }
+  if (pid) {
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    return;
   }
 
-  if (!strcmp(title, "")) {
-    if (Conf_Label == 2)
-      snprintf(title, BUFSIZE, "untitled_document-job_%i", job);
-    else
-      snprintf(title, BUFSIZE, "job_%i-untitled_document", job);
-    log_event(CPDEBUG, "no title found - using default value: %s", title);
+  (void) setsid();
+  if (fork())
+    _exit(0);
+  fd=open("/dev/null", O_RDWR);
+  if (fd >= 0) {
+    (void) dup2(fd, STDIN_FILENO);
+    (void) dup2(fd, STDOUT_FILENO);
+    (void) dup2(fd, STDERR_FILENO);
   }
-  else {
-    if (Conf_Label) {
-      strcpy(buffer, title);
-      if (Conf_Label == 2)
-        snprintf(title, BUFSIZE, "%s-job_%i", buffer, job);
-      else
-        snprintf(title, BUFSIZE, "job_%i-%s", job, buffer);
+  for (fd=3; fd<1024; fd++)
+    if (logfp == NULL || fd != fileno(logfp))
+      (void) close(fd);
+  memset(&action, 0, sizeof(action));
+  action.sa_handler=postprocess_wakeup;
+  (void) sigaction(SIGCHLD, &action, NULL);
+  (void) signal(SIGTERM, SIG_DFL);
+  (void) signal(SIGINT, SIG_DFL);
+  (void) signal(SIGPIPE, SIG_DFL);
+
+  fd=(build_path(path, "%s/.lock", Conf_PostProcessingQueue))?-1:open(path, O_RDWR|O_CREAT, 0600);
+  while (fd >= 0 && !flock(fd, LOCK_EX|LOCK_NB)) {
+    log_event(CPDEBUG, "postprocessing queue drainer started: %d", (int) getpid());
+    postprocess_run();
+    (void) flock(fd, LOCK_UN);
+    if (postprocess_pending() <= 0)
+      break;
+  }
+  log_flush();
+  _exit(0);
+}
+
+static int capture_strings(char *filename, char *strings[], int count) {
+  /* one NUL terminated string after the other */
+  FILE *fp;
+  int i;
+
+  fp=fopen(filename, "w");
+  if (fp == NULL)
+    return 1;
+  for (i=0; i<count; i++)
+    if (strings[i] != NULL && (fputs(strings[i], fp) == EOF || fputc('\0', fp) == EOF))
+      break;
+  return (fclose(fp) || i < count);
+}
+
+static int capture_job(int argc, char *argv[]) {
+  /* keeps what is needed to replay the job with cups-pdf-bench -R; data
+     from stdin is consumed here and handed on from the captured copy, so
+     only losing it on the way fails the job */
+  char *environment[16];
+  cp_string dirname, filename, buffer;
+  struct timespec now;
+  struct stat fstatus;
+  ssize_t count;
+  FILE *fp;
+  int fd, infd, failed=0, lost=0, i, j, n=0;
+
+  if (!strlen(Conf_Capture) || atoi(argv[1])%100 >= Conf_CaptureRate)
+    return 0;
+  (void) clock_gettime(CLOCK_REALTIME, &now);
+  if (build_path(dirname, "%s/%ld.%06ld-%d-%d", Conf_Capture, (long) now.tv_sec,
+                 now.tv_nsec/1000, atoi(argv[1]), (int) getpid()) || mkdir(dirname, 0700)) {
+    log_event(CPERROR, "failed to create capture: %s", dirname);
+    return 0;
+  }
+
+  failed|=(build_path(filename, "%s/%s", dirname, CAPTURE_ARGV) || capture_strings(filename, argv, argc));
+  for (i=0; environ[i] != NULL && n < 16; i++)
+    for (j=0; capture_variables[j] != NULL; j++)
+      if (!strncmp(environ[i], capture_variables[j], strlen(capture_variables[j])) &&
+          environ[i][strlen(capture_variables[j])] == '=')
+        environment[n++]=environ[i];
+  failed|=(build_path(filename, "%s/%s", dirname, CAPTURE_ENVIRON) || capture_strings(filename, environment, n));
+  fp=(build_path(filename, "%s/%s", dirname, CAPTURE_CONFIG))?NULL:fopen(filename, "w");
+  if (fp != NULL) {
+    dump_configuration(fp);
+    failed|=(fclose(fp) != 0);
+  }
+  else
+    failed=1;
+
+  fd=(build_path(filename, "%s/%s", dirname, CAPTURE_INPUT))?-1:open(filename, O_RDWR|O_CREAT|O_EXCL, 0600);
+  if (argc == 6) {
+    if (fd < 0) {
+      log_event(CPERROR, "failed to capture job data: %s", filename);
+      return 0;
+    }
+    while ((count=read(STDIN_FILENO, buffer, BUFSIZE)) > 0)
+      if (!lost && write_all(fd, buffer, count))
+        lost=1;
+    if (count < 0 || lost || lseek(fd, 0, SEEK_SET) || dup2(fd, STDIN_FILENO) < 0) {
+      log_event(CPERROR, "failed to capture job data: %s", filename);
+      (void) close(fd);
+      return 1;
     }
-    log_event(CPDEBUG, "title successfully retrieved: %s", title);
   }
+  else {
+    infd=open(argv[6], O_RDONLY);
+    if (fd < 0 || infd < 0 || fstat(infd, &fstatus) || copy_file_data(infd, 0, fstatus.st_size, fd))
+      failed=1;
+    if (infd >= 0)
+      (void) close(infd);
+  }
+  if (fd >= 0)
+    (void) close(fd);
+  if (failed)
+    log_event(CPERROR, "failed to capture job completely: %s", dirname);
+  else
+    log_event(CPDEBUG, "job captured: %s", dirname);
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  char *user, *dirname, *spoolfile, *outfile, *gscall, *ppcall;
-  cp_string title;
+static int backend(int argc, char *argv[]) {
+  char *user, *dirname, *spoolfile, *outfile, *gscall=NULL, *ppcall;
+  char **gsargv=NULL, *gsvalues[4], *gsformat=Conf_GSCall, *cache="off";
+  cp_string title, gstemplate;
+  FILE *fpsrc;
+  int pipefd[2];
+  int cachefd=-1, fillfd=-1, slotfd=-1, gsdfd=-1, status=0, path=P_GSCALL, converted;
+  int rangefds[ADMIT_SLOTS], nrangefds=0, ranges=0;
   int size;
   mode_t mode;
   struct passwd *passwd;
+  struct rusage usage;
+  struct stat fstatus;
   gid_t *groups;
-  int ngroups;
+  int ngroups, anonymous;
   pid_t pid;
 
-  if (setuid(0)) {
-    (void) fputs("CUPS-PDF cannot be called without root privileges!\n", stderr);
-    return 0;
-  }
-
-  if (argc==1) {
-    announce_printers();
-    return 0;
-  }
-  if (argc<6 || argc>7) {
-    (void) fputs("Usage: cups-pdf job-id user title copies options [file]\n", stderr);
-    return 0;
-  }
-
+  trace_init();
   if (init(argv))
     return 5;
   log_event(CPDEBUG, "initialization finished: %s", CPVERSION);
+  if (capture_job(argc, argv)) {
+    log_close();
+    return 5;
+  }
 
+  trace_begin(T_NSS);
   size=strlen(Conf_UserPrefix)+strlen(argv[2])+1;
   user=calloc(size, sizeof(char));
   if (user == NULL) {
@@ -863,7 +5756,7 @@ int main(int argc, char *argv[]) {
     return 5;
   }
   snprintf(user, size, "%s%s", Conf_UserPrefix, argv[2]);
-  passwd=getpwnam(user);
+  passwd=cached_getpwnam(user);
   if (passwd == NULL && Conf_LowerCase) {
     log_event(CPDEBUG, "unknown user: %s", user);
     for (size=0;size<(int) strlen(argv[2]);size++)
@@ -871,138 +5764,130 @@ int main(int argc, char *argv[]) {
     log_event(CPDEBUG, "trying lower case user name: %s", argv[2]);
     size=strlen(Conf_UserPrefix)+strlen(argv[2])+1;
     snprintf(user, size, "%s%s", Conf_UserPrefix, argv[2]);
-    passwd=getpwnam(user);
-  }
-  if (passwd == NULL) {
-    if (strlen(Conf_AnonUser)) {
-      passwd=getpwnam(Conf_AnonUser);
-      if (passwd == NULL) {
-        log_event(CPERROR, "username for anonymous access unknown: %s", Conf_AnonUser);
-        free(user);
-        if (logfp!=NULL)
-          (void) fclose(logfp);
-        return 5;
-      }
-      log_event(CPDEBUG, "unknown user: %s", user);
-      size=strlen(Conf_AnonDirName)+4;
-      dirname=calloc(size, sizeof(char));
-      if (dirname == NULL) {
-        (void) fputs("CUPS-PDF: failed to allocate memory\n", stderr);
-        free(user);
-        if (logfp!=NULL)
-          (void) fclose(logfp);
-        return 5;
-      }
-      snprintf(dirname, size, "%s", Conf_AnonDirName);
-      while (strlen(dirname) && ((dirname[strlen(dirname)-1] == '\n') ||
-             (dirname[strlen(dirname)-1] == '\r')))
-        dirname[strlen(dirname)-1]='\0';
-      log_event(CPDEBUG, "output directory name generated: %s", dirname);
-    }
-    else {
+    passwd=cached_getpwnam(user);
+  }
+  anonymous=(passwd == NULL);
+  if (anonymous) {
+    if (!strlen(Conf_AnonUser)) {
       log_event(CPSTATUS, "anonymous access denied: %s", user);
       free(user);
-      if (logfp!=NULL)
-        (void) fclose(logfp);
+      log_close();
       return 0;
     }
-    mode=(mode_t)(0666&~Conf_AnonUMask);
-  }
-  else {
-    log_event(CPDEBUG, "user identified: %s", passwd->pw_name);
-    if ((dirname=preparedirname(passwd, argv[2])) == NULL) {
-      (void) fputs("CUPS-PDF: failed to allocate memory\n", stderr);
+    passwd=cached_getpwnam(Conf_AnonUser);
+    if (passwd == NULL) {
+      log_event(CPERROR, "username for anonymous access unknown: %s", Conf_AnonUser);
       free(user);
-      if (logfp!=NULL)
-        (void) fclose(logfp);
+      log_close();
       return 5;
     }
-    while (strlen(dirname) && ((dirname[strlen(dirname)-1] == '\n') ||
-           (dirname[strlen(dirname)-1] == '\r')))
-      dirname[strlen(dirname)-1]='\0';
-    log_event(CPDEBUG, "output directory name generated: %s", dirname);
-    mode=(mode_t)(0666&~Conf_UserUMask);
+    log_event(CPDEBUG, "unknown user: %s", user);
   }
+  else
+    log_event(CPDEBUG, "user identified: %s", passwd->pw_name);
   ngroups=32;
   groups=calloc(ngroups, sizeof(gid_t));
   if (groups == NULL) {
     (void) fputs("CUPS-PDF: failed to allocate memory\n", stderr);
     free(user);
-    if (logfp!=NULL)
-      (void) fclose(logfp);
+    log_close();
     return 5;
   }
-  size=getgrouplist(user, passwd->pw_gid, groups, &ngroups);
-  if (size == -1) {
-    free(groups);
-    groups=calloc(ngroups, sizeof(gid_t));
-    size=getgrouplist(user, passwd->pw_gid, groups, &ngroups);
-  }
+  size=cached_getgrouplist(user, passwd->pw_gid, &groups, &ngroups);
+  free(user);
   if (size < 0) {
     log_event(CPERROR, "getgrouplist failed");
-    free(user);
     free(groups);
-    if (logfp!=NULL)
-      (void) fclose(logfp);
+    log_close();
     return 5;
   }
-  free(user);
+  trace_end(T_NSS);
+
+  trace_begin(T_USERDIR);
+  if (anonymous) {
+    size=strlen(Conf_AnonDirName)+4;
+    dirname=calloc(size, sizeof(char));
+    if (dirname != NULL)
+      snprintf(dirname, size, "%s", Conf_AnonDirName);
+    mode=(mode_t)(0666&~Conf_AnonUMask);
+  }
+  else {
+    dirname=preparedirname(passwd, argv[2]);
+    mode=(mode_t)(0666&~Conf_UserUMask);
+  }
+  if (dirname == NULL) {
+    (void) fputs("CUPS-PDF: failed to allocate memory\n", stderr);
+    free(groups);
+    log_close();
+    return 5;
+  }
+  while (strlen(dirname) && ((dirname[strlen(dirname)-1] == '\n') ||
+         (dirname[strlen(dirname)-1] == '\r')))
+    dirname[strlen(dirname)-1]='\0';
+  log_event(CPDEBUG, "output directory name generated: %s", dirname);
   if (prepareuser(passwd, dirname)) {
     free(groups);
     free(dirname);
-    if (logfp!=NULL)
-      (void) fclose(logfp);
+    log_close();
     return 5;
   }
+  trace_end(T_USERDIR);
   log_event(CPDEBUG, "user information prepared");
 
-  size=strlen(Conf_Spool)+22;
+  size=strlen(Conf_Spool)+32;   /* also holds /proc/self/fd/<n> */
   spoolfile=calloc(size, sizeof(char));
   if (spoolfile == NULL) {
     (void) fputs("CUPS-PDF: failed to allocate memory\n", stderr);
     free(groups);
     free(dirname);
-    if (logfp!=NULL)
-      (void) fclose(logfp);
+    log_close();
     return 5;
   }
   snprintf(spoolfile, size, "%s/cups2pdf-%i", Conf_Spool, (int) getpid());
   log_event(CPDEBUG, "spoolfile name created: %s", spoolfile);
 
+  title[0]='\0';
+  trace_begin(T_SPOOL);
   if (argc == 6) {
-    if (preparespoolfile(stdin, spoolfile, title, argv[3], atoi(argv[1]), passwd)) {
+    fpsrc=stdin;
+    if (preparespoolfile(fpsrc, spoolfile, title, argv[3], atoi(argv[1]), passwd)) {
       free(groups);
       free(dirname);
       free(spoolfile);
-      if (logfp!=NULL)
-        (void) fclose(logfp);
+      log_close();
       return 5;
     }
     log_event(CPDEBUG, "input data read from stdin");
   }
   else {
-    if (preparespoolfile(fopen(argv[6], "r"), spoolfile, title, argv[3], atoi(argv[1]), passwd)) {
+    fpsrc=fopen(argv[6], "r");
+    if (preparespoolfile(fpsrc, spoolfile, title, argv[3], atoi(argv[1]), passwd)) {
       free(groups);
       free(dirname);
       free(spoolfile);
-      if (logfp!=NULL)
-        (void) fclose(logfp);
+      log_close();
       return 5;
     }
     log_event(CPDEBUG, "input data read from file: %s", argv[6]);
   }
+  trace_end(T_SPOOL);
+  if (spool_memfd >= 0) {
+    snprintf(spoolfile, size, "/proc/self/fd/%d", spool_memfd);
+    log_event(CPDEBUG, "spool kept in memory: %s", spoolfile);
+  }
 
   size=strlen(dirname)+strlen(title)+strlen(Conf_OutExtension)+3;
   outfile=calloc(size, sizeof(char));
   if (outfile == NULL) {
     (void) fputs("CUPS-PDF: failed to allocate memory\n", stderr);
-    if (unlink(spoolfile))
+    if (input_is_pdf || input_is_streamed)
+      (void) fclose(fpsrc);
+    else if (remove_spoolfile(spoolfile))
       log_event(CPERROR, "failed to unlink spoolfile during clean-up: %s", spoolfile);
     free(groups);
     free(dirname);
     free(spoolfile);
-    if (logfp!=NULL)
-      (void) fclose(logfp);
+    log_close();
     return 5;
   }
   if (strlen(Conf_OutExtension))
@@ -1011,51 +5896,122 @@ int main(int argc, char *argv[]) {
     snprintf(outfile, size, "%s/%s", dirname, title);
   log_event(CPDEBUG, "output filename created: %s", outfile);
 
-  size=strlen(Conf_GSCall)+strlen(Conf_GhostScript)+strlen(Conf_PDFVer)+strlen(outfile)+strlen(spoolfile)+6;
-  gscall=calloc(size, sizeof(char));
-  if (gscall == NULL) {
-    (void) fputs("CUPS-PDF: failed to allocate memory\n", stderr);
-    if (unlink(spoolfile))
-      log_event(CPERROR, "failed to unlink spoolfile during clean-up: %s", spoolfile);
-    free(groups);
-    free(dirname);
-    free(spoolfile);
-    free(outfile);
-    if (logfp!=NULL)
-      (void) fclose(logfp);
-    return 5;
-  }
-  if (input_is_pdf) {
-    snprintf(gscall, size, "cp \"%s\" \"%s\"", spoolfile, outfile);
-  } else {
-    snprintf(gscall, size, Conf_GSCall, Conf_GhostScript, Conf_PDFVer, outfile, spoolfile);
+  if (!input_is_pdf) {
+    gsformat=gs_profile(gstemplate);
+    size=strlen(gsformat)+strlen(Conf_GhostScript)+strlen(Conf_PDFVer)+strlen(outfile)+strlen(spoolfile)+6;
+    gscall=calloc(size, sizeof(char));
+    if (gscall == NULL) {
+      (void) fputs("CUPS-PDF: failed to allocate memory\n", stderr);
+      if (input_is_streamed)
+        (void) fclose(fpsrc);
+      else if (remove_spoolfile(spoolfile))
+        log_event(CPERROR, "failed to unlink spoolfile during clean-up: %s", spoolfile);
+      free(groups);
+      free(dirname);
+      free(spoolfile);
+      free(outfile);
+      log_close();
+      return 5;
+    }
+    snprintf(gscall, size, gsformat, Conf_GhostScript, Conf_PDFVer, outfile,
+             (input_is_streamed || spool_compressed)?"-":spoolfile);
+    log_event(CPDEBUG, "ghostscript commandline built: %s", gscall);
+    gsvalues[0]=Conf_GhostScript;
+    gsvalues[1]=Conf_PDFVer;
+    gsvalues[2]=outfile;
+    gsvalues[3]=(input_is_streamed || spool_compressed)?"-":spoolfile;
+    gsargv=build_argv(gsformat, gsvalues, 4);
+    if (gsargv == NULL)
+      log_event(CPDEBUG, "ghostscript commandline needs a shell");
   }
-
-  log_event(CPDEBUG, "ghostscript commandline built: %s", gscall);
+  else
+    log_event(CPDEBUG, "PDF passthrough, no ghostscript call needed");
 
   (void) unlink(outfile);
   log_event(CPDEBUG, "output file unlinked: %s", outfile);
 
   if (putenv(Conf_GSTmp)) {
     log_event(CPERROR, "insufficient space in environment to set TMPDIR: %s", Conf_GSTmp);
-    if (unlink(spoolfile))
+    if (input_is_pdf || input_is_streamed)
+      (void) fclose(fpsrc);
+    else if (remove_spoolfile(spoolfile))
       log_event(CPERROR, "failed to unlink spoolfile during clean-up: %s", spoolfile);
     free(groups);
     free(dirname);
     free(spoolfile);
     free(outfile);
     free(gscall);
-    if (logfp!=NULL)
-      (void) fclose(logfp);
+    free_argv(gsargv);
+    log_close();
     return 5;
   }
   log_event(CPDEBUG, "TMPDIR set for GhostScript: %s", getenv("TMPDIR"));
 
+  if ((input_is_streamed || spool_compressed) && pipe(pipefd)) {
+    log_event(CPERROR, "failed to create pipe to GhostScript");
+    if (input_is_streamed)
+      (void) fclose(fpsrc);
+    else if (remove_spoolfile(spoolfile))
+      log_event(CPERROR, "failed to unlink spoolfile during clean-up: %s", spoolfile);
+    free(groups);
+    free(dirname);
+    free(spoolfile);
+    free(outfile);
+    free(gscall);
+    free_argv(gsargv);
+    log_close();
+    return 5;
+  }
+
+  if (!input_is_pdf && !input_is_streamed) {
+    path=(parallel_ranges())?P_PARALLEL:((strlen(Conf_GSDaemon))?P_DAEMON:P_GSCALL);
+    cachefd=cache_lookup(&fillfd, passwd->pw_uid, gsformat, path);
+    if (cachefd >= 0)
+      cache="hit";
+    else if (fillfd >= 0)
+      cache="miss";
+  }
+
+  if (Conf_MaxConverters && !input_is_pdf && cachefd < 0) {
+    trace_begin(T_ADMIT);
+    if (spool_compressed)
+      slotfd=converter_admit(spool_offset);
+    else if (!input_is_streamed)
+      slotfd=converter_admit((!stat(spoolfile, &fstatus))?fstatus.st_size:0);
+    else if (!fstat(fileno(fpsrc), &fstatus) && S_ISREG(fstatus.st_mode))
+      slotfd=converter_admit(fstatus.st_size);
+    else
+      slotfd=converter_admit(ADMIT_UNKNOWN);
+    /* each page range of a parallel conversion holds a slot of its own */
+    if (slotfd >= 0 && path == P_PARALLEL)
+      nrangefds=converter_extra(rangefds, parallel_ranges()-1);
+    trace_end(T_ADMIT);
+  }
+  ranges=(slotfd >= 0)?nrangefds+1:parallel_ranges();
+
+  trace_share();
+  log_flush();
   pid=fork();
 
   if (!pid) {
     log_event(CPDEBUG, "entering child process");
 
+    if (input_is_streamed || spool_compressed) {
+      if (input_is_streamed)
+        (void) fclose(fpsrc);
+      /* with the job read from stdin, the pipe may already be stdin */
+      if (pipefd[0] != STDIN_FILENO) {
+        if (dup2(pipefd[0], STDIN_FILENO) < 0)
+          log_event(CPERROR, "failed to connect pipe to GhostScript");
+        (void) close(pipefd[0]);
+      }
+      (void) close(pipefd[1]);
+    }
+
+    if (!input_is_pdf && cachefd < 0)
+      converter_limits();
+    if (!input_is_pdf && cachefd < 0 && (input_is_streamed || ranges < 2))
+      gsdfd=gsd_connect();
     if (setgid(passwd->pw_gid))
       log_event(CPERROR, "failed to set GID for current user");
     else
@@ -1070,14 +6026,64 @@ int main(int argc, char *argv[]) {
       log_event(CPDEBUG, "UID set for current user: %s", passwd->pw_name);
 
     (void) umask(0077);
-    size=system(gscall);
-    log_event(CPDEBUG, "ghostscript has finished: %d", size);
+    trace_begin(T_CONVERT);
+    if (input_is_pdf) {
+      size=passthrough_pdf(fpsrc, outfile);
+      log_event(CPDEBUG, "PDF passthrough has finished: %d", size);
+    }
+    else if (cachefd >= 0) {
+      size=cache_copy(cachefd, outfile, 1);
+      log_event(CPDEBUG, "output copied from conversion cache: %d", size);
+    }
+    else {
+      if (spool_memfd >= 0) {
+        /* GhostScript opens the memory spool by its /proc path, the daemon
+           gets it as standard input */
+        (void) fcntl(spool_memfd, F_SETFD, 0);
+        if (lseek(spool_memfd, 0, SEEK_SET) || dup2(spool_memfd, STDIN_FILENO) < 0)
+          log_event(CPERROR, "failed to pass memory spool as standard input");
+      }
+      size=(input_is_streamed)?-1:convert_parallel(spoolfile, outfile, gsformat, ranges);
+      converted=P_PARALLEL;
+      if (size < 0) {
+        size=convert_with_daemon(gsdfd, outfile, (input_is_streamed || spool_compressed || spool_memfd >= 0)?
+                                                 NULL:spoolfile);
+        converted=P_DAEMON;
+      }
+      if (size < 0) {
+        size=run_command(gsargv, gscall);
+        converted=P_GSCALL;
+        log_event(CPDEBUG, "ghostscript has finished: %d", size);
+      }
+      if (!size && fillfd >= 0 && converted == P_PARALLEL && ranges < parallel_ranges())
+        log_event(CPDEBUG, "converted in %d of %d page ranges, not cached", ranges, parallel_ranges());
+      else if (!size && fillfd >= 0 && converted != path)
+        log_event(CPDEBUG, "converted on path %s instead of %s, not cached", convert_path_names[converted],
+                  convert_path_names[path]);
+      else if (!size && fillfd >= 0 && cache_copy(fillfd, outfile, 0)) {
+        log_event(CPERROR, "failed to fill cache entry: %s (non fatal)", cache_tmp);
+        size=1;
+      }
+    }
+    trace_end(T_CONVERT);
+    if (slotfd >= 0)
+      (void) close(slotfd);
+    while (nrangefds--)
+      (void) close(rangefds[nrangefds]);
+    if (spool_memfd >= 0)
+      (void) close(spool_memfd);
+    status=size;
+    trace_begin(T_CHMOD);
     if (chmod(outfile, mode))
       log_event(CPERROR, "failed to set file mode for PDF file: %s (non fatal)", outfile);
     else
       log_event(CPDEBUG, "file mode set for user output: %s", outfile);
+    trace_end(T_CHMOD);
 
-    if (strlen(Conf_PostProcessing)) {
+    if (strlen(Conf_PostProcessing) && strlen(Conf_PostProcessingQueue))
+      log_event(CPDEBUG, "postprocessing left to the queue");
+    else if (strlen(Conf_PostProcessing)) {
+      trace_begin(T_POSTPROCESS);
       size=strlen(Conf_PostProcessing)+strlen(outfile)+strlen(passwd->pw_name)+strlen(argv[2])+4;
       ppcall=calloc(size, sizeof(char));
       if (ppcall == NULL)
@@ -1090,16 +6096,59 @@ int main(int argc, char *argv[]) {
         log_event(CPDEBUG, "postprocessing has finished: %s", title);
         free(ppcall);
       }
+      trace_end(T_POSTPROCESS);
     }
     else
      log_event(CPDEBUG, "no postprocessing");
 
-    return 0;
+    return (status)?1:0;
+  }
+  if (slotfd >= 0)
+    (void) close(slotfd);
+  while (nrangefds--)
+    (void) close(rangefds[nrangefds]);
+  if (input_is_streamed) {
+    (void) close(pipefd[0]);
+    (void) signal(SIGPIPE, SIG_IGN);
+    trace_begin(T_STREAM);
+    stream_postscript(fpsrc, pipefd[1]);
+    trace_end(T_STREAM);
   }
+  else if (spool_compressed) {
+    (void) close(pipefd[0]);
+    (void) signal(SIGPIPE, SIG_IGN);
+    if (cachefd < 0) {
+      trace_begin(T_STREAM);
+      stream_spool(spoolfile, pipefd[1]);
+      trace_end(T_STREAM);
+    }
+    else
+      (void) close(pipefd[1]);
+  }
+
   log_event(CPDEBUG, "waiting for child to exit");
-  (void) waitpid(pid,NULL,0);
+  trace_begin(T_WAIT);
+  if (wait4(pid, &status, 0, &usage) < 0)
+    memset(&usage, 0, sizeof(usage));
+  trace_end(T_WAIT);
+  trace->spool_bytes=spool_offset;
+  if (!stat(outfile, &fstatus))
+    trace->output_bytes=fstatus.st_size;
+  if (strlen(Conf_PostProcessing) && strlen(Conf_PostProcessingQueue)) {
+    trace_begin(T_POSTPROCESS);
+    if (!postprocess_enqueue(outfile, passwd->pw_name, argv[2]))
+      postprocess_drain();
+    trace_end(T_POSTPROCESS);
+  }
+  cache_store(fillfd, WIFEXITED(status) && !WEXITSTATUS(status));
+  if (cachefd >= 0)
+    (void) close(cachefd);
 
-  if (unlink(spoolfile))
+  if (input_is_pdf)
+    (void) fclose(fpsrc);
+  else if (input_is_streamed)
+    log_event(CPDEBUG, "no spoolfile used");
+  else if (remove_spoolfile(spoolfile))
     log_event(CPERROR, "failed to unlink spoolfile: %s (non fatal)", spoolfile);
   else
     log_event(CPDEBUG, "spoolfile unlinked: %s", spoolfile);
@@ -1109,12 +6158,336 @@ int main(int argc, char *argv[]) {
   free(spoolfile);
   free(outfile);
   free(gscall);
+  free_argv(gsargv);
+  free(job_pages);
+  free(user_cache);
 
   log_event(CPDEBUG, "all memory has been freed");
 
   log_event(CPSTATUS, "PDF creation successfully finished for %s", passwd->pw_name);
+  trace_write(argv[1], passwd->pw_name, cache, (WIFEXITED(status))?WEXITSTATUS(status):-1, &usage);
 
-  if (logfp!=NULL)
-    (void) fclose(logfp);
+  log_close();
+  return 0;
+}
+
+static int forward_job(int argc, char *argv[]) {
+  /* hands the job to a running cups-pdf server and relays its exit code;
+     returns -1 if no server is listening and the job has to be handled
+     by this process */
+  struct sockaddr_un addr;
+  struct server_request request;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(3*sizeof(int))], *payload=NULL;
+  size_t len=0;
+  FILE *fp;
+  int fd, fds[3]={ STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO }, status, i;
+
+  fd=socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path, CP_SERVER_SOCKET);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    (void) close(fd);
+    return -1;
+  }
+
+  fp=open_memstream(&payload, &len);
+  if (fp == NULL) {
+    (void) close(fd);
+    return -1;
+  }
+  for (i=0; i<argc; i++)
+    (void) fwrite(argv[i], sizeof(char), strlen(argv[i])+1, fp);
+  for (i=0; environ[i] != NULL; i++)
+    (void) fwrite(environ[i], sizeof(char), strlen(environ[i])+1, fp);
+  if (fclose(fp) || len > SERVER_MAXREQUEST) {
+    free(payload);
+    (void) close(fd);
+    return -1;
+  }
+  request.version=SERVER_VERSION;
+  request.argc=argc;
+  request.envc=i;
+  request.length=len;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base=&request;
+  iov.iov_len=sizeof(request);
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  msg.msg_control=control;
+  msg.msg_controllen=sizeof(control);
+  cmsg=CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level=SOL_SOCKET;
+  cmsg->cmsg_type=SCM_RIGHTS;
+  cmsg->cmsg_len=CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof(request)) {
+    free(payload);
+    (void) close(fd);
+    return -1;
+  }
+  /* from here on the server owns the job */
+  if (send(fd, payload, len, MSG_NOSIGNAL) != (ssize_t) len ||
+      recv(fd, &status, sizeof(status), MSG_WAITALL) != (ssize_t) sizeof(status)) {
+    (void) fputs("CUPS-PDF: lost connection to cups-pdf server\n", stderr);
+    status=5;
+  }
+  free(payload);
+  (void) close(fd);
+  return status;
+}
+
+static int receive_job(int fd, char ***args, int *nargs, char **payload) {
+  /* reads a job from the backend, installs its environment and standard
+     file descriptors and returns its argv */
+  struct server_request request;
+  struct ucred cred;
+  socklen_t credlen=sizeof(cred);
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(3*sizeof(int))], *ptr;
+  int fds[3]={ -1, -1, -1 }, i;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) || cred.uid) {
+    log_event(CPERROR, "rejecting job from unprivileged client: uid %d", (int) cred.uid);
+    return 1;
+  }
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base=&request;
+  iov.iov_len=sizeof(request);
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  msg.msg_control=control;
+  msg.msg_controllen=sizeof(control);
+  if (recvmsg(fd, &msg, MSG_WAITALL) != (ssize_t) sizeof(request))
+    return 1;
+  for (cmsg=CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg=CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  if (request.version != SERVER_VERSION || request.argc < 1 || request.envc < 0 ||
+      request.length < 1 || request.length > SERVER_MAXREQUEST || fds[0] < 0) {
+    for (i=0; i<3; i++)
+      if (fds[i] >= 0)
+        (void) close(fds[i]);
+    return 1;
+  }
+  for (i=0; i<3; i++) {
+    (void) dup2(fds[i], i);
+    if (fds[i] > STDERR_FILENO)
+      (void) close(fds[i]);
+  }
+
+  *payload=malloc(request.length+1);
+  *args=calloc(request.argc+1, sizeof(char *));
+  if (*payload == NULL || *args == NULL ||
+      recv(fd, *payload, request.length, MSG_WAITALL) != request.length)
+    return 1;
+  (*payload)[request.length]='\0';
+  ptr=*payload;
+  for (i=0; i<request.argc && ptr < *payload+request.length; i++) {
+    (*args)[i]=ptr;
+    ptr+=strlen(ptr)+1;
+  }
+  *nargs=i;
+  (void) clearenv();
+  for (i=0; i<request.envc && ptr < *payload+request.length; i++) {
+    if (strchr(ptr, '=') != NULL)
+      (void) putenv(ptr);
+    ptr+=strlen(ptr)+1;
+  }
+  return (*nargs != request.argc);
+}
+
+static void serve_child(int sig) {
+  (void) sig;
+  return;
+}
+
+static int serve_watch(int fd, pid_t job, sigset_t *waiting) {
+  /* waits for the job; CUPS cancels a job by terminating the backend that
+     handed it over, so the job's process group is terminated as soon as
+     that backend has gone away */
+  struct pollfd pfd;
+  char c;
+  int status;
+
+  while (waitpid(job, &status, WNOHANG) == 0) {
+    pfd.fd=fd;
+    pfd.events=POLLIN;
+    if (ppoll(&pfd, 1, NULL, waiting) > 0 && recv(fd, &c, 1, MSG_DONTWAIT) == 0) {
+      log_event(CPSTATUS, "backend gone, job cancelled: process group %d", (int) job);
+      (void) kill(-job, SIGTERM);
+      (void) waitpid(job, &status, 0);
+      return 5;
+    }
+  }
+  return (WIFEXITED(status))?WEXITSTATUS(status):5;
+}
+
+static void serve_worker(int listenfd) {
+  /* handles a single job in a forked process: the job runs in a child of
+     its own process group, which drops its privileges in a further child
+     just like the standalone backend */
+  struct sigaction action;
+  sigset_t blocked, waiting;
+  char **args=NULL, *payload=NULL;
+  pid_t job;
+  int fd, nargs=0, status=5;
+
+  (void) prctl(PR_SET_PDEATHSIG, SIGTERM);
+  fd=accept(listenfd, NULL, NULL);
+  if (fd < 0)
+    _exit(1);
+  (void) prctl(PR_SET_PDEATHSIG, 0);
+  (void) close(listenfd);
+  (void) signal(SIGTERM, SIG_DFL);
+  (void) signal(SIGINT, SIG_DFL);
+  if (!receive_job(fd, &args, &nargs, &payload)) {
+    if (nargs < 6 || nargs > 7)
+      (void) fputs("Usage: cups-pdf job-id user title copies options [file]\n", stderr);
+    else {
+      memset(&action, 0, sizeof(action));
+      action.sa_handler=serve_child;
+      (void) sigaction(SIGCHLD, &action, NULL);
+      (void) sigemptyset(&blocked);
+      (void) sigaddset(&blocked, SIGCHLD);
+      (void) sigprocmask(SIG_BLOCK, &blocked, &waiting);
+      job=fork();
+      if (!job) {
+        (void) setpgid(0, 0);
+        (void) close(fd);
+        (void) signal(SIGCHLD, SIG_DFL);
+        (void) sigprocmask(SIG_SETMASK, &waiting, NULL);
+        exit(backend(nargs, args));
+      }
+      if (job > 0) {
+        (void) setpgid(job, job);
+        status=serve_watch(fd, job, &waiting);
+      }
+    }
+  }
+  (void) send(fd, &status, sizeof(status), MSG_NOSIGNAL);
+  (void) close(fd);
+  free(args);
+  free(payload);
+  exit(0);
+}
+
+static volatile sig_atomic_t serve_terminate=0;
+
+static void serve_signal(int sig) {
+  (void) sig;
+  serve_terminate=1;
+  return;
+}
+
+static int serve(int argc, char *argv[]) {
+  /* cups-pdf --server [-s socket] [-n workers]: keeps a pool of forked
+     workers accepting jobs from backends; a socket passed by systemd
+     socket activation is used instead of creating one */
+  struct sockaddr_un addr;
+  struct sigaction action;
+  cp_string conffile;
+  char *socketname=CP_SERVER_SOCKET;
+  int workers=4, running=0, listenfd=-1, i;
+  pid_t pid;
+
+  for (i=2; i<argc; i++) {
+    if (!strcmp(argv[i], "-s") && i+1 < argc)
+      socketname=argv[++i];
+    else if (!strcmp(argv[i], "-n") && i+1 < argc)
+      workers=(atoi(argv[++i]) > 0)?atoi(argv[i]):1;
+    else {
+      (void) fputs("Usage: cups-pdf --server [-s socket] [-n workers]\n", stderr);
+      return 1;
+    }
+  }
+
+  if (getenv("LISTEN_FDS") != NULL && getenv("LISTEN_PID") != NULL &&
+      atoi(getenv("LISTEN_PID")) == (int) getpid() && atoi(getenv("LISTEN_FDS")) >= 1) {
+    listenfd=3;
+    (void) unsetenv("LISTEN_FDS");
+    (void) unsetenv("LISTEN_PID");
+    socketname=NULL;
+  }
+  else {
+    if (strlen(socketname) >= sizeof(addr.sun_path)) {
+      (void) fputs("CUPS-PDF: socket name too long\n", stderr);
+      return 1;
+    }
+    listenfd=socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strcpy(addr.sun_path, socketname);
+    (void) unlink(socketname);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        chmod(socketname, 0600) || listen(listenfd, 64)) {
+      (void) fprintf(stderr, "CUPS-PDF: failed to create socket: %s\n", socketname);
+      return 1;
+    }
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler=serve_signal;
+  (void) sigaction(SIGTERM, &action, NULL);
+  (void) sigaction(SIGINT, &action, NULL);
+
+  /* the configuration of the default printer; jobs of printers with a
+     configuration of their own use their snapshot */
+  snprintf(conffile, BUFSIZE, "%s/cups-pdf.conf", CP_CONFIG_PATH);
+  while (!serve_terminate) {
+    server_config(conffile);
+    while (running < workers) {
+      pid=fork();
+      if (!pid)
+        serve_worker(listenfd);
+      if (pid < 0) {
+        (void) fputs("CUPS-PDF: failed to fork server worker\n", stderr);
+        (void) sleep(1);
+        break;
+      }
+      running++;
+    }
+    if (wait(NULL) > 0)
+      running--;
+    else if (errno == ECHILD)
+      running=0;
+  }
+
+  if (socketname != NULL)
+    (void) unlink(socketname);
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  int status;
+
+  if (setuid(0)) {
+    (void) fputs("CUPS-PDF cannot be called without root privileges!\n", stderr);
+    return 0;
+  }
+
+  if (argc==1) {
+    announce_printers();
+    return 0;
+  }
+  if (!strcmp(argv[1], "--server"))
+    return serve(argc, argv);
+  if (argc<6 || argc>7) {
+    (void) fputs("Usage: cups-pdf job-id user title copies options [file]\n", stderr);
+    return 0;
+  }
+
+  status=forward_job(argc, argv);
+  if (status >= 0)
+    return status;
+  return backend(argc, argv);
+}
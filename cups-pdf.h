@@ -20,6 +20,13 @@
 /* location of the configuration file */
 #define CP_CONFIG_PATH "/etc/cups"
 
+/* location of the precompiled configuration snapshots */
+#define CP_SNAPSHOT_PATH "/var/cache/cups"
+
+/* socket of the cups-pdf server (cups-pdf --server), jobs are handled by
+   the backend itself if no server is listening */
+#define CP_SERVER_SOCKET "/run/cups-pdf.sock"
+
 
 /* --- DO NOT EDIT BELOW THIS LINE --- */
 
@@ -37,6 +44,71 @@
 
 typedef char cp_string[BUFSIZE];
 
+/* request sent to the GhostScript daemon (cups-pdf-gsd) with the
+/  credentials to convert it with; the daemon takes the job by answering
+/  0, the backend confirms this with an int of its own and then waits for
+/  the int exit code of the conversion; every step before the conversion
+/  has to be done within GSD_TIMEOUT seconds				*/
+
+#define GSD_VERSION 2
+#define GSD_TIMEOUT 10
+
+struct gsd_request {
+  int version;
+  char pdfver[16];
+  cp_string outfile;
+  cp_string infile;             /* "-" if passed as a file descriptor */
+};
+
+/* job handed from the backend to the cups-pdf server: followed by the
+/  NUL terminated argv and environment strings, stdin, stdout and stderr
+/  are passed along as file descriptors; the server answers with the
+/  int exit code of the job						*/
+
+#define SERVER_VERSION 1
+#define SERVER_MAXREQUEST 1048576
+
+struct server_request {
+  int version;
+  int argc;
+  int envc;
+  int length;                   /* of the strings following the request */
+};
+
+/* index of the DSC structure of a spooled job, stored next to the spool
+/  file as <spoolfile>.idx: the header below followed by npages long long
+/  offsets of the top-level %%Page: comments; offsets of missing comments
+/  and a missing %%Pages: count are -1. offsets always refer to the
+/  postscript code, also if the spool file has been compressed		*/
+
+#define DSC_INDEX_VERSION 1
+
+struct dsc_index {
+  int version;
+  int conforming;               /* %!PS-Adobe- header, sequential %%Page: */
+  int npages;
+  int declared_pages;           /* %%Pages: */
+  int max_depth;                /* deepest nesting of embedded documents */
+  int has_bbox;
+  int bbox[4];                  /* %%BoundingBox: */
+  long long prolog;             /* %%BeginProlog */
+  long long setup_end;          /* %%EndSetup */
+  long long trailer;            /* %%Trailer */
+  char creator[128];            /* %%Creator: */
+  char user[128];               /* %%For: */
+};
+
+/* job captured for replay (see Capture): a directory named
+/  <seconds>.<microseconds>-<job id>-<pid> after its arrival, holding
+/  argv and environ (NUL terminated strings, the environment limited to
+/  what CUPS tells a backend about the job), config (the final
+/  configuration as dumped to the debug log) and input (the job data)	*/
+
+#define CAPTURE_ARGV    "argv"
+#define CAPTURE_ENVIRON "environ"
+#define CAPTURE_CONFIG  "config"
+#define CAPTURE_INPUT   "input"
+
 
 #define SEC_CONF  1
 #define SEC_PPD   2
@@ -44,7 +116,7 @@ typedef char cp_string[BUFSIZE];
 
 /* order in the enum and the struct-array has to be identical! */
 
-enum configOptions { AnonDirName, AnonUser, GhostScript, GSCall, Grp, GSTmp, Log, PDFVer, PostProcessing, Out, Spool, UserPrefix, RemovePrefix, OutExtension, Cut, Truncate, DirPrefix, Label, LogType, LowerCase, TitlePref, DecodeHexStrings, FixNewlines, AllowUnsafeOptions, AnonUMask, UserUMask, END_OF_OPTIONS };
+enum configOptions { AnonDirName, AnonUser, GhostScript, GSCall, Grp, GSTmp, Log, PDFVer, PostProcessing, Out, Spool, UserPrefix, RemovePrefix, OutExtension, Cut, Truncate, DirPrefix, Label, LogType, LowerCase, TitlePref, DecodeHexStrings, FixNewlines, AllowUnsafeOptions, AnonUMask, UserUMask, StreamPostScript, GSDaemon, ConversionCache, ConversionCacheSize, ParallelWorkers, ParallelMinPages, TraceFile, LogRotateSize, UserCacheTTL, PostProcessingQueue, PostProcessingWorkers, PostProcessingTimeout, PDFOptimize, PDFOptimizeThreads, MaxConverters, ConverterLocks, ConverterWeight, ConverterNice, ConverterCPUs, GSProfileText, GSProfileImage, GSProfileLarge, SpoolMemory, SpoolCompress, Capture, CaptureRate, END_OF_OPTIONS };
 
 struct {
   char *key_name;
@@ -81,6 +153,32 @@ struct {
   { "AllowUnsafeOptions", SEC_CONF|SEC_PPD, {{ 0 }} },
   { "AnonUmask", SEC_CONF|SEC_PPD, {{ 0000 }} },
   { "UserUMask", SEC_CONF|SEC_PPD|SEC_LPOPT, {{ 0077 }} },
+  { "StreamPostScript", SEC_CONF|SEC_PPD, {{ 0 }} },
+  { "GSDaemon", SEC_CONF|SEC_PPD, { "" } },
+  { "ConversionCache", SEC_CONF, { "" } },
+  { "ConversionCacheSize", SEC_CONF, { .ival = 256 } },
+  { "ParallelWorkers", SEC_CONF|SEC_PPD, {{ 0 }} },
+  { "ParallelMinPages", SEC_CONF|SEC_PPD, {{ 100 }} },
+  { "TraceFile", SEC_CONF, { "" } },
+  { "LogRotateSize", SEC_CONF, {{ 0 }} },
+  { "UserCacheTTL", SEC_CONF, {{ 0 }} },
+  { "PostProcessingQueue", SEC_CONF, { "" } },
+  { "PostProcessingWorkers", SEC_CONF, {{ 2 }} },
+  { "PostProcessingTimeout", SEC_CONF, { .ival = 600 } },
+  { "PDFOptimize", SEC_CONF|SEC_PPD, {{ 0 }} },
+  { "PDFOptimizeThreads", SEC_CONF, {{ 4 }} },
+  { "MaxConverters", SEC_CONF, {{ 0 }} },
+  { "ConverterLocks", SEC_CONF, { "/var/spool/cups-pdf/SLOTS" } },
+  { "ConverterWeight", SEC_CONF, {{ 1 }} },
+  { "ConverterNice", SEC_CONF, {{ 0 }} },
+  { "ConverterCPUs", SEC_CONF, { "" } },
+  { "GSProfileText", SEC_CONF, { "" } },
+  { "GSProfileImage", SEC_CONF, { "" } },
+  { "GSProfileLarge", SEC_CONF, { "" } },
+  { "SpoolMemory", SEC_CONF, {{ 0 }} },
+  { "SpoolCompress", SEC_CONF, {{ 0 }} },
+  { "Capture", SEC_CONF, { "" } },
+  { "CaptureRate", SEC_CONF, { .ival = 100 } },
 };
 
 #define Conf_AnonDirName          configData[AnonDirName].value.sval
@@ -109,3 +207,29 @@ struct {
 #define Conf_AllowUnsafeOptions   configData[AllowUnsafeOptions].value.ival
 #define Conf_AnonUMask            configData[AnonUMask].value.modval
 #define Conf_UserUMask            configData[UserUMask].value.modval
+#define Conf_StreamPostScript     configData[StreamPostScript].value.ival
+#define Conf_GSDaemon             configData[GSDaemon].value.sval
+#define Conf_ConversionCache      configData[ConversionCache].value.sval
+#define Conf_ConversionCacheSize  configData[ConversionCacheSize].value.ival
+#define Conf_ParallelWorkers      configData[ParallelWorkers].value.ival
+#define Conf_ParallelMinPages     configData[ParallelMinPages].value.ival
+#define Conf_TraceFile            configData[TraceFile].value.sval
+#define Conf_LogRotateSize        configData[LogRotateSize].value.ival
+#define Conf_UserCacheTTL         configData[UserCacheTTL].value.ival
+#define Conf_PostProcessingQueue  configData[PostProcessingQueue].value.sval
+#define Conf_PostProcessingWorkers configData[PostProcessingWorkers].value.ival
+#define Conf_PostProcessingTimeout configData[PostProcessingTimeout].value.ival
+#define Conf_PDFOptimize          configData[PDFOptimize].value.ival
+#define Conf_PDFOptimizeThreads   configData[PDFOptimizeThreads].value.ival
+#define Conf_MaxConverters        configData[MaxConverters].value.ival
+#define Conf_ConverterLocks       configData[ConverterLocks].value.sval
+#define Conf_ConverterWeight      configData[ConverterWeight].value.ival
+#define Conf_ConverterNice        configData[ConverterNice].value.ival
+#define Conf_ConverterCPUs        configData[ConverterCPUs].value.sval
+#define Conf_GSProfileText        configData[GSProfileText].value.sval
+#define Conf_GSProfileImage       configData[GSProfileImage].value.sval
+#define Conf_GSProfileLarge       configData[GSProfileLarge].value.sval
+#define Conf_SpoolMemory          configData[SpoolMemory].value.ival
+#define Conf_SpoolCompress        configData[SpoolCompress].value.ival
+#define Conf_Capture              configData[Capture].value.sval
+#define Conf_CaptureRate          configData[CaptureRate].value.ival